@@ -0,0 +1,81 @@
+//
+// FSProto.h
+//
+// The wire protocol between the file system daemon (fsd) and its
+// clients (LibFSClient). Every LibFS call becomes one request and one
+// reply over a Unix domain socket; all integers are in host byte order
+// since both ends always live on the same machine.
+//
+
+#ifndef __FSProto_H__
+#define __FSProto_H__
+
+// the daemon listens on "<disk image>.sock" unless told otherwise
+#define FSP_SOCKET_SUFFIX ".sock"
+
+// the largest payload carried by a single request or reply
+#define FSP_MAX_DATA (1<<20)
+
+// the size of a directory entry as returned by Dir_Read and Dir_Next
+// (a 16-byte name followed by the inode)
+#define FSP_DIRENT_SIZE 20
+
+// operations; the arguments and payloads each one uses are noted
+typedef enum {
+  FSP_HELLO,          // (handshake)
+  FSP_SYNC,
+  FSP_SNAPSHOT,
+  FSP_ROLLBACK,       // arg0 = snapshot
+  FSP_RELEASE,        // arg0 = snapshot
+  FSP_FILE_CREATE,    // path0
+  FSP_FILE_OPEN,      // path0
+  FSP_FILE_READ,      // arg0 = fd, arg1 = size; reply data = bytes read
+  FSP_FILE_WRITE,     // arg0 = fd; data = bytes to write
+  FSP_FILE_SEEK,      // arg0 = fd, arg1 = offset
+  FSP_FILE_CLOSE,     // arg0 = fd
+  FSP_FILE_UNLINK,    // path0
+  FSP_DIR_CREATE,     // path0
+  FSP_DIR_UNLINK,     // path0
+  FSP_DIR_SIZE,       // path0
+  FSP_DIR_READ,       // path0, arg1 = size; reply data = dirents
+  FSP_DIR_OPEN,       // path0
+  FSP_DIR_NEXT,       // arg0 = dd, arg1 = max; reply data = dirents
+  FSP_DIR_NEXT_PLUS,  // arg0 = dd, arg1 = max; reply data = Dir_Entry_t's
+  FSP_DIR_CLOSE,      // arg0 = dd
+  FSP_DIR_UNLINK_TREE,// path0
+  FSP_DIR_USAGE,      // path0; reply data = Dir_Usage_t
+  FSP_FILE_RENAME,    // path0 = old path, path1 = new path
+  FSP_DIR_RENAME,     // path0 = old path, path1 = new path
+  FSP_STAT,           // reply data = FS_Stat_t
+  FSP_DEFRAG,         // reply data = FS_Defrag_t
+  FSP_FILE_TRUNCATE,  // arg0 = fd, arg1 = size
+  FSP_FILE_PREALLOCATE,// arg0 = fd, arg1 = size
+  FSP_FILE_SEEK_DATA, // arg0 = fd, arg1 = offset
+  FSP_FILE_SEEK_HOLE, // arg0 = fd, arg1 = offset
+  FSP_FILE_CLONE,     // path0 = source, path1 = new file
+  FSP_DEDUP,          // reply data = FS_Dedup_t
+  FSP_SET_DEDUP,      // arg0 = on
+  FSP_FILE_COMPRESS,  // path0, arg0 = on
+} fsp_op_t;
+
+// a request is this header followed by 'len0' bytes of the first path,
+// 'len1' bytes of the second path and 'datalen' bytes of data; paths
+// are sent without their terminating null
+typedef struct fsp_request {
+  int op;
+  int arg0;
+  int arg1;
+  int len0;
+  int len1;
+  int datalen;
+} fsp_request_t;
+
+// a reply is this header followed by 'datalen' bytes of data; 'ret' is
+// what the LibFS call returned and 'err' the osErrno it left behind
+typedef struct fsp_reply {
+  int ret;
+  int err;
+  int datalen;
+} fsp_reply_t;
+
+#endif // __FSProto_H__
@@ -0,0 +1,152 @@
+#include <string.h>
+#include "LZ.h"
+
+// The compressed stream is a sequence of
+//
+//   token | [literal length bytes] | literals | offset | [match length bytes]
+//
+// where the token holds the literal length in its high nibble and the
+// match length (minus LZ_MIN_MATCH) in its low nibble; a nibble of 15
+// is continued by bytes that are added to it until a byte below 255.
+// The offset is two bytes (little endian) back from the current output
+// position. The last sequence carries literals only and has no offset.
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+static unsigned int read32(const unsigned char* p)
+{
+  unsigned int v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static unsigned int lz_hash(unsigned int v)
+{
+  return (v*2654435761u) >> (32-LZ_HASH_BITS);
+}
+
+// append an extended length; return the new output position or NULL
+// if there's no room
+static unsigned char* put_length(unsigned char* op, unsigned char* oend, int len)
+{
+  while(len >= 255) {
+    if(op >= oend) return NULL;
+    *op++ = 255;
+    len -= 255;
+  }
+  if(op >= oend) return NULL;
+  *op++ = (unsigned char)len;
+  return op;
+}
+
+// append one sequence; 'mlen' is 0 for the final, literal-only one
+static unsigned char* put_sequence(unsigned char* op, unsigned char* oend,
+                                   const unsigned char* lit, int nlit, int offset, int mlen)
+{
+  if(op >= oend) return NULL;
+  unsigned char* token = op++;
+  int mcode = mlen ? mlen-LZ_MIN_MATCH : 0;
+  *token = (unsigned char)(((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15));
+
+  if(nlit >= 15 && (op = put_length(op, oend, nlit-15)) == NULL) return NULL;
+  if(oend-op < nlit) return NULL;
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if(mlen == 0) return op;
+
+  if(oend-op < 2) return NULL;
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  if(mcode >= 15 && (op = put_length(op, oend, mcode-15)) == NULL) return NULL;
+  return op;
+}
+
+int LZ_Compress(const char* src, int n, char* dst, int cap)
+{
+  const unsigned char* base = (const unsigned char*)src;
+  const unsigned char* ip = base;
+  const unsigned char* anchor = base;
+  const unsigned char* end = base+n;
+  unsigned char* op = (unsigned char*)dst;
+  unsigned char* oend = op+cap;
+  int table[1<<LZ_HASH_BITS];
+  memset(table, -1, sizeof(table));
+
+  while(end-ip >= LZ_MIN_MATCH) {
+    unsigned int v = read32(ip);
+    unsigned int h = lz_hash(v);
+    int ref = table[h];
+    table[h] = (int)(ip-base);
+    if(ref < 0 || (ip-base)-ref > LZ_MAX_OFFSET || read32(base+ref) != v) {
+      ip++;
+      continue;
+    }
+
+    // extend the match as far as it goes
+    const unsigned char* m = base+ref+LZ_MIN_MATCH;
+    const unsigned char* p = ip+LZ_MIN_MATCH;
+    while(p < end && *p == *m) { p++; m++; }
+
+    op = put_sequence(op, oend, anchor, (int)(ip-anchor), (int)((ip-base)-ref), (int)(p-ip));
+    if(op == NULL) return -1;
+    ip = anchor = p;
+  }
+
+  op = put_sequence(op, oend, anchor, (int)(end-anchor), 0, 0);
+  if(op == NULL) return -1;
+  return (int)(op-(unsigned char*)dst);
+}
+
+// read an extended length; return -1 if the input runs out
+static int get_length(const unsigned char** ip, const unsigned char* iend)
+{
+  int len = 0;
+  unsigned char b;
+  do {
+    if(*ip >= iend) return -1;
+    b = *(*ip)++;
+    len += b;
+  } while(b == 255);
+  return len;
+}
+
+int LZ_Decompress(const char* src, int n, char* dst, int cap)
+{
+  const unsigned char* ip = (const unsigned char*)src;
+  const unsigned char* iend = ip+n;
+  unsigned char* op = (unsigned char*)dst;
+  unsigned char* oend = op+cap;
+
+  while(ip < iend) {
+    int token = *ip++;
+    int nlit = token >> 4;
+    if(nlit == 15) {
+      int more = get_length(&ip, iend);
+      if(more < 0) return -1;
+      nlit += more;
+    }
+    if(iend-ip < nlit || oend-op < nlit) return -1;
+    memcpy(op, ip, nlit);
+    ip += nlit; op += nlit;
+    if(ip == iend) break; // the final sequence has no match
+
+    if(iend-ip < 2) return -1;
+    int offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    int mlen = token & 15;
+    if(mlen == 15) {
+      int more = get_length(&ip, iend);
+      if(more < 0) return -1;
+      mlen += more;
+    }
+    mlen += LZ_MIN_MATCH;
+    if(offset == 0 || offset > op-(unsigned char*)dst || oend-op < mlen) return -1;
+
+    // the match may overlap the bytes being produced
+    const unsigned char* m = op-offset;
+    while(mlen-- > 0) *op++ = *m++;
+  }
+  return (int)(op-(unsigned char*)dst);
+}
@@ -0,0 +1,24 @@
+//
+// LZ.h
+//
+// A small, fast LZ77-family block codec (in the spirit of LZ4) used
+// for compressed disk images and compressed files.
+//
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+// the worst-case size of the compressed form of 'n' bytes; a buffer of
+// this size is always large enough for LZ_Compress()
+#define LZ_BOUND(n) ((n) + (n)/255 + 16)
+
+// compress 'n' bytes from 'src' into 'dst' (room for 'cap' bytes);
+// return the compressed size, or -1 if it doesn't fit in 'cap'
+int LZ_Compress(const char* src, int n, char* dst, int cap);
+
+// decompress 'n' bytes from 'src' into 'dst' (room for 'cap' bytes);
+// return the decompressed size, or -1 if the input is malformed or
+// the output doesn't fit in 'cap'
+int LZ_Decompress(const char* src, int n, char* dst, int cap);
+
+#endif // __LZ_H__
@@ -1,8 +1,18 @@
+#define _GNU_SOURCE // for fallocate() and SEEK_DATA/SEEK_HOLE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "LibDisk.h"
+#include "LZ.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 typedef struct sector {
   char data[SECTOR_SIZE];
@@ -11,32 +21,1018 @@ typedef struct sector {
 // used to see what happened w/ disk ops
 int diskErrno; 
 
-// the disk in memory (static makes it private to the file)
-static sector_t* disk;
+// the disk in memory (static makes it private to the file); sectors
+// live in reference-counted blocks reached through a two-level map,
+// so that snapshots can share them with the live disk and a sector
+// is copied only when it is first written after a snapshot
+typedef struct block {
+  int refs;          // number of map pages pointing to the block
+  unsigned int crc;  // checksum of the contents
+  int verified;      // checksum checked since the last load
+  sector_t s;
+} block_t;
+
+// the number of sectors covered by one page of the map
+#define MAP_SECTORS 64
+#define MAP_PAGES ((TOTAL_SECTORS+MAP_SECTORS-1)/MAP_SECTORS)
+
+typedef struct map_page {
+  int refs;                     // number of maps pointing to the page
+  block_t* block[MAP_SECTORS];  // NULL means the sector is all zeroes
+} map_page_t;
+
+// a sector map; a NULL page means all of its sectors are zeroes
+typedef map_page_t* sector_map_t[MAP_PAGES];
+
+static sector_map_t disk;
+static int disk_ready; // Disk_Init() has been called
+
+// snapshots of the disk (NULL if the handle is not in use)
+#define MAX_SNAPSHOTS 64
+static sector_map_t* snapshot[MAX_SNAPSHOTS];
 
 // used for statistics
 // static int lastSector = 0;
 // static int seekCount = 0;
 
+/*
+ * Checksums
+ *
+ * Every sector has a CRC32C checksum kept out of band, both in memory
+ * and, when the disk is saved, in a "<image>.crc" file next to the
+ * (first) image file, or next to every member of a mirror. Disk_Write
+ * updates the checksum; Disk_Read verifies it either on every read
+ * (DISK_CRC_VERIFY) or only the first time the sector is read after a
+ * load (DISK_CRC_LAZY). On a mirror, a sector that fails is read again
+ * from the members, and the first copy that matches is kept.
+ */
+
+// CRC32C (Castagnoli) polynomial, bit-reflected
+#define CRC32C_POLY 0x82f63b78
+
+// the sidecar file starts with a magic number followed by one
+// checksum per sector, either as is or LZ-compressed (preceded by
+// the compressed length)
+#define CRC_FILE_MAGIC 0x43524331 // "CRC1", raw checksums
+#define CRC_FILE_MAGIC_LZ 0x43524332 // "CRC2", compressed checksums
+#define CRC_BYTES (TOTAL_SECTORS*sizeof(unsigned int))
+
+static int crc_mode = DISK_CRC_LAZY;
+static unsigned int zero_sector_crc;  // checksum of an all-zero sector
+
+// slice-by-8 lookup tables for the software implementation
+static unsigned int crc_table[8][256];
+
+// tables that advance a raw CRC state over 'len' zero bytes; used to
+// stitch together the three interleaved streams of a sector
+static unsigned int crc_shift_a[4][256]; // over 2*CRC_LANE bytes
+static unsigned int crc_shift_b[4][256]; // over CRC_LANE bytes
+
+// a sector is checksummed as three independent lanes so that the
+// latency of the crc32 instruction is hidden; the first lane takes
+// whatever doesn't divide evenly
+#define CRC_LANE ((SECTOR_SIZE/8/3)*8)
+#define CRC_LANE0 (SECTOR_SIZE-2*CRC_LANE)
+
+static int crc_hw; // the processor has the SSE4.2 crc32 instruction
+
+static unsigned int crc32c_sw(unsigned int crc, const unsigned char* p, size_t n)
+{
+  while(n > 0 && ((size_t)p & 7)) {
+    crc = crc_table[0][(crc^*p++) & 0xff] ^ (crc >> 8);
+    n--;
+  }
+  while(n >= 8) {
+    unsigned long long w;
+    memcpy(&w, p, 8);
+    unsigned int lo = crc ^ (unsigned int)w;
+    unsigned int hi = (unsigned int)(w >> 32);
+    crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+          crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+          crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+          crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    p += 8; n -= 8;
+  }
+  while(n-- > 0)
+    crc = crc_table[0][(crc^*p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+static unsigned int crc_shift(unsigned int t[4][256], unsigned int crc)
+{
+  return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff] ^
+         t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+// checksum a whole sector with three interleaved crc32 streams
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_hw_sector(unsigned int crc, const unsigned char* p)
+{
+  unsigned long long a = crc, b = 0, c = 0;
+  const unsigned char* pb = p+CRC_LANE0;
+  const unsigned char* pc = pb+CRC_LANE;
+  int i;
+  for(i=0; i<CRC_LANE; i+=8) {
+    unsigned long long wa, wb, wc;
+    memcpy(&wa, p+i, 8); memcpy(&wb, pb+i, 8); memcpy(&wc, pc+i, 8);
+    a = _mm_crc32_u64(a, wa);
+    b = _mm_crc32_u64(b, wb);
+    c = _mm_crc32_u64(c, wc);
+  }
+  for(; i<CRC_LANE0; i+=8) {
+    unsigned long long wa;
+    memcpy(&wa, p+i, 8);
+    a = _mm_crc32_u64(a, wa);
+  }
+  // lane 'a' is followed by lanes 'b' and 'c'
+  return crc_shift(crc_shift_a, (unsigned int)a) ^
+         crc_shift(crc_shift_b, (unsigned int)b) ^ (unsigned int)c;
+}
+#endif
+
+// build the tables that advance a CRC state over 'len' zero bytes
+static void crc_shift_init(unsigned int t[4][256], int len)
+{
+  static const unsigned char zeros[2*SECTOR_SIZE];
+  int k, b;
+  for(k=0; k<4; k++)
+    for(b=0; b<256; b++)
+      t[k][b] = crc32c_sw((unsigned int)b << (8*k), zeros, len);
+}
+
+static void crc_init()
+{
+  static int done = 0;
+  if(done) return;
+  int i, k;
+  for(i=0; i<256; i++) {
+    unsigned int c = i;
+    for(k=0; k<8; k++)
+      c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    crc_table[0][i] = c;
+  }
+  for(i=0; i<256; i++)
+    for(k=1; k<8; k++)
+      crc_table[k][i] = (crc_table[k-1][i] >> 8) ^ crc_table[0][crc_table[k-1][i] & 0xff];
+  crc_shift_init(crc_shift_a, 2*CRC_LANE);
+  crc_shift_init(crc_shift_b, CRC_LANE);
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+  done = 1;
+}
+
+// the CRC32C checksum of a sector
+static unsigned int sector_checksum(sector_t* s)
+{
+#if defined(__x86_64__)
+  if(crc_hw) return ~crc32c_hw_sector(~0u, (unsigned char*)s);
+#endif
+  return ~crc32c_sw(~0u, (unsigned char*)s, SECTOR_SIZE);
+}
+
+/*
+ * Sector map
+ */
+
+static void block_put(block_t* b)
+{
+  if(b != NULL && --b->refs == 0) free(b);
+}
+
+static void page_put(map_page_t* pg)
+{
+  if(pg != NULL && --pg->refs == 0) {
+    int i;
+    for(i=0; i<MAP_SECTORS; i++) block_put(pg->block[i]);
+    free(pg);
+  }
+}
+
+// drop every page of a map
+static void map_release(map_page_t** map)
+{
+  int p;
+  for(p=0; p<MAP_PAGES; p++) {
+    page_put(map[p]);
+    map[p] = NULL;
+  }
+}
+
+// make 'dst' share all pages of 'src'
+static void map_share(map_page_t** dst, map_page_t** src)
+{
+  int p;
+  for(p=0; p<MAP_PAGES; p++) {
+    dst[p] = src[p];
+    if(dst[p] != NULL) dst[p]->refs++;
+  }
+}
+
+// the block holding a sector of the live disk; NULL if it is zero
+static block_t* sector_block(int sector)
+{
+  map_page_t* pg = disk[sector/MAP_SECTORS];
+  return pg != NULL ? pg->block[sector%MAP_SECTORS] : NULL;
+}
+
+// the page of the live disk holding 'sector', made private to the
+// live disk (copied if it's shared with a snapshot); NULL if out of
+// memory
+static map_page_t* page_for_write(int sector)
+{
+  int p = sector/MAP_SECTORS;
+  map_page_t* pg = disk[p];
+  if(pg == NULL) {
+    pg = (map_page_t*) calloc(1, sizeof(map_page_t));
+    if(pg == NULL) return NULL;
+    pg->refs = 1;
+    disk[p] = pg;
+  } else if(pg->refs > 1) {
+    map_page_t* copy = (map_page_t*) malloc(sizeof(map_page_t));
+    if(copy == NULL) return NULL;
+    memcpy(copy->block, pg->block, sizeof(pg->block));
+    copy->refs = 1;
+    int i;
+    for(i=0; i<MAP_SECTORS; i++)
+      if(copy->block[i] != NULL) copy->block[i]->refs++;
+    pg->refs--;
+    disk[p] = pg = copy;
+  }
+  return pg;
+}
+
+// a private block about to receive new contents for 'sector'; a block
+// shared with a snapshot is replaced rather than modified
+static block_t* block_for_write(int sector)
+{
+  map_page_t* pg = page_for_write(sector);
+  if(pg == NULL) return NULL;
+  block_t** slot = &pg->block[sector%MAP_SECTORS];
+  if(*slot != NULL && (*slot)->refs == 1) return *slot;
+
+  block_t* b = (block_t*) malloc(sizeof(block_t));
+  if(b == NULL) return NULL;
+  b->refs = 1;
+  block_put(*slot);
+  *slot = b;
+  return b;
+}
+
+static int sector_is_zero(sector_t* s)
+{
+  return s->data[0] == 0 && !memcmp(s->data, s->data+1, SECTOR_SIZE-1);
+}
+
+// copy 'n' sectors starting at 'first' from the disk into 'buf'
+static void gather(int first, int n, char* buf)
+{
+  int i;
+  for(i=0; i<n; i++, buf+=SECTOR_SIZE) {
+    block_t* b = sector_block(first+i);
+    if(b != NULL) memcpy(buf, &b->s, SECTOR_SIZE);
+    else memset(buf, 0, SECTOR_SIZE);
+  }
+}
+
+// copy 'n' sectors from 'buf' into the disk starting at 'first'; zero
+// sectors take no memory; the checksums are left to the caller; return
+// 0 if successful, -1 if out of memory
+static int scatter(int first, int n, char* buf)
+{
+  int i;
+  for(i=0; i<n; i++, buf+=SECTOR_SIZE) {
+    if(sector_is_zero((sector_t*)buf)) {
+      map_page_t* pg = disk[(first+i)/MAP_SECTORS];
+      if(pg != NULL && pg->block[(first+i)%MAP_SECTORS] != NULL) {
+        if((pg = page_for_write(first+i)) == NULL) return -1;
+        block_put(pg->block[(first+i)%MAP_SECTORS]);
+        pg->block[(first+i)%MAP_SECTORS] = NULL;
+      }
+      continue;
+    }
+    block_t* b = block_for_write(first+i);
+    if(b == NULL) return -1;
+    memcpy(&b->s, buf, SECTOR_SIZE);
+    b->verified = 0;
+  }
+  return 0;
+}
+
+// recompute the checksum of every sector from the disk contents
+static void checksum_all()
+{
+  int i;
+  for(i=0; i<TOTAL_SECTORS; i++) {
+    block_t* b = sector_block(i);
+    if(b != NULL) {
+      b->crc = sector_checksum(&b->s);
+      b->verified = 1;
+    }
+  }
+}
+
+// the name of the checksum file that goes with the backing store
+static void crc_filename(char* image, char* name, int size)
+{
+  snprintf(name, size, "%s.crc", image);
+}
+
+// write the checksums next to the image; return 0 if successful
+static int save_checksums(char* image)
+{
+  char name[FILENAME_MAX];
+  crc_filename(image, name, sizeof(name));
+  if(crc_mode == DISK_CRC_OFF) {
+    // checksums are not maintained; don't leave stale ones around
+    unlink(name);
+    return 0;
+  }
+  // most sectors share the checksum of the zero sector, so the
+  // checksums compress about as well as the image does
+  unsigned int* crc = malloc(CRC_BYTES);
+  char* packed = malloc(LZ_BOUND(CRC_BYTES));
+  if(crc == NULL || packed == NULL) {
+    free(crc); free(packed);
+    return -1;
+  }
+  int i;
+  for(i=0; i<TOTAL_SECTORS; i++) {
+    block_t* b = sector_block(i);
+    crc[i] = b != NULL ? b->crc : zero_sector_crc;
+  }
+  int len = LZ_Compress((char*)crc, CRC_BYTES, packed, LZ_BOUND(CRC_BYTES));
+  free(crc);
+
+  FILE* f = fopen(name, "w");
+  if(f == NULL) {
+    free(packed);
+    return -1;
+  }
+  unsigned int magic = CRC_FILE_MAGIC_LZ;
+  int ok = len > 0 &&
+           fwrite(&magic, sizeof(magic), 1, f) == 1 &&
+           fwrite(&len, sizeof(len), 1, f) == 1 &&
+           fwrite(packed, 1, len, f) == len;
+  if(fclose(f) != 0) ok = 0;
+  free(packed);
+  return ok ? 0 : -1;
+}
+
+// read the checksums saved with the image; if there are none, they
+// are recomputed from the (just loaded) contents
+static void load_checksums(char* image)
+{
+  if(crc_mode == DISK_CRC_OFF) return;
+  char name[FILENAME_MAX];
+  crc_filename(image, name, sizeof(name));
+  unsigned int* sector_crc = malloc(CRC_BYTES);
+  FILE* f = fopen(name, "r");
+  unsigned int magic = 0;
+  int ok = sector_crc != NULL && f != NULL && fread(&magic, sizeof(magic), 1, f) == 1;
+  if(ok && magic == CRC_FILE_MAGIC) {
+    ok = fread(sector_crc, sizeof(unsigned int), TOTAL_SECTORS, f) == TOTAL_SECTORS;
+  } else if(ok && magic == CRC_FILE_MAGIC_LZ) {
+    int len = 0;
+    char* packed = NULL;
+    ok = fread(&len, sizeof(len), 1, f) == 1 && len > 0 && len <= LZ_BOUND(CRC_BYTES) &&
+         (packed = malloc(len)) != NULL && fread(packed, 1, len, f) == len &&
+         LZ_Decompress(packed, len, (char*)sector_crc, CRC_BYTES) == CRC_BYTES;
+    free(packed);
+  } else ok = 0;
+  if(f) fclose(f);
+  if(!ok) {
+    free(sector_crc);
+    checksum_all();
+    return;
+  }
+
+  int i;
+  for(i=0; i<TOTAL_SECTORS; i++) {
+    block_t* b = sector_block(i);
+    if(b == NULL) {
+      if(sector_crc[i] == zero_sector_crc) continue;
+      // the sector was expected to hold data; keep the zeroes with
+      // the saved checksum so that reading the sector fails
+      if((b = block_for_write(i)) == NULL) continue;
+      memset(&b->s, 0, SECTOR_SIZE);
+    }
+    // nothing is verified yet: a bad sector is reported by the first
+    // Disk_Read of it
+    b->crc = sector_crc[i];
+    b->verified = 0;
+  }
+  free(sector_crc);
+}
+
+/*
+ * Disk_SetChecksumMode
+ *
+ * Selects how sector checksums are handled: DISK_CRC_OFF, DISK_CRC_VERIFY
+ * or DISK_CRC_LAZY (the default). May be called before Disk_Init().
+ */
+int Disk_SetChecksumMode(int mode)
+{
+  if(mode != DISK_CRC_OFF && mode != DISK_CRC_VERIFY && mode != DISK_CRC_LAZY) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  // checksums were not maintained while off; bring them up to date
+  if(crc_mode == DISK_CRC_OFF && mode != DISK_CRC_OFF && disk_ready)
+    checksum_all();
+  crc_mode = mode;
+  return 0;
+}
+
 /*
  * Disk_Init
  *
- * Initializes the disk area (really just some memory for now).
+ * Initializes the disk area (really just some memory for now). Any
+ * previous disk contents and snapshots are dropped.
  *
  * THIS FUNCTION MUST BE CALLED BEFORE ANY OTHER FUNCTION IN HERE CAN BE USED!
  *
  */
 int Disk_Init()
 {
-  // create the disk image and fill every sector with zeroes
-  disk = (sector_t *) calloc(TOTAL_SECTORS, sizeof(sector_t));
-  if(disk == NULL) {
-    diskErrno = E_MEM_OP;
+  // every sector starts out zeroed, which takes no memory at all
+  map_release(disk);
+  int i;
+  for(i=0; i<MAX_SNAPSHOTS; i++) {
+    if(snapshot[i] != NULL) {
+      map_release(*snapshot[i]);
+      free(snapshot[i]);
+      snapshot[i] = NULL;
+    }
+  }
+
+  crc_init();
+  sector_t zero;
+  memset(&zero, 0, sizeof(zero));
+  zero_sector_crc = sector_checksum(&zero);
+  disk_ready = 1;
+  return 0;
+}
+
+/*
+ * Backing store
+ *
+ * The disk is normally backed by a single image file. A composite
+ * backing store spreads the image over several member files and is
+ * named with a prefix and a comma-separated member list:
+ *
+ *   "stripe:a.img,b.img,c.img"  sectors striped across the members
+ *                               in units of STRIPE_SECTORS (RAID-0)
+ *   "mirror:a.img,b.img"        every member holds a full copy of the
+ *                               image (RAID-1)
+ *
+ * Each member is saved and loaded by its own thread so that the time
+ * to sync or boot shrinks with the number of backing files.
+ */
+
+// the maximum number of member files in a composite backing store
+#define MAX_MEMBERS 16
+
+// the stripe unit (in sectors) of a striped backing store
+#define STRIPE_SECTORS 16
+
+// max length of a member file name
+#define MAX_MEMBER_NAME 1024
+
+typedef enum {
+  BS_SINGLE,
+  BS_STRIPE,
+  BS_MIRROR,
+} bs_mode_t;
+
+typedef struct backing {
+  int mode;   // one of bs_mode_t
+  int count;  // number of member files
+  char member[MAX_MEMBERS][MAX_MEMBER_NAME];
+} backing_t;
+
+// the work handed to the thread that saves or loads one member
+typedef struct member_io {
+  backing_t* bs;
+  int idx;      // index of the member file
+  int err;      // 0, or the diskErrno value describing the failure
+  int missing;  // set if the member file does not exist
+  off_t packed_size; // size of a packed image file, 0 if raw
+} member_io_t;
+
+// split a backing store name into its member files; return 0 if
+// successful, -1 if the name is malformed
+static int parse_backing(char* file, backing_t* bs)
+{
+  char* list;
+  if(!strncmp(file, "stripe:", 7)) { bs->mode = BS_STRIPE; list = file+7; }
+  else if(!strncmp(file, "mirror:", 7)) { bs->mode = BS_MIRROR; list = file+7; }
+  else {
+    bs->mode = BS_SINGLE;
+    bs->count = 1;
+    strncpy(bs->member[0], file, MAX_MEMBER_NAME-1);
+    bs->member[0][MAX_MEMBER_NAME-1] = '\0';
+    return 0;
+  }
+
+  bs->count = 0;
+  while(*list != '\0') {
+    char* comma = strchr(list, ',');
+    int len = comma ? (int)(comma-list) : (int)strlen(list);
+    if(len == 0 || len >= MAX_MEMBER_NAME || bs->count == MAX_MEMBERS)
+      return -1;
+    memcpy(bs->member[bs->count], list, len);
+    bs->member[bs->count][len] = '\0';
+    bs->count++;
+    list += len;
+    if(*list == ',') list++;
+  }
+  return bs->count > 0 ? 0 : -1;
+}
+
+// write or read exactly 'len' bytes at offset 'off'; return 0 if
+// successful, -1 otherwise
+static int pwrite_full(int fd, char* buf, size_t len, off_t off)
+{
+  while(len > 0) {
+    ssize_t n = pwrite(fd, buf, len, off);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return -1;
+    buf += n; len -= n; off += n;
+  }
+  return 0;
+}
+
+static int pread_full(int fd, char* buf, size_t len, off_t off)
+{
+  while(len > 0) {
+    ssize_t n = pread(fd, buf, len, off);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return -1;
+    buf += n; len -= n; off += n;
+  }
+  return 0;
+}
+
+// the number of sectors stored in member 'idx' of a striped disk
+static int stripe_member_sectors(int count, int idx)
+{
+  int nunits = (TOTAL_SECTORS+STRIPE_SECTORS-1)/STRIPE_SECTORS;
+  int sectors = 0;
+  int u;
+  for(u=idx; u<nunits; u+=count) {
+    int first = u*STRIPE_SECTORS;
+    sectors += (first+STRIPE_SECTORS > TOTAL_SECTORS) ? TOTAL_SECTORS-first : STRIPE_SECTORS;
+  }
+  return sectors;
+}
+
+// the number of sectors expected in member 'idx'
+static int member_sectors(backing_t* bs, int idx)
+{
+  if(bs->mode == BS_STRIPE) return stripe_member_sectors(bs->count, idx);
+  return TOTAL_SECTORS;
+}
+
+// the number of sectors staged at a time between the disk and a file
+#define XFER_SECTORS 256
+
+// return 1 if a sector of the live disk holds nothing but zeroes
+static int sector_zero_at(int sector)
+{
+  block_t* b = sector_block(sector);
+  return b == NULL || sector_is_zero(&b->s);
+}
+
+// turn 'len' bytes at offset 'off' of a file into a hole (or, where
+// the file system can't punch holes, into zeroes)
+static int zero_range(int fd, off_t off, size_t len, char* zeros)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if(fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, off, len) == 0)
+    return 0;
+#endif
+  memset(zeros, 0, (size_t)XFER_SECTORS*SECTOR_SIZE);
+  while(len > 0) {
+    size_t k = len < (size_t)XFER_SECTORS*SECTOR_SIZE ? len : (size_t)XFER_SECTORS*SECTOR_SIZE;
+    if(pwrite_full(fd, zeros, k, off) < 0) return -1;
+    off += k; len -= k;
+  }
+  return 0;
+}
+
+// write 'n' sectors starting at 'first' to offset 'off' of an open
+// file; runs of zero (e.g. discarded) sectors become holes in the file
+static int write_sectors(int fd, int first, int n, off_t off)
+{
+  char* buf = malloc((size_t)XFER_SECTORS*SECTOR_SIZE);
+  if(buf == NULL) return -1;
+  int rc = 0;
+  while(n > 0 && rc == 0) {
+    int zero = sector_zero_at(first);
+    int k = 1;
+    while(k < n && k < XFER_SECTORS && sector_zero_at(first+k) == zero) k++;
+    size_t len = (size_t)k*SECTOR_SIZE;
+    if(zero) rc = zero_range(fd, off, len, buf);
+    else {
+      gather(first, k, buf);
+      rc = pwrite_full(fd, buf, len, off);
+    }
+    first += k; n -= k; off += len;
+  }
+  free(buf);
+  return rc;
+}
+
+// read 'n' sectors starting at 'first' from offset 'off' of an open
+// file into the (freshly initialized) disk; holes in the file are
+// skipped without any I/O and simply stay zero
+static int read_sectors(int fd, int first, int n, off_t off)
+{
+  char* buf = malloc((size_t)XFER_SECTORS*SECTOR_SIZE);
+  if(buf == NULL) return -1;
+  off_t end = off+(off_t)n*SECTOR_SIZE;
+  int rc = 0;
+  while(n > 0 && rc == 0) {
+    // find the next stretch of data, if the file system can tell
+    off_t data = lseek(fd, off, SEEK_DATA);
+    if(data < 0 && errno == ENXIO) break; // nothing but holes left
+    if(data < 0 || data < off) data = off;
+    if(data >= end) break;
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    if(hole < 0 || hole > end) hole = end;
+
+    int skip = (int)((data-off)/SECTOR_SIZE);
+    first += skip; n -= skip; off += (off_t)skip*SECTOR_SIZE;
+    int k = (int)((hole-off+SECTOR_SIZE-1)/SECTOR_SIZE);
+    if(k > n) k = n;
+    if(k > XFER_SECTORS) k = XFER_SECTORS;
+    if(k <= 0) k = 1;
+
+    size_t len = (size_t)k*SECTOR_SIZE;
+    rc = pread_full(fd, buf, len, off);
+    if(rc == 0) rc = scatter(first, k, buf);
+    first += k; n -= k; off += len;
+  }
+  free(buf);
+  return rc;
+}
+
+// copy 'n' sectors starting at 'first' between the disk and offset
+// 'off' of an open file; return 0 if successful, -1 otherwise
+static int transfer(int fd, int first, int n, off_t off, int writing)
+{
+  return writing ? write_sectors(fd, first, n, off) : read_sectors(fd, first, n, off);
+}
+
+// copy the stripe units owned by member 'idx' between memory and the
+// member file (which holds them back to back)
+static int stripe_transfer(int fd, backing_t* bs, int idx, int writing)
+{
+  int nunits = (TOTAL_SECTORS+STRIPE_SECTORS-1)/STRIPE_SECTORS;
+  off_t off = 0;
+  int u;
+  for(u=idx; u<nunits; u+=bs->count) {
+    int first = u*STRIPE_SECTORS;
+    int n = (first+STRIPE_SECTORS > TOTAL_SECTORS) ? TOTAL_SECTORS-first : STRIPE_SECTORS;
+    if(transfer(fd, first, n, off, writing) < 0) return -1;
+    off += (off_t)n*SECTOR_SIZE;
+  }
+  return 0;
+}
+
+/*
+ * Packed images
+ *
+ * A single image file may be stored in a compact container instead of
+ * as raw sectors: a header, an index with one entry per chunk of
+ * PACK_CHUNK_SECTORS sectors, and the chunk payloads. All-zero sectors
+ * are left out of a chunk (its zero mask says which), and the rest of
+ * the chunk is LZ-compressed unless that doesn't make it smaller.
+ * Disk_Load recognizes the container by its magic number.
+ */
+
+#define PACK_MAGIC "LDSKPAK"
+#define PACK_VERSION 1
+#define PACK_CHUNK_SECTORS 16 // must fit in the 16-bit zero mask
+#define PACK_NCHUNKS ((TOTAL_SECTORS+PACK_CHUNK_SECTORS-1)/PACK_CHUNK_SECTORS)
+#define PACK_CHUNK_BYTES (PACK_CHUNK_SECTORS*SECTOR_SIZE)
+
+typedef struct pack_header {
+  char magic[8];               // PACK_MAGIC
+  unsigned int version;        // PACK_VERSION
+  unsigned int sector_size;    // must match SECTOR_SIZE
+  unsigned int total_sectors;  // must match TOTAL_SECTORS
+  unsigned int chunk_sectors;  // sectors per chunk
+  unsigned int nchunks;        // entries in the index
+  unsigned int reserved;
+} pack_header_t;
+
+// how a chunk's payload is stored
+#define PACK_CHUNK_RAW 0  // the non-zero sectors back to back
+#define PACK_CHUNK_LZ 1   // the same, LZ-compressed
+
+typedef struct pack_index {
+  unsigned long long offset;  // of the payload from the start of the file
+  unsigned int length;        // of the payload in bytes
+  unsigned short kind;        // PACK_CHUNK_RAW or PACK_CHUNK_LZ
+  unsigned short zero_mask;   // bit i set: sector i of the chunk is zero
+} pack_index_t;
+
+// the format Disk_Save uses for a single image file; a loaded image
+// keeps the format it was found in
+static int disk_format = DISK_FORMAT_PACKED;
+
+// the number of sectors in chunk 'c' (the last one may be short)
+static int pack_chunk_sectors(int c)
+{
+  int first = c*PACK_CHUNK_SECTORS;
+  return (first+PACK_CHUNK_SECTORS > TOTAL_SECTORS) ? TOTAL_SECTORS-first : PACK_CHUNK_SECTORS;
+}
+
+static int save_packed(int fd)
+{
+  size_t hdrlen = sizeof(pack_header_t)+PACK_NCHUNKS*sizeof(pack_index_t);
+  char* out = malloc(hdrlen+(size_t)PACK_NCHUNKS*LZ_BOUND(PACK_CHUNK_BYTES));
+  char* raw = malloc(PACK_CHUNK_BYTES);
+  if(out == NULL || raw == NULL) {
+    free(out); free(raw);
+    return -1;
+  }
+
+  pack_header_t* hdr = (pack_header_t*)out;
+  memset(hdr, 0, sizeof(pack_header_t));
+  memcpy(hdr->magic, PACK_MAGIC, sizeof(hdr->magic));
+  hdr->version = PACK_VERSION;
+  hdr->sector_size = SECTOR_SIZE;
+  hdr->total_sectors = TOTAL_SECTORS;
+  hdr->chunk_sectors = PACK_CHUNK_SECTORS;
+  hdr->nchunks = PACK_NCHUNKS;
+  pack_index_t* index = (pack_index_t*)(out+sizeof(pack_header_t));
+
+  size_t off = hdrlen;
+  int c;
+  for(c=0; c<PACK_NCHUNKS; c++) {
+    // gather the non-zero sectors of the chunk
+    int n = pack_chunk_sectors(c), len = 0, i;
+    unsigned short mask = 0;
+    for(i=0; i<n; i++) {
+      block_t* b = sector_block(c*PACK_CHUNK_SECTORS+i);
+      if(b == NULL || sector_is_zero(&b->s)) mask |= 1 << i;
+      else {
+        memcpy(raw+len, &b->s, SECTOR_SIZE);
+        len += SECTOR_SIZE;
+      }
+    }
+
+    index[c].offset = off;
+    index[c].zero_mask = mask;
+    int clen = len ? LZ_Compress(raw, len, out+off, len-1) : -1;
+    if(clen > 0) {
+      index[c].kind = PACK_CHUNK_LZ;
+      index[c].length = clen;
+    } else {
+      memcpy(out+off, raw, len);
+      index[c].kind = PACK_CHUNK_RAW;
+      index[c].length = len;
+    }
+    off += index[c].length;
+  }
+
+  int rc = pwrite_full(fd, out, off, 0);
+  if(rc == 0) rc = ftruncate(fd, off);
+  free(out); free(raw);
+  return rc;
+}
+
+// return 1 if the open file is a packed image
+static int is_packed(int fd)
+{
+  char magic[8];
+  return pread_full(fd, magic, sizeof(magic), 0) == 0 &&
+         !memcmp(magic, PACK_MAGIC, sizeof(magic));
+}
+
+static int load_packed(int fd, off_t size)
+{
+  char* in = malloc(size);
+  char* raw = malloc(PACK_CHUNK_BYTES);
+  int rc = -1;
+  if(in == NULL || raw == NULL || pread_full(fd, in, size, 0) < 0)
+    goto done;
+
+  pack_header_t* hdr = (pack_header_t*)in;
+  size_t hdrlen = sizeof(pack_header_t)+PACK_NCHUNKS*sizeof(pack_index_t);
+  if(size < hdrlen || hdr->version != PACK_VERSION || hdr->sector_size != SECTOR_SIZE ||
+     hdr->total_sectors != TOTAL_SECTORS || hdr->chunk_sectors != PACK_CHUNK_SECTORS ||
+     hdr->nchunks != PACK_NCHUNKS)
+    goto done;
+  pack_index_t* index = (pack_index_t*)(in+sizeof(pack_header_t));
+
+  // unpack chunk by chunk straight into the disk
+  int c;
+  for(c=0; c<PACK_NCHUNKS; c++) {
+    pack_index_t* e = &index[c];
+    if(e->offset > size || e->length > size-e->offset) goto done;
+    int n = pack_chunk_sectors(c), i, nonzero = 0;
+    for(i=0; i<n; i++)
+      if(!(e->zero_mask & (1 << i))) nonzero++;
+
+    int len = e->length;
+    char* payload = in+e->offset;
+    if(e->kind == PACK_CHUNK_LZ) {
+      len = LZ_Decompress(payload, e->length, raw, PACK_CHUNK_BYTES);
+      payload = raw;
+    } else if(e->kind != PACK_CHUNK_RAW) goto done;
+    if(len != nonzero*SECTOR_SIZE) goto done;
+
+    for(i=0; i<n; i++) {
+      if(e->zero_mask & (1 << i)) continue; // the sector stays zero
+      if(scatter(c*PACK_CHUNK_SECTORS+i, 1, payload) < 0) goto done;
+      payload += SECTOR_SIZE;
+    }
+  }
+  rc = 0;
+
+ done:
+  free(in); free(raw);
+  return rc;
+}
+
+static void* save_member(void* arg)
+{
+  member_io_t* io = (member_io_t*)arg;
+  backing_t* bs = io->bs;
+  // the file is not truncated up front: raw sectors are written in
+  // place (zero ones are punched out as holes) and only the tail that
+  // is no longer needed is cut off
+  int fd = open(bs->member[io->idx], O_WRONLY|O_CREAT, 0644);
+  if(fd < 0) {
+    io->err = E_OPENING_FILE;
+    return NULL;
+  }
+
+  int rc;
+  if(bs->mode == BS_SINGLE && disk_format == DISK_FORMAT_PACKED) rc = save_packed(fd);
+  else {
+    if(bs->mode == BS_STRIPE) rc = stripe_transfer(fd, bs, io->idx, 1);
+    else rc = transfer(fd, 0, TOTAL_SECTORS, 0, 1);
+    if(rc == 0) rc = ftruncate(fd, (off_t)member_sectors(bs, io->idx)*SECTOR_SIZE);
+  }
+  if(rc < 0) io->err = E_WRITING_FILE;
+
+  close(fd);
+  return NULL;
+}
+
+// open a member for reading and make sure it has the expected size
+static int open_member(member_io_t* io)
+{
+  backing_t* bs = io->bs;
+  int fd = open(bs->member[io->idx], O_RDONLY);
+  if(fd < 0) {
+    io->missing = (errno == ENOENT);
+    io->err = E_OPENING_FILE;
+    return -1;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) < 0) {
+    close(fd);
+    io->err = E_READING_FILE;
+    return -1;
+  }
+
+  // a single image may be packed; anything else must be raw sectors
+  if(bs->mode == BS_SINGLE && is_packed(fd)) {
+    io->packed_size = st.st_size;
+    return fd;
+  }
+  io->packed_size = 0;
+  if(st.st_size != (off_t)member_sectors(bs, io->idx)*SECTOR_SIZE) {
+    close(fd);
+    io->err = E_READING_FILE;
     return -1;
   }
+  return fd;
+}
+
+static void* load_member(void* arg)
+{
+  member_io_t* io = (member_io_t*)arg;
+  backing_t* bs = io->bs;
+
+  if(bs->mode == BS_MIRROR) {
+    // each mirror thread reads its own share of the sector range;
+    // if its member can't supply it, the other members are tried
+    int first = (int)((long)TOTAL_SECTORS*io->idx/bs->count);
+    int last = (int)((long)TOTAL_SECTORS*(io->idx+1)/bs->count);
+    off_t off = (off_t)first*sizeof(sector_t);
+    int i;
+    for(i=0; i<bs->count; i++) {
+      member_io_t probe = *io;
+      probe.idx = (io->idx+i)%bs->count;
+      probe.err = 0; probe.missing = 0;
+      int fd = open_member(&probe);
+      if(i == 0) io->missing = probe.missing;
+      if(fd < 0) { io->err = probe.err; continue; }
+      int rc = transfer(fd, first, last-first, off, 0);
+      close(fd);
+      if(rc == 0) { io->err = 0; return NULL; }
+      io->err = E_READING_FILE;
+    }
+    return NULL;
+  }
+
+  int fd = open_member(io);
+  if(fd < 0) return NULL;
+
+  int rc;
+  if(bs->mode == BS_STRIPE) rc = stripe_transfer(fd, bs, io->idx, 0);
+  else if(io->packed_size > 0) rc = load_packed(fd, io->packed_size);
+  else rc = transfer(fd, 0, TOTAL_SECTORS, 0, 0);
+  if(rc < 0) io->err = E_READING_FILE;
+
+  close(fd);
+  return NULL;
+}
+
+// run 'fn' for every member of the backing store, each in its own
+// thread (a single member is handled by the calling thread)
+static void run_members(backing_t* bs, member_io_t* io, void* (*fn)(void*))
+{
+  pthread_t tid[MAX_MEMBERS];
+  int started[MAX_MEMBERS];
+  int i;
+  for(i=0; i<bs->count; i++) {
+    io[i].bs = bs; io[i].idx = i;
+    io[i].err = 0; io[i].missing = 0;
+    io[i].packed_size = 0;
+  }
+  if(bs->count == 1) {
+    fn(&io[0]);
+    return;
+  }
+  for(i=0; i<bs->count; i++)
+    started[i] = (pthread_create(&tid[i], NULL, fn, &io[i]) == 0);
+  for(i=0; i<bs->count; i++) {
+    if(started[i]) pthread_join(tid[i], NULL);
+    else fn(&io[i]);
+  }
+}
+
+// the backing store the disk was last loaded from or saved to; on a
+// mirror, a sector that fails its checksum is looked for in the members
+static backing_t current_bs;
+static int current_bs_set;
+
+// find a copy of 'sector' that matches the checksum in 'b' among the
+// members of the current mirror, put it in 'b' and write it over the
+// copies that don't match; return 0 if successful, -1 if none matches
+static int mirror_repair(int sector, block_t* b)
+{
+  if(!current_bs_set || current_bs.mode != BS_MIRROR) return -1;
+  off_t off = (off_t)sector*SECTOR_SIZE;
+  sector_t copy;
+  int i, good = -1, bad[MAX_MEMBERS], nbad = 0;
+  for(i=0; i<current_bs.count && good < 0; i++) {
+    int fd = open(current_bs.member[i], O_RDONLY);
+    int ok = fd >= 0 && pread_full(fd, (char*)&copy, SECTOR_SIZE, off) == 0 &&
+             sector_checksum(&copy) == b->crc;
+    if(fd >= 0) close(fd);
+    if(ok) good = i;
+    else bad[nbad++] = i;
+  }
+  if(good < 0) return -1;
+
+  memcpy(&b->s, &copy, SECTOR_SIZE);
+  b->verified = 1;
+  for(i=0; i<nbad; i++) {
+    int fd = open(current_bs.member[bad[i]], O_WRONLY);
+    if(fd < 0) continue;
+    pwrite_full(fd, (char*)&copy, SECTOR_SIZE, off);
+    close(fd);
+  }
   return 0;
 }
 
+// before a mirror is saved over, check the sectors not read since the
+// load, so that a bad copy doesn't replace the good ones of the other
+// members; those that can't be repaired are left for Disk_Read to report
+static void mirror_repair_all()
+{
+  if(crc_mode == DISK_CRC_OFF || !current_bs_set || current_bs.mode != BS_MIRROR) return;
+  int i;
+  for(i=0; i<TOTAL_SECTORS; i++) {
+    block_t* b = sector_block(i);
+    if(b == NULL || b->verified) continue;
+    if(sector_checksum(&b->s) == b->crc) b->verified = 1;
+    else mirror_repair(i, b);
+  }
+}
+
 /*
  * Disk_Save
  *
@@ -45,29 +1041,38 @@ int Disk_Init()
  */
 int Disk_Save(char* file)
 {
-  FILE* diskFile;
-    
+  backing_t bs;
+  member_io_t io[MAX_MEMBERS];
+
   // error check
-  if (file == NULL) {
+  if (file == NULL || parse_backing(file, &bs) < 0) {
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
-    
-  // open the diskFile
-  if ((diskFile = fopen(file, "w")) == NULL) {
-    diskErrno = E_OPENING_FILE;
-    return -1;
+
+  if(bs.mode == BS_MIRROR) mirror_repair_all();
+
+  // actually write the disk image to the member file(s)
+  run_members(&bs, io, save_member);
+
+  int i;
+  for(i=0; i<bs.count; i++) {
+    if(io[i].err) {
+      diskErrno = io[i].err;
+      return -1;
+    }
   }
-    
-  // actually write the disk image to a file
-  if ((fwrite(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
-    fclose(diskFile);
-    diskErrno = E_WRITING_FILE;
-    return -1;
+  current_bs = bs;
+  current_bs_set = 1;
+
+  // every member of a mirror gets the checksums, so that any one of
+  // them can be loaded on its own
+  for(i=0; i<(bs.mode == BS_MIRROR ? bs.count : 1); i++) {
+    if(save_checksums(bs.member[i]) < 0) {
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
   }
-    
-  // clean up and return
-  fclose(diskFile);
   return 0;
 }
 
@@ -75,33 +1080,84 @@ int Disk_Save(char* file)
  * Disk_Load
  *
  * Loads a current disk image from disk into memory - requires that
- * the disk be created first.
+ * the disk be created first. A raw image must have exactly the size
+ * of the disk, a packed one must have a valid index; E_OPENING_FILE
+ * is reported only if none of the backing files exist.
  */
 int Disk_Load(char* file)
 {
-  FILE* diskFile;
-    
+  backing_t bs;
+  member_io_t io[MAX_MEMBERS];
+
   // error check
-  if (file == NULL) {
+  if (file == NULL || parse_backing(file, &bs) < 0) {
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
-    
-  // open the diskFile
-  if ((diskFile = fopen(file, "r")) == NULL) {
-    diskErrno = E_OPENING_FILE;
-    return -1;
+
+  // start from a fresh map whose pages all exist up front, so that the
+  // member threads only ever fill in distinct block slots
+  map_release(disk);
+  int p;
+  for(p=0; p<MAP_PAGES; p++) {
+    if((disk[p] = (map_page_t*) calloc(1, sizeof(map_page_t))) == NULL) {
+      diskErrno = E_MEM_OP;
+      return -1;
+    }
+    disk[p]->refs = 1;
   }
-    
+
   // actually read the disk image into memory
-  if ((fread(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
-    fclose(diskFile);
-    diskErrno = E_READING_FILE;
+  run_members(&bs, io, load_member);
+
+  int i, missing = 0, failed = -1;
+  for(i=0; i<bs.count; i++) {
+    if(io[i].missing) missing++;
+    if(io[i].err && failed < 0) failed = i;
+  }
+  if(failed >= 0) {
+    // a partially present composite disk must not be mistaken for a
+    // missing one, otherwise the caller may format over it
+    if(missing == bs.count) diskErrno = E_OPENING_FILE;
+    else diskErrno = io[failed].err == E_OPENING_FILE ? E_READING_FILE : io[failed].err;
     return -1;
   }
-    
-  // clean up and return
-  fclose(diskFile);
+
+  // keep saving the image in the format it was found in
+  if(bs.mode == BS_SINGLE)
+    disk_format = io[0].packed_size > 0 ? DISK_FORMAT_PACKED : DISK_FORMAT_RAW;
+
+  current_bs = bs;
+  current_bs_set = 1;
+
+  // the checksums of a mirror come from the first member that has them
+  int crcs = 0;
+  for(i=0; bs.mode == BS_MIRROR && i<bs.count; i++) {
+    char name[FILENAME_MAX];
+    crc_filename(bs.member[i], name, sizeof(name));
+    if(access(name, R_OK) == 0) {
+      crcs = i;
+      break;
+    }
+  }
+  load_checksums(bs.member[crcs]);
+  return 0;
+}
+
+/*
+ * Disk_SetFormat
+ *
+ * Selects the format Disk_Save uses for a single image file:
+ * DISK_FORMAT_RAW or DISK_FORMAT_PACKED (the default). Composite
+ * backing stores always hold raw sectors.
+ */
+int Disk_SetFormat(int format)
+{
+  if(format != DISK_FORMAT_RAW && format != DISK_FORMAT_PACKED) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  disk_format = format;
   return 0;
 }
 
@@ -119,8 +1175,25 @@ int Disk_Read(int sector, char* buffer)
     return -1;
   }
     
+  // a sector that was never written is all zeroes
+  block_t* b = sector_block(sector);
+  if(b == NULL) {
+    memset(buffer, 0, SECTOR_SIZE);
+    return 0;
+  }
+
+  // verify the checksum (once per load in lazy mode)
+  if(crc_mode != DISK_CRC_OFF && (crc_mode == DISK_CRC_VERIFY || !b->verified)) {
+    // a mirror may still have a good copy in another member
+    if(sector_checksum(&b->s) != b->crc && mirror_repair(sector, b) < 0) {
+      diskErrno = E_CHECKSUM;
+      return -1;
+    }
+    b->verified = 1;
+  }
+
   // copy the memory for the user
-  if((memcpy((void*)buffer, (void*)(disk + sector), sizeof(sector_t))) == NULL) {
+  if((memcpy((void*)buffer, (void*)&b->s, sizeof(sector_t))) == NULL) {
     diskErrno = E_MEM_OP;
     return -1;
   }
@@ -141,10 +1214,109 @@ int Disk_Write(int sector, char* buffer)
     return -1;
   }
     
+  // the sector gets a block of its own if it shares one with a snapshot
+  block_t* b = block_for_write(sector);
+  if(b == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+
   // copy the memory for the user
-  if((memcpy((void*)(disk + sector), (void*)buffer, sizeof(sector_t))) == NULL) {
+  if((memcpy((void*)&b->s, (void*)buffer, sizeof(sector_t))) == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+
+  if(crc_mode != DISK_CRC_OFF) b->crc = sector_checksum(&b->s);
+  b->verified = 1;
+  return 0;
+}
+
+/*
+ * Disk_Snapshot
+ *
+ * Takes a snapshot of the disk and returns its handle. The snapshot
+ * shares all sectors with the disk; a sector is copied only when it
+ * is first written afterwards, so the cost grows with the amount of
+ * change rather than with the size of the disk.
+ */
+int Disk_Snapshot()
+{
+  int i;
+  for(i=0; i<MAX_SNAPSHOTS; i++)
+    if(snapshot[i] == NULL) break;
+  if(i == MAX_SNAPSHOTS) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  snapshot[i] = (sector_map_t*) malloc(sizeof(sector_map_t));
+  if(snapshot[i] == NULL) {
     diskErrno = E_MEM_OP;
     return -1;
   }
+  map_share(*snapshot[i], disk);
+  return i;
+}
+
+/*
+ * Disk_Rollback
+ *
+ * Returns the disk to the contents it had when snapshot 'snap' was
+ * taken. The snapshot stays valid and can be rolled back to again.
+ */
+int Disk_Rollback(int snap)
+{
+  if(snap < 0 || snap >= MAX_SNAPSHOTS || snapshot[snap] == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  map_release(disk);
+  map_share(disk, *snapshot[snap]);
+  return 0;
+}
+
+/*
+ * Disk_ReleaseSnapshot
+ *
+ * Drops snapshot 'snap' and the sectors only it was holding on to.
+ */
+int Disk_ReleaseSnapshot(int snap)
+{
+  if(snap < 0 || snap >= MAX_SNAPSHOTS || snapshot[snap] == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  map_release(*snapshot[snap]);
+  free(snapshot[snap]);
+  snapshot[snap] = NULL;
+  return 0;
+}
+
+/*
+ * Disk_Discard
+ *
+ * Tells the disk that 'count' sectors starting at 'sector' no longer
+ * hold anything useful. They read back as zeroes from now on, take no
+ * memory, and become holes in a raw image file the next time the disk
+ * is saved.
+ */
+int Disk_Discard(int sector, int count)
+{
+  if(sector < 0 || count < 0 || sector+count > TOTAL_SECTORS) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  int i;
+  for(i=sector; i<sector+count; i++) {
+    if(sector_block(i) == NULL) continue;
+    map_page_t* pg = page_for_write(i);
+    if(pg == NULL) {
+      diskErrno = E_MEM_OP;
+      return -1;
+    }
+    block_put(pg->block[i%MAP_SECTORS]);
+    pg->block[i%MAP_SECTORS] = NULL;
+  }
   return 0;
 }
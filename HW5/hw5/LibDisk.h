@@ -24,14 +24,41 @@ typedef enum {
   E_OPENING_FILE,
   E_WRITING_FILE,
   E_READING_FILE,
+  E_CHECKSUM,
 } Disk_Error_t;
 
+// how sector checksums (CRC32C, kept out of band) are used
+#define DISK_CRC_OFF 0     // no checksums are kept
+#define DISK_CRC_VERIFY 1  // every Disk_Read verifies its sector
+#define DISK_CRC_LAZY 2    // a sector is verified the first time it is
+                           // read after Disk_Load (the default)
+
+// how Disk_Save stores a single image file
+#define DISK_FORMAT_RAW 0     // TOTAL_SECTORS raw sectors
+#define DISK_FORMAT_PACKED 1  // indexed, zero-elided, compressed chunks
+                              // (the default)
+
 extern int diskErrno; // used to see what happened w/ disk ops
 
 int Disk_Init();
+
+// 'file' names the backing store: either a single image file, or a
+// composite of several files written as "stripe:a,b,..." (sectors
+// striped across the files) or "mirror:a,b,..." (each file holds a
+// full copy); the members of a composite are saved and loaded in
+// parallel
 int Disk_Save(char* file);
 int Disk_Load(char* file);
 int Disk_Write(int sector, char* buffer);
 int Disk_Read(int sector, char* buffer);
+int Disk_Discard(int sector, int count);
+int Disk_SetChecksumMode(int mode);
+int Disk_SetFormat(int format);
+
+// snapshots share sectors with the disk until they are written;
+// Disk_Snapshot returns a handle to pass to the other two calls
+int Disk_Snapshot();
+int Disk_Rollback(int snap);
+int Disk_ReleaseSnapshot(int snap);
 
 #endif // __Disk_H__
@@ -17,8 +17,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "LibDisk.h"
 #include "LibFS.h"
+#include "LZ.h"
 #include <ctype.h>
 
 // set to 1 to have detailed debug print-outs and 0 to have none
@@ -37,22 +39,49 @@ void noprintf(char* str, ...) {}
 // its first four bytes (integer)
 #define SUPERBLOCK_START_SECTOR 0
 
-// the magic number chosen for our file system
-#define OS_MAGIC 0xdeadbeef
+// the magic number chosen for our file system (changed when the inode
+// table became growable, and again with the allocation groups, so older
+// images are not misread)
+#define OS_MAGIC 0xdeadbef1
+
+// the disk is split into allocation groups of AG_SECTORS consecutive
+// sectors (the last one is shorter), and the inode numbers into as many
+// groups of AG_INODES (the last one takes the rest); a new directory
+// goes to a group with few directories and plenty of room, a file's
+// inode to its directory's group, and its data as close after its inode
+// as there is room, so that what is used together stays together
+#define AG_SECTORS 1024
+#define AG_COUNT ((TOTAL_SECTORS+AG_SECTORS-1)/AG_SECTORS)                    //10 in our program
+
+// the superblock also keeps the number of free inodes and sectors, and
+// a histogram of the free extents (runs of free sectors) by size:
+// extents[i] counts the extents of 2^i up to 2^(i+1)-1 sectors (the
+// last entry takes everything bigger); they are kept up to date on
+// every allocation and release, so reading them costs nothing
+typedef struct _superblock {
+  int magic;
+  int free_inodes;
+  int free_sectors;
+  int extents[FS_EXTENT_BUCKETS];
+  int ag_free_inodes[AG_COUNT];  // the same counts for each allocation group
+  int ag_free_sectors[AG_COUNT];
+  int ag_dirs[AG_COUNT];         // and the number of directories in it
+  int refs_start;                // first sector of the reference counts (see below), 0 if none
+} superblock_t;
 
 // 2. the inode bitmap (one or more sectors), which indicates whether
-// the particular entry in the inode table (#4) is currently in use
+// the particular entry in the inode table is currently in use
 #define INODE_BITMAP_START_SECTOR 1
 
 // the total number of bytes and sectors needed for the inode bitmap;
 // we use one bit for each inode (whether it's a file or directory) to
 // indicate whether the particular inode in the inode table is in use
-#define INODE_BITMAP_SIZE ((MAX_FILES+7)/8)                                           //125.875 => 125 in our program
-#define INODE_BITMAP_SECTORS ((INODE_BITMAP_SIZE+SECTOR_SIZE-1)/SECTOR_SIZE)          //1.24 => 1 in our program
+#define INODE_BITMAP_SIZE ((MAX_FILES+7)/8)                                           //8192 in our program
+#define INODE_BITMAP_SECTORS ((INODE_BITMAP_SIZE+SECTOR_SIZE-1)/SECTOR_SIZE)          //16 in our program
 
 // 3. the sector bitmap (one or more sectors), which indicates whether
 // the particular sector in the disk is currently in use
-#define SECTOR_BITMAP_START_SECTOR (INODE_BITMAP_START_SECTOR+INODE_BITMAP_SECTORS)   // 2 in our program
+#define SECTOR_BITMAP_START_SECTOR (INODE_BITMAP_START_SECTOR+INODE_BITMAP_SECTORS)   // 17 in our program
 
 // the total number of bytes and sectors needed for the data block
 // bitmap (we call it the sector bitmap); we use one bit for each
@@ -60,19 +89,46 @@ void noprintf(char* str, ...) {}
 #define SECTOR_BITMAP_SIZE ((TOTAL_SECTORS+7)/8)                                      //1250.87 => 1250 in our program
 #define SECTOR_BITMAP_SECTORS ((SECTOR_BITMAP_SIZE+SECTOR_SIZE-1)/SECTOR_SIZE)        //3.44 => 3 in our program
 
-// 4. the inode table (one or more sectors), which contains the inodes
-// stored consecutively
-#define INODE_TABLE_START_SECTOR (SECTOR_BITMAP_START_SECTOR+SECTOR_BITMAP_SECTORS)   // 5 in our program
+// 4. the inode chunk map (one or more sectors), which tells where each
+// chunk of the inode table lives on disk (see below)
+#define INODE_CHUNK_MAP_START_SECTOR (SECTOR_BITMAP_START_SECTOR+SECTOR_BITMAP_SECTORS) // 20 in our program
 
 // an inode is used to represent each file or directory; the data
 // structure supposedly contains all necessary information about the
 // corresponding file or directory
 typedef struct _inode {
   int size; // the size of the file or number of directory entries
-  int type; // 0 means regular file; 1 means directory
+  int type; // 0 means regular file; 1 means directory (plus flags, see below)
   int data[MAX_SECTORS_PER_FILE]; // indices to sectors containing data blocks
 } inode_t;
 
+// the low byte of the type tells files from directories; the bits
+// above it are flags
+#define INODE_TYPE(inode) ((inode)->type & 0xff)
+
+// a small file may keep its content right in the inode, in place of
+// the sector indices, until it grows beyond INLINE_SIZE bytes
+#define INODE_INLINE 0x100
+#define INLINE_SIZE ((int)(MAX_SECTORS_PER_FILE*sizeof(int)))
+#define IS_INLINE(inode) (((inode)->type & INODE_INLINE) != 0)
+
+// a file may instead be kept compressed in clusters of CLUSTER_SIZE
+// bytes (see File_Compress); its first sector holds the cluster map,
+// the compressed length of each cluster (0 for a cluster of zeroes,
+// and CLUSTER_RAW with the length for one that didn't compress), and
+// the compressed clusters follow in order, packed one right after the
+// other across the rest of its sectors (the stream), so that no
+// cluster wastes the end of a sector
+#define INODE_COMPRESSED 0x200
+#define IS_COMPRESSED(inode) (((inode)->type & INODE_COMPRESSED) != 0)
+#define CLUSTER_SIZE (16*SECTOR_SIZE)
+#define CLUSTER_RAW 0x8000
+#define MAX_CLUSTERS ((MAX_COMPRESSED_FILE_SIZE+CLUSTER_SIZE-1)/CLUSTER_SIZE)
+#define STREAM_SIZE ((MAX_SECTORS_PER_FILE-1)*SECTOR_SIZE)
+
+// the largest size a file may grow to
+#define FILE_MAX(inode) (IS_COMPRESSED(inode) ? MAX_COMPRESSED_FILE_SIZE : MAX_FILE_SIZE)
+
 // the inode structures are stored consecutively and yet they don't
 // straddle accross the sector boundaries; that is, there may be
 // fragmentation towards the end of each sector used by the inode
@@ -81,11 +137,36 @@ typedef struct _inode {
 // the system; the inode bitmap (#2) indicates whether the entries are
 // current in use or not
 #define INODES_PER_SECTOR (SECTOR_SIZE/sizeof(inode_t))                             //4 in our program
-#define INODE_TABLE_SECTORS ((MAX_FILES+INODES_PER_SECTOR-1)/INODES_PER_SECTOR)     //250.75 => 250 in our program
+#define INODE_TABLE_SECTORS ((MAX_FILES+INODES_PER_SECTOR-1)/INODES_PER_SECTOR)     //16384 in our program
+
+// the inode table is not reserved up front; it is cut into chunks of
+// consecutive sectors, and a chunk is taken from the data blocks the
+// first time one of its inodes is handed out; the chunk map (#4) holds
+// the first sector of each chunk, or zero if it has none yet
+#define INODE_CHUNK_SECTORS 16
+#define INODES_PER_CHUNK (INODE_CHUNK_SECTORS*INODES_PER_SECTOR)                    //64 in our program
+#define INODE_CHUNKS ((MAX_FILES+INODES_PER_CHUNK-1)/INODES_PER_CHUNK)              //1024 in our program
+#define INODE_CHUNK_MAP_SECTORS ((INODE_CHUNKS*sizeof(int)+SECTOR_SIZE-1)/SECTOR_SIZE) //8 in our program
+
+// the inodes of an allocation group are whole chunks of the table, and
+// its chunks are put in its own sectors whenever there is room
+#define AG_INODES ((int)(INODES_PER_CHUNK*(INODE_CHUNKS/AG_COUNT)))               //6528 in our program
+#define INODE_AG(inode) ((inode)/AG_INODES < AG_COUNT ? (inode)/AG_INODES : AG_COUNT-1)
+#define SECTOR_AG(sector) ((sector)/AG_SECTORS)
 
 // 5. the data blocks; all the rest sectors are reserved for data
-// blocks for the content of files and directories
-#define DATABLOCK_START_SECTOR (INODE_TABLE_START_SECTOR+INODE_TABLE_SECTORS)       //255 in our program
+// blocks for the content of files and directories, and for the chunks
+// of the inode table
+#define DATABLOCK_START_SECTOR (INODE_CHUNK_MAP_START_SECTOR+INODE_CHUNK_MAP_SECTORS) //28 in our program
+
+// a data sector may be shared by several files after File_Clone; how
+// many other files share each sector is kept in a table of reference
+// counts, taken from the data blocks the first time a file is cloned
+// (the superblock tells where); a shared sector is only freed once no
+// other file refers to it, and a file writing to it gets a copy first
+#define REFS_PER_SECTOR ((int)(SECTOR_SIZE/sizeof(unsigned short)))             //256 in our program
+#define REFS_SECTORS ((TOTAL_SECTORS+REFS_PER_SECTOR-1)/REFS_PER_SECTOR)        //40 in our program
+#define REFS_MAX 65535 // a sector with this many is never shared any further
 
 // other file related definitions
 
@@ -115,6 +196,9 @@ int osErrno;
 // the name of the disk backstore file (with which the file system is booted)
 static char bs_filename[1024];
 
+// the inode chunk map, kept in memory while the file system is booted
+static int inode_chunks[INODE_CHUNK_MAP_SECTORS*SECTOR_SIZE/sizeof(int)];
+
 /* the following functions are internal helper functions */
 
 // check magic number in the superblock; return 1 if OK, and 0 if not
@@ -127,6 +211,26 @@ static int check_magic()
   else return 0;
 }
 
+// read the inode chunk map from disk; return 0 if successful, -1
+// otherwise
+static int load_inode_chunks()
+{
+  int i;
+  for(i=0; i<INODE_CHUNK_MAP_SECTORS; i++)
+    if(Disk_Read(INODE_CHUNK_MAP_START_SECTOR+i, (char*)inode_chunks+i*SECTOR_SIZE) < 0) return -1;
+  return 0;
+}
+
+// return the disk sector holding the given inode, or -1 if there is no
+// such inode or its chunk of the inode table was never allocated
+static int inode_table_sector(int inode)
+{
+  if(inode < 0 || inode >= MAX_FILES) return -1;
+  int start = inode_chunks[inode/INODES_PER_CHUNK];
+  if(start <= 0) return -1;
+  return start+inode%INODES_PER_CHUNK/INODES_PER_SECTOR;
+}
+
 // initialize a bitmap with 'num' sectors starting from 'start'
 // sector; all bits should be set to zero except that the first
 // 'nbits' number of bits are set to one
@@ -198,119 +302,597 @@ static char setNthBitSet (unsigned char c, int n) {
 }
 /********* END OUR CODE **********/
 
-// set the first unused bit from a bitmap of 'nbits' bits (flip the
-// first zero appeared in the bitmap to one) and return its location;
-// return -1 if the bitmap is already full (no more zeros)
-static int bitmap_first_unused(int start, int num, int nbits)
+// in-memory copies of the superblock and both bitmaps, loaded when the
+// file system is booted; every allocation and release goes through the
+// helpers below, which keep the counts in the superblock up to date
+// and mark the sectors that need to be written back
+static union {
+  superblock_t sb;
+  char buf[SECTOR_SIZE];
+} super;
+static char inode_bitmap[INODE_BITMAP_SECTORS*SECTOR_SIZE];
+static char sector_bitmap[SECTOR_BITMAP_SECTORS*SECTOR_SIZE];
+static char meta_dirty[INODE_CHUNK_MAP_START_SECTOR]; // indexed by disk sector
+static unsigned short sector_refs[REFS_SECTORS*REFS_PER_SECTOR];
+static char refs_dirty[REFS_SECTORS];
+
+// return the in-memory copy of the superblock or bitmap sector
+static char* meta_sector(int sector)
 {
-  /********* BEGING OUR CODE **********/
-  int nbytes = nbits/8;                       // Number of bytes to set to 1  
-  int extra_bits = nbits % 8;                 //Remainder bits after the last byte set to 1
-  int final_block = 0;                        //Bool varaible to know if I am in the last byte
-  char buf[SECTOR_SIZE];                      //Buffer sector  
-  int location = -1;                          //Return location 
-  
-  int i;
-  for(i=start; i<(start+num); i++){     //  Going through the sectors to check all its bytes 
+  if(sector == SUPERBLOCK_START_SECTOR) return super.buf;
+  if(sector < SECTOR_BITMAP_START_SECTOR) return inode_bitmap+(sector-INODE_BITMAP_START_SECTOR)*SECTOR_SIZE;
+  return sector_bitmap+(sector-SECTOR_BITMAP_START_SECTOR)*SECTOR_SIZE;
+}
 
-    if(nbytes < SECTOR_SIZE){
-      final_block = 1;            //This is the last sector
+// write back the superblock and bitmap sectors changed since the last
+// time; return 0 if successful, -1 otherwise
+static int metadata_write()
+{
+  int i;
+  for(i=0; i<INODE_CHUNK_MAP_START_SECTOR; i++) {
+    if(!meta_dirty[i]) continue;
+    if(Disk_Write(i, meta_sector(i)) < 0) {
+      dprintf("... failed writing the block %d\n", i);
+      osErrno = E_GENERAL;
+      return -1;
     }
-
-    if(Disk_Read(i, buf) < 0){                                      //Read the sector
-      dprintf("... failed reading the block %d\n" , i);
+    meta_dirty[i] = 0;
+  }
+  for(i=0; super.sb.refs_start > 0 && i<REFS_SECTORS; i++) {
+    if(!refs_dirty[i]) continue;
+    if(Disk_Write(super.sb.refs_start+i, (char*)sector_refs+i*SECTOR_SIZE) < 0) {
+      dprintf("... failed writing the block %d\n", super.sb.refs_start+i);
       osErrno = E_GENERAL;
-      return -1;  
+      return -1;
     }
+    refs_dirty[i] = 0;
+  }
+  return 0;
+}
+
+static int bit_isset(char* map, int ibit)
+{
+  return isNthBitSet(map[ibit/8], ibit%8);
+}
 
-    //Variables used to control the following loops
-    int b;       
-    int bitInbyte; 
-    int limit; 
+// a summary of the inode bitmap in two levels, so that finding a free
+// inode looks at a few words however big the table is: bit j of
+// inode_summary[k] is set when byte 64*k+j of the bitmap has a free
+// inode, and bit k%64 of inode_summary_top[k/64] when inode_summary[k]
+// has any bit set; it is rebuilt whenever the bitmap is loaded
+#define SUMMARY_WORDS ((INODE_BITMAP_SIZE+63)/64)         //128 in our program
+#define SUMMARY_TOP_WORDS ((SUMMARY_WORDS+63)/64)         //2 in our program
+static unsigned long long inode_summary[SUMMARY_WORDS];
+static unsigned long long inode_summary_top[SUMMARY_TOP_WORDS];
+
+// bring the summary up to date after a change to byte 'byte' of the
+// inode bitmap
+static void summary_update(int byte)
+{
+  int k = byte/64;
+  if((unsigned char)inode_bitmap[byte] != 255) inode_summary[k] |= 1ULL<<(byte%64);
+  else inode_summary[k] &= ~(1ULL<<(byte%64));
+  if(inode_summary[k]) inode_summary_top[k/64] |= 1ULL<<(k%64);
+  else inode_summary_top[k/64] &= ~(1ULL<<(k%64));
+}
 
-    if(final_block == 1){                  //This is the last sector
-      limit = nbytes;
-    }else{                                  //We need to check more than one sector
-      limit = SECTOR_SIZE;
-    }      
-                                   
-    for(b=0; b<limit; b++){                          //Going through all the completed bytes in the sector
-      for(bitInbyte =0; bitInbyte<8; bitInbyte++){  //Checking all the bits inside this byte
-        location ++;
-        if(!isNthBitSet(buf[b], bitInbyte)){        //Chek if this bit is not set          
-           
-          buf[b] = setNthBitSet(buf[b], bitInbyte);          //Set this bit
-           
-          if(Disk_Write(i, buf) < 0) {              //Write the sector back
-            dprintf("... failed writing the block %d\n" , i);
-            osErrno = E_GENERAL;
-            return -1;
-          }
-          return location;        //Return the location found 
-        }
-        
-      }   //End of the loop through the bits within the byte   
-    }   //End of the loop through the bytes within the sector
-
-    //If we reach this point we still need to do a last check
-    //1- We need to check the last bits in the last incompleted byte
-    if(final_block == 1){   //We need to check the last byte
-      for(bitInbyte =0; bitInbyte < extra_bits ; bitInbyte++){  //Checking the remaining bits in this byte
-        location ++;
-        if(!isNthBitSet(buf[b], bitInbyte)){        //Chek if this bit is not set
-           buf[b] = setNthBitSet(buf[b], bitInbyte);          //Set this bit
-
-          if(Disk_Write(i, buf) < 0) {              //Write the sector back
-            dprintf("... failed writing the block %d\n" , i);
-            osErrno = E_GENERAL;
-            return -1;
-          }
-          return location;        //Return the location found 
-        }
-      }   //End of the loop inside the last byte
+static void summary_build()
+{
+  int byte;
+  memset(inode_summary, 0, sizeof(inode_summary));
+  memset(inode_summary_top, 0, sizeof(inode_summary_top));
+  for(byte=0; byte<INODE_BITMAP_SIZE; byte++) summary_update(byte);
+}
+
+// return the first free inode at or after 'inode', -1 if there is none
+static int summary_next(int inode)
+{
+  // the rest of the byte the search starts in
+  for(; inode < MAX_FILES && inode%8; inode++)
+    if(!bit_isset(inode_bitmap, inode)) return inode;
+  if(inode >= MAX_FILES) return -1;
+
+  // then the first byte with a free inode: in the same summary word if
+  // there is one, or else in the next word the top level says has any
+  int byte = inode/8, k = byte/64, t;
+  unsigned long long w = inode_summary[k] & (~0ULL<<(byte%64));
+  if(!w) {
+    unsigned long long top = 0;
+    for(t=(k+1)/64; t<SUMMARY_TOP_WORDS; t++) {
+      top = inode_summary_top[t];
+      if(t == (k+1)/64) top &= ~0ULL<<((k+1)%64);
+      if(top) break;
     }
+    if(t >= SUMMARY_TOP_WORDS) return -1;
+    k = t*64+__builtin_ctzll(top);
+    w = inode_summary[k];
+  }
+  byte = k*64+__builtin_ctzll(w);
 
-  } // End of the loop of the sector  
-  /********* END OUR CODE **********/
-  return -1;
+  // and its first free bit (the bitmap goes from the high bit down)
+  inode = byte*8+__builtin_clz(~(unsigned char)inode_bitmap[byte] & 255)-24;
+  return inode < MAX_FILES ? inode : -1;
 }
 
-// reset the i-th bit of a bitmap with 'num' sectors starting from
-// 'start' sector; return 0 if successful, -1 otherwise
-static int bitmap_reset(int start, int num, int ibit)
+// return the entry of the extent histogram for extents of 'len' sectors
+static int extent_bucket(int len)
 {
-  /*********BEGING OUR CODE **********/
-  //printf("***************Inside bitmap init*************\n");
-  int nbytes = ibit/8;                       // Number of completed bytes before the one that contains the bit we are going to reset  
-  int extra_bits = ibit % 8;                 //Position of the bit to reset within the last byte
-  char buf[SECTOR_SIZE];                      //Buffer sector  
-          
-    if(nbytes > SECTOR_SIZE*num){
-      dprintf("... Error ibit=%d passed to reset is to big for a sector \n" , ibit);  //incorrect number of ibit (greater than the sector size)
-      return -1;                 
-    }
+  int bucket = 0;
+  while(len >>= 1) bucket++;
+  return bucket < FS_EXTENT_BUCKETS ? bucket : FS_EXTENT_BUCKETS-1;
+}
 
-    while(nbytes> SECTOR_SIZE){
-      nbytes = nbytes- SECTOR_SIZE;   //Go straight to the last sector 
-    }
+// count one more (delta=1) or one less (delta=-1) free extent of
+// 'len' sectors in the histogram of the superblock
+static void extent_count(int len, int delta)
+{
+  if(len > 0) super.sb.extents[extent_bucket(len)] += delta;
+}
 
-    if(Disk_Read(start, buf) < 0){                                      //Read the sector
-      dprintf("... failed reading the block %d\n" , start);
-      osErrno = E_GENERAL;
-      return -1;  
+// an index of the free extents beside the sector bitmap, built from it
+// whenever the bitmaps are loaded: a treap (a binary search tree kept
+// balanced by random priorities) of the extents by their first sector,
+// where every node also knows the longest extent below it; finding the
+// extent around a sector, the first one at or after a sector that is
+// long enough, and the longest one all take O(log n) steps
+#define FREE_EXTENTS_MAX (TOTAL_SECTORS/2+1)
+typedef struct _free_extent {
+  int start;        // first sector of the extent
+  int len;          // number of sectors in it
+  int longest;      // the longest extent in this subtree
+  unsigned prio;    // random; a parent's is never lower than its children's
+  int left, right;  // subtrees (0 for none)
+} free_extent_t;
+static free_extent_t fx[FREE_EXTENTS_MAX+1]; // fx[0] stands for no node
+static int fx_root;   // the tree
+static int fx_unused; // the nodes not in the tree, linked through 'right'
+
+static void fx_update(int t)
+{
+  int longest = fx[t].len;
+  if(fx[fx[t].left].longest > longest) longest = fx[fx[t].left].longest;
+  if(fx[fx[t].right].longest > longest) longest = fx[fx[t].right].longest;
+  fx[t].longest = longest;
+}
+
+// split tree 't' into the extents starting before 'sector' and the rest
+static void fx_split(int t, int sector, int* before, int* rest)
+{
+  if(!t) { *before = *rest = 0; return; }
+  if(fx[t].start < sector) {
+    fx_split(fx[t].right, sector, &fx[t].right, rest);
+    *before = t;
+  } else {
+    fx_split(fx[t].left, sector, before, &fx[t].left);
+    *rest = t;
+  }
+  fx_update(t);
+}
+
+// join two trees, all of whose extents in 'a' come before those in 'b'
+static int fx_merge(int a, int b)
+{
+  if(!a || !b) return a ? a : b;
+  if(fx[a].prio > fx[b].prio) {
+    fx[a].right = fx_merge(fx[a].right, b);
+    fx_update(a);
+    return a;
+  }
+  fx[b].left = fx_merge(a, fx[b].left);
+  fx_update(b);
+  return b;
+}
+
+// add a free extent to the index; an empty one is ignored
+static void fx_insert(int start, int len)
+{
+  static unsigned seed = 2463534242u;
+  if(len <= 0) return;
+  int t = fx_unused, a, b;
+  fx_unused = fx[t].right;
+  seed ^= seed<<13; seed ^= seed>>17; seed ^= seed<<5;
+  fx[t].start = start;
+  fx[t].len = fx[t].longest = len;
+  fx[t].prio = seed;
+  fx[t].left = fx[t].right = 0;
+  fx_split(fx_root, start, &a, &b);
+  fx_root = fx_merge(fx_merge(a, t), b);
+}
+
+// take the free extent starting at 'start' out of the index
+static void fx_remove(int start)
+{
+  int a, t, b;
+  fx_split(fx_root, start, &a, &t);
+  fx_split(t, start+1, &t, &b);
+  fx[t].right = fx_unused;
+  fx_unused = t;
+  fx_root = fx_merge(a, b);
+}
+
+// return the free extent starting at or before 'sector' that starts
+// last, 0 if none
+static int fx_floor(int sector)
+{
+  int t = fx_root, found = 0;
+  while(t) {
+    if(fx[t].start <= sector) { found = t; t = fx[t].right; }
+    else t = fx[t].left;
+  }
+  return found;
+}
+
+// return how many runs of 'count' sectors the free extents in tree 't'
+// can be cut into; subtrees with no extent that long are skipped
+static int fx_runs(int t, int count)
+{
+  if(!t || fx[t].longest < count) return 0;
+  return fx[t].len/count+fx_runs(fx[t].left, count)+fx_runs(fx[t].right, count);
+}
+
+// return the first free extent in tree 't' starting at or after
+// 'sector' with at least 'count' sectors, 0 if none
+static int fx_fit(int t, int sector, int count)
+{
+  while(t && fx[t].longest >= count) {
+    if(fx[t].start < sector) { t = fx[t].right; continue; }
+    int found = fx_fit(fx[t].left, sector, count);
+    if(found) return found;
+    if(fx[t].len >= count) return t;
+    t = fx[t].right;
+  }
+  return 0;
+}
+
+// rebuild the index from the sector bitmap in memory
+static void fx_build()
+{
+  int i, run = 0;
+  for(i=1; i<=FREE_EXTENTS_MAX; i++) fx[i].right = i < FREE_EXTENTS_MAX ? i+1 : 0;
+  memset(&fx[0], 0, sizeof(free_extent_t));
+  fx_unused = 1;
+  fx_root = 0;
+  for(i=DATABLOCK_START_SECTOR; i<=TOTAL_SECTORS; i++) {
+    if(i < TOTAL_SECTORS && !bit_isset(sector_bitmap, i)) run++;
+    else if(run > 0) {
+      fx_insert(i-run, run);
+      run = 0;
     }
+  }
+}
+
+// the dedup index finds a file's data sector by its content (see
+// FS_Dedup): every sector indexed is chained into the bucket of its
+// hash; since a sector found is always read back and compared, an
+// entry only has to go when its sector is freed (and may be taken for
+// something that is not file data), not when the sector is rewritten
+#define DEDUP_BUCKETS 4096
+static int dedup_on;                           // share whole sectors as they are written
+static int dedup_head[DEDUP_BUCKETS];          // first sector in each bucket, 0 if none
+static int dedup_next[TOTAL_SECTORS];          // next sector in the same bucket
+static unsigned int dedup_hash[TOTAL_SECTORS]; // hash of each sector when indexed
+static char dedup_indexed[TOTAL_SECTORS];
+
+// FNV-1a over a whole sector
+static unsigned int dedup_hash_of(char* buf)
+{
+  unsigned int h = 2166136261u;
+  int i;
+  for(i=0; i<SECTOR_SIZE; i++) h = (h^(unsigned char)buf[i])*16777619u;
+  return h;
+}
 
-    static unsigned char mask[] = {127, 191, 223, 239, 247, 251, 253, 254};
-    buf[nbytes] = (buf[nbytes] & mask[extra_bits]);
+static void dedup_reset()
+{
+  memset(dedup_head, 0, sizeof(dedup_head));
+  memset(dedup_indexed, 0, sizeof(dedup_indexed));
+}
 
-    if(Disk_Write(start, buf) < 0) {                                        //Write the sector back
-            dprintf("... failed writing the block %d\n" , start);
-            osErrno = E_GENERAL;
-            return -1;
-          }
-    
+static void dedup_forget(int sector)
+{
+  if(!dedup_indexed[sector]) return;
+  int* p = &dedup_head[dedup_hash[sector]%DEDUP_BUCKETS];
+  while(*p != sector) p = &dedup_next[*p];
+  *p = dedup_next[sector];
+  dedup_indexed[sector] = 0;
+}
+
+// index a sector of file data that now holds content with this hash
+static void dedup_insert(int sector, unsigned int hash)
+{
+  dedup_forget(sector);
+  int b = hash%DEDUP_BUCKETS;
+  dedup_hash[sector] = hash;
+  dedup_next[sector] = dedup_head[b];
+  dedup_head[b] = sector;
+  dedup_indexed[sector] = 1;
+}
+
+// return an indexed sector holding exactly 'buf' (whose hash is given)
+// that may still be shared, or 0 if there is none
+static int dedup_find(char* buf, unsigned int hash)
+{
+  int sector;
+  for(sector=dedup_head[hash%DEDUP_BUCKETS]; sector; sector=dedup_next[sector]) {
+    char other[SECTOR_SIZE];
+    if(dedup_hash[sector] != hash || sector_refs[sector] >= REFS_MAX) continue;
+    if(Disk_Read(sector, other) == 0 && !memcmp(buf, other, SECTOR_SIZE)) return sector;
+  }
+  return 0;
+}
+
+// a few clusters of compressed files are kept decompressed, so that
+// reading a file a bit at a time doesn't decompress the same cluster
+// over and over; cluster -1 of an inode is its cluster map; what is
+// cached for an inode only changes with the file itself, and is dropped
+// when the inode is freed
+#define CLUSTER_CACHE_SIZE 8
+static struct {
+  int inode;                // 0 means the entry is not used
+  int cluster;
+  char data[CLUSTER_SIZE];
+} cluster_cache[CLUSTER_CACHE_SIZE];
+static int cluster_cache_next; // the entry to replace next
+
+// drop what is cached for an inode, or for all of them with -1
+static void cluster_cache_drop(int inode)
+{
+  int i;
+  for(i=0; i<CLUSTER_CACHE_SIZE; i++)
+    if(inode < 0 || cluster_cache[i].inode == inode) cluster_cache[i].inode = 0;
+}
+
+static char* cluster_cache_find(int inode, int cluster)
+{
+  int i;
+  for(i=0; i<CLUSTER_CACHE_SIZE; i++)
+    if(cluster_cache[i].inode == inode && cluster_cache[i].cluster == cluster) return cluster_cache[i].data;
+  return NULL;
+}
+
+static void cluster_cache_put(int inode, int cluster, char* data, int size)
+{
+  char* p = cluster_cache_find(inode, cluster);
+  if(!p) {
+    int i = cluster_cache_next;
+    cluster_cache_next = (i+1)%CLUSTER_CACHE_SIZE;
+    cluster_cache[i].inode = inode;
+    cluster_cache[i].cluster = cluster;
+    p = cluster_cache[i].data;
+  }
+  memcpy(p, data, size);
+}
+
+// read the superblock, the bitmaps and the inode chunk map from disk;
+// return 0 if successful, -1 otherwise
+static int load_metadata()
+{
+  int i;
+  for(i=0; i<INODE_CHUNK_MAP_START_SECTOR; i++)
+    if(Disk_Read(i, meta_sector(i)) < 0) return -1;
+  memset(meta_dirty, 0, sizeof(meta_dirty));
+  memset(sector_refs, 0, sizeof(sector_refs));
+  memset(refs_dirty, 0, sizeof(refs_dirty));
+  if(super.sb.refs_start < DATABLOCK_START_SECTOR || super.sb.refs_start+REFS_SECTORS > TOTAL_SECTORS) {
+    if(super.sb.refs_start != 0) dprintf("... the reference counts have a bad place (sector %d)\n", super.sb.refs_start);
+    super.sb.refs_start = 0; // (fsck tells)
+  }
+  for(i=0; super.sb.refs_start > 0 && i<REFS_SECTORS; i++)
+    if(Disk_Read(super.sb.refs_start+i, (char*)sector_refs+i*SECTOR_SIZE) < 0) return -1;
+  dedup_reset();
+  cluster_cache_drop(-1);
+  summary_build();
+  fx_build();
+  return load_inode_chunks();
+}
+
+// mark the free sectors 'first' to 'first+count-1' used, in memory only
+static void sectors_take(int first, int count)
+{
+  int t = fx_floor(first), i;
+  if(!t || fx[t].start+fx[t].len < first+count) {
+    dprintf("... sectors %d-%d are not free, can't take them\n", first, first+count-1);
+    return;
+  }
+  int left = fx[t].start, right = left+fx[t].len;
+  fx_remove(left);
+  fx_insert(left, first-left);
+  fx_insert(first+count, right-first-count);
+  extent_count(right-left, -1);
+  extent_count(first-left, 1);
+  extent_count(right-first-count, 1);
+  for(i=first; i<first+count; i++) {
+    sector_bitmap[i/8] = setNthBitSet(sector_bitmap[i/8], i%8);
+    meta_dirty[SECTOR_BITMAP_START_SECTOR+i/8/SECTOR_SIZE] = 1;
+    super.sb.ag_free_sectors[SECTOR_AG(i)]--;
+  }
+  super.sb.free_sectors -= count;
+  meta_dirty[SUPERBLOCK_START_SECTOR] = 1;
+}
+
+// drop a reference to a used data sector, in memory only; the sector
+// is marked free if no other file shares it, and is then merged with
+// the free extents right before and after it; return 1 if it was
+// freed, 0 if not
+static int sector_release(int sector)
+{
+  if(sector < DATABLOCK_START_SECTOR || sector >= TOTAL_SECTORS || !bit_isset(sector_bitmap, sector)) {
+    dprintf("... sector %d is not in use, can't free it\n", sector);
+    return 0;
+  }
+  if(sector_refs[sector] > 0) {
+    sector_refs[sector]--;
+    refs_dirty[sector/REFS_PER_SECTOR] = 1;
+    return 0;
+  }
+  sector_bitmap[sector/8] &= ~(128>>(sector%8));
+  meta_dirty[SECTOR_BITMAP_START_SECTOR+sector/8/SECTOR_SIZE] = 1;
+  dedup_forget(sector);
+  int left = sector, right = sector+1;
+  int t = fx_floor(sector-1);
+  if(t && fx[t].start+fx[t].len == sector) {
+    left = fx[t].start;
+    fx_remove(left);
+  }
+  t = fx_floor(sector+1);
+  if(t && fx[t].start == sector+1) {
+    right += fx[t].len;
+    fx_remove(sector+1);
+  }
+  fx_insert(left, right-left);
+  extent_count(sector-left, -1);
+  extent_count(right-sector-1, -1);
+  extent_count(right-left, 1);
+  super.sb.free_sectors++;
+  super.sb.ag_free_sectors[SECTOR_AG(sector)]++;
+  meta_dirty[SUPERBLOCK_START_SECTOR] = 1;
+  return 1;
+}
+
+// mark a used inode of the given type free, in memory only
+static void inode_release(int inode, int type)
+{
+  if(inode <= 0 || inode >= MAX_FILES || !bit_isset(inode_bitmap, inode)) {
+    dprintf("... inode %d is not in use, can't free it\n", inode);
+    return;
+  }
+  inode_bitmap[inode/8] &= ~(128>>(inode%8));
+  summary_update(inode/8);
+  cluster_cache_drop(inode);
+  meta_dirty[INODE_BITMAP_START_SECTOR+inode/8/SECTOR_SIZE] = 1;
+  super.sb.free_inodes++;
+  super.sb.ag_free_inodes[INODE_AG(inode)]++;
+  if(type == 1) super.sb.ag_dirs[INODE_AG(inode)]--;
+  meta_dirty[SUPERBLOCK_START_SECTOR] = 1;
+}
+
+// allocate the first run of 'count' consecutive free sectors at or
+// after 'goal', wrapping around to the start of the data blocks if
+// there is none, and return the first of them; return -1 if there is
+// no such run anywhere
+static int sectors_alloc(int goal, int count)
+{
+  if(super.sb.free_sectors < count || fx[fx_root].longest < count) return -1;
+  if(goal < DATABLOCK_START_SECTOR || goal >= TOTAL_SECTORS) goal = DATABLOCK_START_SECTOR;
+  int t = fx_floor(goal), first;
+  if(t && fx[t].start+fx[t].len >= goal+count) first = goal;
+  else if((t = fx_fit(fx_root, goal, count)) || (t = fx_fit(fx_root, DATABLOCK_START_SECTOR, count))) first = fx[t].start;
+  else return -1;
+  sectors_take(first, count);
+  if(metadata_write() < 0) return -1;
+  return first;
+}
+
+// free a data sector; return 0 if successful, -1 otherwise
+static int sector_free(int sector)
+{
+  sector_release(sector);
+  return metadata_write();
+}
+
+// return the allocation group for a new inode of the given type under
+// 'parent': a file goes with its directory, and a directory to the
+// group with the fewest directories of those with at least the average
+// share of free inodes and sectors (the most free sectors wins a tie)
+static int ag_choose(int parent, int type)
+{
+  int home = INODE_AG(parent), best = -1, g;
+  if(type != 1) return home;
+  for(g=0; g<AG_COUNT; g++) {
+    int ninodes = g < AG_COUNT-1 ? AG_INODES : MAX_FILES-g*AG_INODES;
+    int nsectors = g < AG_COUNT-1 ? AG_SECTORS : TOTAL_SECTORS-g*AG_SECTORS;
+    if(g == 0) nsectors -= DATABLOCK_START_SECTOR;
+    if((long long)super.sb.ag_free_inodes[g]*MAX_FILES < (long long)super.sb.free_inodes*ninodes ||
+       (long long)super.sb.ag_free_sectors[g]*(TOTAL_SECTORS-DATABLOCK_START_SECTOR) <
+       (long long)super.sb.free_sectors*nsectors) continue;
+    if(best < 0 || super.sb.ag_dirs[g] < super.sb.ag_dirs[best] ||
+       (super.sb.ag_dirs[g] == super.sb.ag_dirs[best] &&
+        super.sb.ag_free_sectors[g] > super.sb.ag_free_sectors[best])) best = g;
+  }
+  return best < 0 ? home : best;
+}
+
+// allocate a free inode of the given type for a new entry of directory
+// 'parent' and return it: the first one in the group ag_choose() picks,
+// or else in the groups after it (wrapping around); return -1 if the
+// inode table is full
+static int inode_alloc(int parent, int type)
+{
+  if(super.sb.free_inodes <= 0) return -1;
+  int i = summary_next(ag_choose(parent, type)*AG_INODES);
+  if(i < 0) i = summary_next(0);
+  if(i < 0) return -1;
+  inode_bitmap[i/8] = setNthBitSet(inode_bitmap[i/8], i%8);
+  summary_update(i/8);
+  meta_dirty[INODE_BITMAP_START_SECTOR+i/8/SECTOR_SIZE] = 1;
+  super.sb.free_inodes--;
+  super.sb.ag_free_inodes[INODE_AG(i)]--;
+  if(type == 1) super.sb.ag_dirs[INODE_AG(i)]++;
+  meta_dirty[SUPERBLOCK_START_SECTOR] = 1;
+  if(metadata_write() < 0) return -1;
+  dprintf("... inode %d in allocation group %d\n", i, INODE_AG(i));
+  return i;
+}
+
+// free an inode of the given type; return 0 if successful, -1 otherwise
+static int inode_free(int inode, int type)
+{
+  inode_release(inode, type);
+  return metadata_write();
+}
+
+// fill in the free inode and sector counts of each allocation group
+// from the bitmaps in memory (the directories are counted elsewhere)
+static void ag_tally(superblock_t* sb)
+{
+  int i;
+  memset(sb->ag_free_inodes, 0, sizeof(sb->ag_free_inodes));
+  memset(sb->ag_free_sectors, 0, sizeof(sb->ag_free_sectors));
+  for(i=0; i<MAX_FILES; i++)
+    if(!bit_isset(inode_bitmap, i)) sb->ag_free_inodes[INODE_AG(i)]++;
+  for(i=DATABLOCK_START_SECTOR; i<TOTAL_SECTORS; i++)
+    if(!bit_isset(sector_bitmap, i)) sb->ag_free_sectors[SECTOR_AG(i)]++;
+}
+
+// return where to start looking for a new data sector for 'inode':
+// right after its data sector 'prev' if it has one, or else right
+// after the inode itself
+static int data_goal(int inode, int prev)
+{
+  return prev > 0 ? prev+1 : inode_table_sector(inode)+1;
+}
+
+// give the inode table the chunk holding 'inode' if it has none yet;
+// the chunk is not cleared, since an inode is always wiped when it is
+// handed out; return 0 if successful, -1 otherwise
+static int inode_chunk_alloc(int inode)
+{
+  int chunk = inode/INODES_PER_CHUNK;
+  if(inode_chunks[chunk] > 0) return 0;
+  int ag = INODE_AG(inode);
+  int start = sectors_alloc(ag*AG_SECTORS, INODE_CHUNK_SECTORS);
+  if(start < 0) {
+    dprintf("... error: no room for inode table chunk %d\n", chunk);
+    return -1;
+  }
+  inode_chunks[chunk] = start;
+  int map_sector = chunk*sizeof(int)/SECTOR_SIZE;
+  if(Disk_Write(INODE_CHUNK_MAP_START_SECTOR+map_sector, (char*)inode_chunks+map_sector*SECTOR_SIZE) < 0) return -1;
+  dprintf("... inode table chunk %d at disk sectors %d-%d\n", chunk, start, start+INODE_CHUNK_SECTORS-1);
   return 0;
-  /********* END OUR CODE **********/
+}
+
+// return how many more inodes can be handed out: the free ones in the
+// chunks the table has, and those of as many new chunks as the free
+// extents have room for
+static int inodes_reachable()
+{
+  int chunk, chunks = 0;
+  for(chunk=0; chunk<INODE_CHUNKS; chunk++)
+    if(inode_chunks[chunk] > 0) chunks++;
+  int more = fx_runs(fx_root, INODE_CHUNK_SECTORS);
+  if(more > INODE_CHUNKS-chunks) more = INODE_CHUNKS-chunks;
+  return chunks*INODES_PER_CHUNK-(MAX_FILES-super.sb.free_inodes)+more*INODES_PER_CHUNK;
 }
 
 // return 1 if the file name is illegal; otherwise, return 0; legal
@@ -346,12 +928,12 @@ static int illegal_filename(char* name)
 // directory, or there's read error, etc.)
 static int find_child_inode(int parent_inode, char* fname, int *cached_inode_sector, char* cached_inode_buffer){
 
-  int cached_start_entry = ((*cached_inode_sector)-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = parent_inode-cached_start_entry;
+  assert(*cached_inode_sector == inode_table_sector(parent_inode));
+  int offset = parent_inode%INODES_PER_SECTOR;
   assert(0 <= offset && offset < INODES_PER_SECTOR);
   inode_t* parent = (inode_t*)(cached_inode_buffer+offset*sizeof(inode_t));
   dprintf("... load parent inode: %d (size=%d, type=%d)\n",	parent_inode, parent->size, parent->type);
-  if(parent->type != 1) {
+  if(INODE_TYPE(parent) != 1) {
     dprintf("... parent not a directory\n");
     return -2;
   }
@@ -368,7 +950,7 @@ static int find_child_inode(int parent_inode, char* fname, int *cached_inode_sec
 	       // found the file/directory; update inode cache
 	       int child_inode = ((dirent_t*)buf)[i].inode;
 	       dprintf("... found child_inode=%d\n", child_inode);
-	       int sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
+	       int sector = inode_table_sector(child_inode);
 	       if(sector != (*cached_inode_sector)) {
 	         *cached_inode_sector = sector;
 	         if(Disk_Read(sector, cached_inode_buffer) < 0) return -2;
@@ -412,7 +994,7 @@ static int follow_path(char* path, int* last_inode, char* last_fname)
   
   int parent_inode = -1, child_inode = 0; // start from root
   // cache the disk sector containing the root inode
-  int cached_sector = INODE_TABLE_START_SECTOR;
+  int cached_sector = inode_table_sector(0);
   char cached_buffer[SECTOR_SIZE];
   if(Disk_Read(cached_sector, cached_buffer) < 0) return -1;
   dprintf("... load inode table for root from disk sector %d\n", cached_sector);
@@ -452,63 +1034,107 @@ static int follow_path(char* path, int* last_inode, char* last_fname)
   }
 }
 
-// add a new file or directory (determined by 'type') of given name
-// 'file' under parent directory represented by 'parent_inode'
-int add_inode(int type, int parent_inode, char* file)
+// load the disk sector containing the given inode into 'inode_buffer'
+// and return a pointer to the inode in it; return NULL on read error
+static inode_t* load_inode(int inode, char* inode_buffer)
 {
-  // get a new inode for child
-  int child_inode = bitmap_first_unused(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, INODE_BITMAP_SIZE);
-  
-  if(child_inode < 0) {
-    dprintf("... error: inode table is full\n");
-    return -1; 
-  }
-  dprintf("... new child inode %d\n", child_inode);
-
-  // load the disk sector containing the child inode
-  int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
- // printf("Inode sector = %d\n", inode_sector);
+  int inode_sector = inode_table_sector(inode);
+  if(Disk_Read(inode_sector, inode_buffer) < 0) return NULL;
+  return (inode_t*)(inode_buffer+(inode%INODES_PER_SECTOR)*sizeof(inode_t));
+}
 
+// remove the dirent pointing to 'child_inode' from the directory
+// 'parent_inode' by moving the directory's last dirent into its place;
+// the sector of the last dirent group is given back once it empties;
+// return 0 if successful, -1 on error, -2 if parent is not a directory
+static int dirent_remove(int parent_inode, int child_inode)
+{
+  int inode_sector = inode_table_sector(parent_inode);
   char inode_buffer[SECTOR_SIZE];
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
+  inode_t* parent = load_inode(parent_inode, inode_buffer);
+  if(!parent) return -1;
+  dprintf("... get parent inode %d (size=%d, type=%d)\n", parent_inode, parent->size, parent->type);
+  if(INODE_TYPE(parent) != 1) {
+    dprintf("... error: parent inode is not directory\n");
+    return -2;
+  }
+  if(parent->size <= 0) return -1;
+
+  // the last dirent, which fills the hole
+  int last = parent->size-1;
+  int last_sector = parent->data[last/DIRENTS_PER_SECTOR];
+  char last_buffer[SECTOR_SIZE];
+  if(Disk_Read(last_sector, last_buffer) < 0) return -1;
+  dirent_t* last_dirent = (dirent_t*)last_buffer+last%DIRENTS_PER_SECTOR;
+
+  int group, i, found = 0;
+  for(group=0; !found && group*DIRENTS_PER_SECTOR<=last; group++) {
+    char dirent_buffer[SECTOR_SIZE];
+    char* buf = dirent_buffer;
+    if(group == last/DIRENTS_PER_SECTOR) buf = last_buffer;
+    else if(Disk_Read(parent->data[group], dirent_buffer) < 0) return -1;
+    for(i=0; i<DIRENTS_PER_SECTOR && group*DIRENTS_PER_SECTOR+i<=last; i++) {
+      dirent_t* dirent = (dirent_t*)buf+i;
+      if(dirent->inode != child_inode) continue;
+      if(dirent != last_dirent) memcpy(dirent, last_dirent, sizeof(dirent_t));
+      memset(last_dirent, 0, sizeof(dirent_t));
+      if(buf != last_buffer && Disk_Write(parent->data[group], buf) < 0) return -1;
+      dprintf("... remove dirent of inode %d from group %d, disk sector %d\n", child_inode, group, parent->data[group]);
+      found = 1;
+      break;
+    }
+  }
+  if(!found) {
+    dprintf("... error: no dirent for inode %d\n", child_inode);
+    return -1;
+  }
 
-  // get the child inode
-  int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
- 
-  int offset = child_inode-inode_start_entry;
-  
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
+  parent->size--;
+  if(parent->size%DIRENTS_PER_SECTOR == 0) {
+    // the last group is empty now
+    sector_free(last_sector);
+    Disk_Discard(last_sector, 1);
+    parent->data[last/DIRENTS_PER_SECTOR] = 0;
+    dprintf("... free dirent group %d, disk sector %d\n", (int)(last/DIRENTS_PER_SECTOR), last_sector);
+  } else if(Disk_Write(last_sector, last_buffer) < 0) return -1;
 
-  // update the new child inode and write to disk
-  memset(child, 0, sizeof(inode_t));
-  child->type = type;
   if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... update child inode %d (size=%d, type=%d), update disk sector %d\n", child_inode, child->size, child->type, inode_sector);
+  dprintf("... update parent inode on disk sector %d\n", inode_sector);
+  return 0;
+}
 
+// append a dirent named 'file' for 'child_inode' to the directory
+// 'parent_inode'; return 0 if successful, -1 on error (or if the disk
+// is full), -2 if parent is not a directory
+static int dirent_add(int parent_inode, char* file, int child_inode)
+{
   // get the disk sector containing the parent inode
-  inode_sector = INODE_TABLE_START_SECTOR+parent_inode/INODES_PER_SECTOR;
+  char inode_buffer[SECTOR_SIZE];
+  int inode_sector = inode_table_sector(parent_inode);
   if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
   dprintf("... load inode table for parent inode %d from disk sector %d\n", parent_inode, inode_sector);
 
   // get the parent inode
-  inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  offset = parent_inode-inode_start_entry;
+  int inode_start_entry = parent_inode-parent_inode%INODES_PER_SECTOR;
+  int offset = parent_inode-inode_start_entry;
   assert(0 <= offset && offset < INODES_PER_SECTOR);
   inode_t* parent = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
   dprintf("... get parent inode %d (size=%d, type=%d)\n", parent_inode, parent->size, parent->type);
 
   // get the dirent sector
-  if(parent->type != 1) {
+  if(INODE_TYPE(parent) != 1) {
     dprintf("... error: parent inode is not directory\n");
     return -2; // parent not directory
   }
+  if(parent->size >= MAX_SECTORS_PER_FILE*DIRENTS_PER_SECTOR) {
+    dprintf("... error: parent directory is full\n");
+    return -1;
+  }
   int group = parent->size/DIRENTS_PER_SECTOR;
   char dirent_buffer[SECTOR_SIZE];
   if(group*DIRENTS_PER_SECTOR == parent->size) {
-    // new disk sector is needed
-    int newsec = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
+    // new disk sector is needed, best right after the last one
+    int newsec = sectors_alloc(data_goal(parent_inode, group > 0 ? parent->data[group-1] : 0), 1);
     if(newsec < 0) {
       dprintf("... error: disk is full\n");
       return -1;
@@ -539,34 +1165,90 @@ int add_inode(int type, int parent_inode, char* file)
   return 0;
 }
 
-// used by both File_Create() and Dir_Create(); type=0 is file, type=1
-// is directory
-int create_file_or_directory(int type, char* pathname)
+// add a new file or directory (determined by 'type') of given name
+// 'file' under parent directory represented by 'parent_inode'
+int add_inode(int type, int parent_inode, char* file)
 {
-  int child_inode;
-  char last_fname[MAX_NAME];
-  int parent_inode = follow_path(pathname, &child_inode, last_fname);
-  if(parent_inode >= 0) {
-    if(child_inode >= 0) {
-      dprintf("... file/directory '%s' already exists, failed to create\n", pathname);
-      osErrno = E_CREATE;
-      return -1;
-    } else {
-        if(add_inode(type, parent_inode, last_fname) >= 0) {
-  	      dprintf("... successfully created file/directory: '%s'\n", pathname);
-  	      return 0;
-        } else {
-  	      dprintf("... error: something wrong with adding child inode\n");
-  	      osErrno = E_CREATE;
-  	      return -1;
-        }
-      }
-  } else {
-    dprintf("... error: something wrong with the file/path: '%s'\n", pathname);
-    osErrno = E_CREATE;
+  // get a new inode for child
+  int child_inode = inode_alloc(parent_inode, type);
+  
+  if(child_inode < 0) {
+    dprintf("... error: inode table is full\n");
+    return -1; 
+  }
+  dprintf("... new child inode %d\n", child_inode);
+
+  // the inode may be the first one of a chunk the table doesn't have yet
+  if(inode_chunk_alloc(child_inode) < 0) {
+    inode_free(child_inode, type);
     return -1;
   }
-}
+
+  // load the disk sector containing the child inode
+  int inode_sector = inode_table_sector(child_inode);
+ // printf("Inode sector = %d\n", inode_sector);
+
+  char inode_buffer[SECTOR_SIZE];
+  if(Disk_Read(inode_sector, inode_buffer) < 0) {
+    inode_free(child_inode, type);
+    return -1;
+  }
+  dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
+
+  // get the child inode
+  int inode_start_entry = child_inode-child_inode%INODES_PER_SECTOR;
+ 
+  int offset = child_inode-inode_start_entry;
+  
+  assert(0 <= offset && offset < INODES_PER_SECTOR);
+  inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
+
+  // update the new child inode and write to disk
+  memset(child, 0, sizeof(inode_t));
+  child->type = type == 0 ? INODE_INLINE : type; // new files start out inline
+  if(Disk_Write(inode_sector, inode_buffer) < 0) {
+    inode_free(child_inode, type);
+    return -1;
+  }
+  dprintf("... update child inode %d (size=%d, type=%d), update disk sector %d\n", child_inode, child->size, child->type, inode_sector);
+
+  // and link it into the parent directory; if it can't be (the directory
+  // or the disk is full), nothing refers to the inode and it goes back
+  if(dirent_add(parent_inode, file, child_inode) < 0) {
+    inode_free(child_inode, type);
+    return -1;
+  }
+  return 0;
+}
+
+// used by both File_Create() and Dir_Create(); type=0 is file, type=1
+// is directory
+int create_file_or_directory(int type, char* pathname)
+{
+  int child_inode;
+  char last_fname[MAX_NAME];
+  int parent_inode = follow_path(pathname, &child_inode, last_fname);
+  if(parent_inode >= 0) {
+    if(child_inode >= 0) {
+      dprintf("... file/directory '%s' already exists, failed to create\n", pathname);
+      osErrno = E_CREATE;
+      return -1;
+    } else {
+        if(add_inode(type, parent_inode, last_fname) >= 0) {
+  	      dprintf("... successfully created file/directory: '%s'\n", pathname);
+  	      return 0;
+        } else {
+  	      dprintf("... error: something wrong with adding child inode\n");
+  	      osErrno = E_CREATE;
+  	      return -1;
+        }
+      }
+  } else {
+    dprintf("... error: something wrong with the file/path: '%s'\n", pathname);
+    osErrno = E_CREATE;
+    return -1;
+  }
+}
 
 // remove the child from parent; the function is called by both
 // File_Unlink() and Dir_Unlink(); the function returns 0 if success,
@@ -575,14 +1257,14 @@ int remove_inode(int type, int parent_inode, int child_inode)
 {
   /********* BEGING OUR CODE **********/
   //First we need to load the child inode sector 
-  int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
+  int inode_sector = inode_table_sector(child_inode);
  
   char inode_buffer[SECTOR_SIZE];
   if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
   dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
 
   // get the child inode
-  int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
+  int inode_start_entry = child_inode-child_inode%INODES_PER_SECTOR;
  
   int offset = child_inode-inode_start_entry;
   
@@ -590,25 +1272,37 @@ int remove_inode(int type, int parent_inode, int child_inode)
   inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
 
   //Now we need to check the child inode for errors
-  if(child->type != type){    //If the type pass to the function does not match the child type
+  if(INODE_TYPE(child) != type){    //If the type pass to the function does not match the child type
     return -3;                //ERROR -3 if wrong type
   }
 
-  if(child->type == 1 && child->size > 0){    //If this inode is a directory and is not empty
+  if(INODE_TYPE(child) == 1 && child->size > 0){    //If this inode is a directory and is not empty
     return -2;                                //ERROR -2 if directory not empty,
   }
 
-  //Now we need to reclaim the data sectores of the child inode only if the inode is a file
-  //if the inode is a directory is must already be empty (no data inside) in order to delete it
-  if(child->type == 0){ //If I am deleting a file
-    int i;
-    for(i=0; i<MAX_SECTORS_PER_FILE; i++){   //Going through all the sectors 
-        if(child->data[i] > 0){           //There is valid data in this sector that we need to clear
-          bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, child->data[i]);    //Clear the entry in the sector bitmap
-          dprintf("... reseting bit sector %d from data index [%d] \n", child->data[i], i );
+  //Now we need to reclaim the data sectores of the child inode; a directory must already
+  //be empty in order to delete it, but it still owns the sectors its dirents used to live in
+  int i;
+  int discard_start = -1, discard_count = 0;  //Run of freed sectors not yet discarded
+  int nsectors = IS_INLINE(child) ? 0 : MAX_SECTORS_PER_FILE;   //An inline file has no sectors
+  for(i=0; i<nsectors; i++){   //Going through all the sectors 
+      if(child->data[i] > 0){           //There is valid data in this sector that we need to clear
+        //Clear the entry in the sector bitmap (written back with the inode bitmap below),
+        //unless a clone still shares the sector
+        if(!sector_release(child->data[i])) continue;
+        dprintf("... reseting bit sector %d from data index [%d] \n", child->data[i], i );
+
+        //Tell the disk the old contents are garbage; adjacent sectors go in one call
+        if(discard_count > 0 && child->data[i] == discard_start+discard_count){
+          discard_count++;
+        }else{
+          if(discard_count > 0) Disk_Discard(discard_start, discard_count);
+          discard_start = child->data[i];
+          discard_count = 1;
         }
       }
   }
+  if(discard_count > 0) Disk_Discard(discard_start, discard_count);
   //At this point we are ready to delete the inode
   // Clear the child inode and write to disk
   memset(child, 0, sizeof(inode_t));
@@ -617,112 +1311,1159 @@ int remove_inode(int type, int parent_inode, int child_inode)
   dprintf("...  update disk sector %d\n", inode_sector);
 
   //Now we update the inode bitmap
-  bitmap_reset(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, child_inode);
+  inode_free(child_inode, type);
 
-  //Now we need to update the parent inode
-  // get the disk sector containing the parent inode
-  inode_sector = INODE_TABLE_START_SECTOR+parent_inode/INODES_PER_SECTOR;
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for parent inode %d from disk sector %d\n", parent_inode, inode_sector);
+  //Now we need to take the child out of the parent directory
+  return dirent_remove(parent_inode, child_inode);
+  /********* END OUR CODE **********/ 
+  
+}
 
-  // get the parent inode
-  inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  offset = parent_inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* parent = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-  dprintf("... get parent inode %d (size=%d, type=%d)\n", parent_inode, parent->size, parent->type);
+// move the content of an inline file (inode 'inode', in 'child') out
+// to a data sector of its own, if it has any, and clear the inline
+// flag; the inode is not written back; return 0 if successful, or the
+// osErrno code if not
+static int inline_spill(int inode, inode_t* child)
+{
+  char sector_buffer[SECTOR_SIZE];
+  memset(sector_buffer, 0, SECTOR_SIZE);
+  memcpy(sector_buffer, child->data, child->size);
+  memset(child->data, 0, sizeof(child->data));
+  if(child->size > 0) {
+    int newsec = sectors_alloc(data_goal(inode, 0), 1);
+    if(newsec < 0 || Disk_Write(newsec, sector_buffer) < 0) {
+      dprintf("... error: can't move the inline data to a sector\n");
+      if(newsec >= 0) sector_free(newsec);
+      memcpy(child->data, sector_buffer, child->size);
+      return newsec < 0 ? E_NO_SPACE : E_GENERAL;
+    }
+    child->data[0] = newsec;
+    dprintf("... moved %d inline bytes to disk sector %d\n", child->size, newsec);
+  }
+  child->type &= ~INODE_INLINE;
+  return 0;
+}
 
-  // get the dirent sector
-  if(parent->type != 1) {
-    dprintf("... error: parent inode is not directory\n");
-    return -2; // parent not directory
+// give a file (inode 'inode', in 'child') zero-filled sectors for its
+// first 'size' bytes wherever it has none yet; the missing sectors are
+// taken as one run, right after the file's last sector if there is
+// room, and only one at a time if there is no run that long; the inode
+// is not written back, even if this fails halfway; return 0 if
+// successful, or the osErrno code if not
+static int file_reserve(int inode, inode_t* child, int size)
+{
+  if(IS_INLINE(child)) {
+    if(size <= INLINE_SIZE) return 0;
+    int err = inline_spill(inode, child);
+    if(err) return err;
   }
-  
-  //Now we need to find in the parent inode the dirent structure that contains the child inode 
-  //And then swap it with the last dirent entry in the parent inode and decrement size
-   char dirent_buffer[SECTOR_SIZE];
-    int group = 0;
-    int entry = 0;    
-    dirent_t* current_dirent;
-  //First we are going to look for the last dirent entry in the parent inode
-
-  if(parent->size > 1){  //There are more files or directories in the parent dierctory 
-    int last_group = parent->size/DIRENTS_PER_SECTOR;
-    char last_dirent_buffer[SECTOR_SIZE];
-    int last_sector = parent->data[last_group];
-    if(Disk_Read(last_sector, last_dirent_buffer) < 0)    //Read the sector used by the last entry
+  int n = (size+SECTOR_SIZE-1)/SECTOR_SIZE, i, missing = 0, prev = 0;
+  for(i=0; i<n; i++) {
+    if(child->data[i] == 0) missing++;
+    else if(!missing) prev = child->data[i];
+  }
+  if(missing == 0) return 0;
+
+  int next = sectors_alloc(data_goal(inode, prev), missing);
+  if(next >= 0) Disk_Discard(next, missing); // reads back as zeroes
+  for(i=0; i<n; i++) {
+    if(child->data[i] != 0) continue;
+    if(next < 0) {
+      int sector = sectors_alloc(data_goal(inode, prev), 1);
+      if(sector < 0) return E_NO_SPACE;
+      Disk_Discard(sector, 1);
+      child->data[i] = prev = sector;
+    } else {
+      child->data[i] = prev = next++;
+    }
+  }
+  dprintf("... reserved %d sectors for inode %d\n", missing, inode);
+  return 0;
+}
+
+// make room for the reference counts the first time a sector is
+// shared; until then the table takes no space at all; return 0 if
+// successful, -1 if the disk is full or can't be written
+static int refs_alloc()
+{
+  if(super.sb.refs_start > 0) return 0;
+  int start = sectors_alloc(DATABLOCK_START_SECTOR, REFS_SECTORS);
+  if(start < 0) {
+    dprintf("... no room for the reference counts\n");
+    return -1;
+  }
+  super.sb.refs_start = start;
+  meta_dirty[SUPERBLOCK_START_SECTOR] = 1;
+  memset(sector_refs, 0, sizeof(sector_refs));
+  memset(refs_dirty, 1, sizeof(refs_dirty));
+  dprintf("... reference counts placed at sectors %d-%d\n", start, start+REFS_SECTORS-1);
+  return metadata_write();
+}
+
+// give a file (inode 'inode', in 'child') a copy of its own of its
+// i-th sector if it shares it with a clone; the content is copied only
+// if 'copy' is set (it need not be when the whole sector is about to be
+// overwritten); the inode is not written back; return 0 if successful,
+// or the osErrno code if not
+static int sector_unshare(int inode, inode_t* child, int i, int copy)
+{
+  int old = child->data[i];
+  if(old <= 0 || sector_refs[old] == 0) return 0;
+  int newsec = sectors_alloc(data_goal(inode, i > 0 ? child->data[i-1] : 0), 1);
+  if(newsec < 0) return E_NO_SPACE;
+  char buf[SECTOR_SIZE];
+  if(copy && (Disk_Read(old, buf) < 0 || Disk_Write(newsec, buf) < 0)) {
+    sector_free(newsec);
+    return E_GENERAL;
+  }
+  sector_release(old);
+  child->data[i] = newsec;
+  dprintf("... inode %d gets sector %d as its own copy of shared sector %d\n", inode, newsec, old);
+  return metadata_write() < 0 ? E_GENERAL : 0;
+}
+
+// clear the bytes of a file's last sector past its end (they may still
+// hold what was cut off earlier), so that the file (inode 'inode', in
+// 'child') can grow over them; return 0 if successful, or the osErrno
+// code if not
+static int file_clear_tail(int inode, inode_t* child)
+{
+  int i = child->size/SECTOR_SIZE;
+  if(IS_INLINE(child) || child->size%SECTOR_SIZE == 0 || child->data[i] == 0) return 0;
+  int err = sector_unshare(inode, child, i, 1);
+  if(err) return err;
+  char buf[SECTOR_SIZE];
+  if(Disk_Read(child->data[i], buf) < 0) return E_GENERAL;
+  memset(buf+child->size%SECTOR_SIZE, 0, SECTOR_SIZE-child->size%SECTOR_SIZE);
+  return Disk_Write(child->data[i], buf) < 0 ? E_GENERAL : 0;
+}
+
+// cut a file (in 'child') down to 'size' bytes and free the sectors
+// past it, with a single write of the bitmaps; the inode is
+// not written back; return 0 if successful, -1 otherwise
+static int file_shrink(inode_t* child, int size)
+{
+  child->size = size;
+  if(IS_INLINE(child)) {
+    memset((char*)child->data+size, 0, INLINE_SIZE-size);
+    return 0;
+  }
+  int i, discard_start = -1, discard_count = 0;
+  for(i=(size+SECTOR_SIZE-1)/SECTOR_SIZE; i<MAX_SECTORS_PER_FILE; i++) {
+    if(child->data[i] == 0) continue;
+    if(sector_release(child->data[i])) {
+      if(discard_count > 0 && child->data[i] == discard_start+discard_count) discard_count++;
+      else {
+        if(discard_count > 0) Disk_Discard(discard_start, discard_count);
+        discard_start = child->data[i];
+        discard_count = 1;
+      }
+    }
+    child->data[i] = 0;
+  }
+  if(discard_count > 0) Disk_Discard(discard_start, discard_count);
+  return metadata_write();
+}
+
+// the offset in the stream of cluster 'c', from the compressed lengths
+// of the clusters before it; with c=MAX_CLUSTERS, the length of the
+// whole stream
+static int cluster_offset(unsigned short* map, int c)
+{
+  int off = 0, j;
+  for(j=0; j<c; j++) off += map[j] & ~CLUSTER_RAW;
+  return off;
+}
+
+// read the sectors holding bytes 'from' up to 'to' of the stream of a
+// compressed file (in 'child') into 'buf', starting with the one 'from'
+// is in; return 0 if successful, -1 otherwise
+static int stream_read(inode_t* child, int from, int to, char* buf)
+{
+  int k;
+  if(to > STREAM_SIZE) return -1;
+  for(k=from/SECTOR_SIZE; k*SECTOR_SIZE<to; k++) {
+    if(child->data[1+k] <= 0 || Disk_Read(child->data[1+k], buf) < 0) return -1;
+    buf += SECTOR_SIZE;
+  }
+  return 0;
+}
+
+// get the cluster map of a compressed file (inode 'inode', in 'child');
+// a file without a map sector has nothing but zeroes; return 0 if
+// successful, -1 otherwise
+static int cluster_map_read(int inode, inode_t* child, unsigned short* map)
+{
+  char buf[SECTOR_SIZE];
+  char* cached = cluster_cache_find(inode, -1);
+  if(cached) {
+    memcpy(map, cached, MAX_CLUSTERS*sizeof(unsigned short));
+    return 0;
+  }
+  memset(buf, 0, SECTOR_SIZE);
+  if(child->data[0] > 0 && Disk_Read(child->data[0], buf) < 0) return -1;
+  memcpy(map, buf, MAX_CLUSTERS*sizeof(unsigned short));
+  cluster_cache_put(inode, -1, buf, MAX_CLUSTERS*sizeof(unsigned short));
+  return 0;
+}
+
+// make sure a compressed file has a map sector of its own to write the
+// map to; a new one gets the map as it is now, so the inode is never
+// left with a map sector holding junk; return 0 if successful, or the
+// osErrno code if not
+static int cluster_map_prepare(int inode, inode_t* child, unsigned short* map)
+{
+  if(child->data[0] > 0) return sector_unshare(inode, child, 0, 1);
+  int sector = sectors_alloc(data_goal(inode, 0), 1);
+  if(sector < 0) return E_NO_SPACE;
+  char buf[SECTOR_SIZE];
+  memset(buf, 0, SECTOR_SIZE);
+  memcpy(buf, map, MAX_CLUSTERS*sizeof(unsigned short));
+  if(Disk_Write(sector, buf) < 0) {
+    sector_free(sector);
+    return E_GENERAL;
+  }
+  child->data[0] = sector;
+  return 0;
+}
+
+static int cluster_map_write(int inode, inode_t* child, unsigned short* map)
+{
+  char buf[SECTOR_SIZE];
+  memset(buf, 0, SECTOR_SIZE);
+  memcpy(buf, map, MAX_CLUSTERS*sizeof(unsigned short));
+  if(Disk_Write(child->data[0], buf) < 0) return E_GENERAL;
+  cluster_cache_put(inode, -1, buf, MAX_CLUSTERS*sizeof(unsigned short));
+  return 0;
+}
+
+// get cluster 'c' of a compressed file (inode 'inode', in 'child', with
+// cluster map 'map') into 'buf'; return 0 if successful, or the osErrno
+// code if not
+static int cluster_load(int inode, inode_t* child, unsigned short* map, int c, char* buf)
+{
+  char* cached = cluster_cache_find(inode, c);
+  if(cached) {
+    memcpy(buf, cached, CLUSTER_SIZE);
+    return 0;
+  }
+  memset(buf, 0, CLUSTER_SIZE);
+  int clen = map[c] & ~CLUSTER_RAW, off = cluster_offset(map, c);
+  if(clen > 0) {
+    char packed[CLUSTER_SIZE+SECTOR_SIZE];
+    char* p = packed+off%SECTOR_SIZE;
+    int ok = clen <= CLUSTER_SIZE && stream_read(child, off, off+clen, packed) == 0;
+    if(ok && (map[c] & CLUSTER_RAW)) memcpy(buf, p, clen);
+    else if(ok) ok = LZ_Decompress(p, clen, buf, CLUSTER_SIZE) >= 0;
+    if(!ok) {
+      dprintf("... cluster %d of inode %d is damaged\n", c, inode);
+      return E_GENERAL;
+    }
+  }
+  cluster_cache_put(inode, c, buf, CLUSTER_SIZE);
+  return 0;
+}
+
+// write cluster 'c' of a compressed file (inode 'inode', in 'child',
+// with cluster map 'map') from 'buf': it is compressed (a cluster of
+// zeroes to nothing) and takes the place of its old form in the stream,
+// with the clusters after it moving up or down to follow on; only the
+// sectors of the stream whose bytes change are written, and the ones
+// left past its end are given back; the map goes to disk, the inode is
+// not written back; return 0 if successful, or the osErrno code if not
+static int cluster_store(int inode, inode_t* child, unsigned short* map, int c, char* buf)
+{
+  char packed[CLUSTER_SIZE];
+  int clen = 0, j, k;
+  for(j=CLUSTER_SIZE; j>0 && !buf[j-1]; j--);
+  if(j > 0) {
+    clen = LZ_Compress(buf, CLUSTER_SIZE, packed, j-1);
+    if(clen < 0) {
+      // stored as it is, without the zeroes at its end
+      clen = j|CLUSTER_RAW;
+      memcpy(packed, buf, j);
+    }
+  }
+  int off = cluster_offset(map, c), oldlen = map[c] & ~CLUSTER_RAW, len = clen & ~CLUSTER_RAW;
+  int end = cluster_offset(map, MAX_CLUSTERS), newend = end-oldlen+len;
+  if(newend > STREAM_SIZE) {
+    dprintf("... inode %d has no room for cluster %d (%d bytes)\n", inode, c, len);
+    return E_FILE_TOO_BIG;
+  }
+  int err = cluster_map_prepare(inode, child, map);
+  if(err) return err;
+
+  // the stream as it is and as it will be, from the sector the cluster
+  // starts in
+  char old[STREAM_SIZE], cur[STREAM_SIZE];
+  int first = off/SECTOR_SIZE, nold = (end+SECTOR_SIZE-1)/SECTOR_SIZE, nnew = (newend+SECTOR_SIZE-1)/SECTOR_SIZE;
+  if(stream_read(child, first*SECTOR_SIZE, end, old+first*SECTOR_SIZE) < 0) return E_GENERAL;
+  memcpy(cur+first*SECTOR_SIZE, old+first*SECTOR_SIZE, off-first*SECTOR_SIZE);
+  memcpy(cur+off, packed, len);
+  memmove(cur+off+len, old+off+oldlen, end-off-oldlen);
+  memset(cur+newend, 0, nnew*SECTOR_SIZE-newend);
+
+  // every sector needed is taken before the stream is touched: the new
+  // ones past its end, and copies of shared ones about to change
+  for(k=nold; !err && k<nnew; k++) {
+    int sector = sectors_alloc(data_goal(inode, child->data[k]), 1);
+    if(sector < 0) err = E_NO_SPACE;
+    else child->data[1+k] = sector;
+  }
+  for(k=first; !err && k<nold && k<nnew; k++)
+    if(memcmp(old+k*SECTOR_SIZE, cur+k*SECTOR_SIZE, SECTOR_SIZE)) err = sector_unshare(inode, child, 1+k, 1);
+  if(err) {
+    for(k=nold; k<nnew; k++) {
+      if(child->data[1+k] > 0) sector_release(child->data[1+k]);
+      child->data[1+k] = 0;
+    }
+    metadata_write();
+    return err;
+  }
+
+  for(k=first; k<nnew; k++) {
+    if(k < nold && !memcmp(old+k*SECTOR_SIZE, cur+k*SECTOR_SIZE, SECTOR_SIZE)) continue;
+    if(Disk_Write(child->data[1+k], cur+k*SECTOR_SIZE) < 0) return E_GENERAL;
+    dedup_forget(child->data[1+k]);
+  }
+  for(k=nnew; k<nold; k++) {
+    if(sector_release(child->data[1+k])) Disk_Discard(child->data[1+k], 1);
+    child->data[1+k] = 0;
+  }
+  map[c] = clen;
+  if(cluster_map_write(inode, child, map) < 0 || metadata_write() < 0) return E_GENERAL;
+  cluster_cache_put(inode, c, buf, CLUSTER_SIZE);
+  dprintf("... cluster %d of inode %d takes %d bytes at %d\n", c, inode, len, off);
+  return 0;
+}
+
+// write 'size' bytes from 'data' at 'pos' into a compressed file (inode
+// 'inode', in 'child'), a cluster at a time; a cluster only partly
+// written is read in first; what was written goes to 'done', and the
+// size of the file grows with it; return 0 if successful, or the
+// osErrno code if not
+static int clusters_write(int inode, inode_t* child, int pos, char* data, int size, int* done)
+{
+  unsigned short map[MAX_CLUSTERS];
+  char cluster[CLUSTER_SIZE];
+  *done = 0;
+  if(cluster_map_read(inode, child, map) < 0) return E_GENERAL;
+  while(*done < size) {
+    int c = pos/CLUSTER_SIZE, at = pos%CLUSTER_SIZE, n = CLUSTER_SIZE-at;
+    if(n > size-*done) n = size-*done;
+    int err = n < CLUSTER_SIZE ? cluster_load(inode, child, map, c, cluster) : 0;
+    if(!err) {
+      memcpy(cluster+at, data+*done, n);
+      err = cluster_store(inode, child, map, c, cluster);
+    }
+    if(err) return err;
+    pos += n;
+    *done += n;
+    if(pos > child->size) child->size = pos;
+  }
+  return 0;
+}
+
+// cut a compressed file (inode 'inode', in 'child') down to 'size'
+// bytes: the clusters past it are given back and the end of its new
+// last cluster is cleared, so that the file can grow again with
+// zeroes; the inode is not written back; return 0 if successful, or
+// the osErrno code if not
+static int clusters_shrink(int inode, inode_t* child, int size)
+{
+  unsigned short map[MAX_CLUSTERS];
+  char cluster[CLUSTER_SIZE];
+  if(cluster_map_read(inode, child, map) < 0) return E_GENERAL;
+  int keep = (size+CLUSTER_SIZE-1)/CLUSTER_SIZE, c, k;
+  int err = 0;
+  if(size%CLUSTER_SIZE) err = cluster_load(inode, child, map, keep-1, cluster);
+  if(err) return err;
+  cluster_cache_drop(inode);
+
+  int end = cluster_offset(map, keep), nold = (cluster_offset(map, MAX_CLUSTERS)+SECTOR_SIZE-1)/SECTOR_SIZE;
+  for(k=(end+SECTOR_SIZE-1)/SECTOR_SIZE; k<nold; k++) {
+    if(sector_release(child->data[1+k])) Disk_Discard(child->data[1+k], 1);
+    child->data[1+k] = 0;
+  }
+  for(c=keep; c<MAX_CLUSTERS; c++) map[c] = 0;
+  child->size = size;
+  if(size%CLUSTER_SIZE) {
+    memset(cluster+size%CLUSTER_SIZE, 0, CLUSTER_SIZE-size%CLUSTER_SIZE);
+    return cluster_store(inode, child, map, keep-1, cluster);
+  }
+  if(child->data[0] > 0) {
+    err = cluster_map_prepare(inode, child, map);
+    if(!err) err = cluster_map_write(inode, child, map);
+  }
+  return err ? err : metadata_write() < 0 ? E_GENERAL : 0;
+}
+
+// representing an open file
+typedef struct _open_file {
+  int inode; // pointing to the inode of the file (0 means entry not used)
+  int size;  // file size cached here for convenience
+  int pos;   // read/write position
+  int max;   // the size it may grow to (FILE_MAX)
+} open_file_t;
+static open_file_t open_files[MAX_OPEN_FILES];
+
+// max number of open directories (see Dir_Open)
+#define MAX_OPEN_DIRS 64
+
+// representing an open directory
+typedef struct _open_dir {
+  int inode; // the directory's inode (0 means entry not used, unless 'used')
+  int used;  // the entry is in use (the root directory is inode 0)
+  int pos;   // index of the next directory entry to return
+} open_dir_t;
+static open_dir_t open_dirs[MAX_OPEN_DIRS];
+
+// return true if the file pointed to by inode has already been open
+int is_file_open(int inode)
+{
+  int i;
+  for(i=0; i<MAX_OPEN_FILES; i++) {
+    if(open_files[i].inode == inode)
+      return 1;
+  }
+  return 0;
+}
+
+// return a new file descriptor not used; -1 if full
+int new_file_fd()
+{
+  int i;
+  for(i=0; i<MAX_OPEN_FILES; i++) {
+    if(open_files[i].inode <= 0)
+      return i;
+  }
+  return -1;
+}
+
+// set the first 'nbits' bits of a bitmap kept in memory (the rest of
+// the bitmap is expected to be zero already)
+static void bitmap_fill(char* map, int nbits)
+{
+  memset(map, 255, nbits/8);
+  if(nbits%8) map[nbits/8] = (char)(255<<(8-nbits%8));
+}
+
+// return up to 'max' entries of the open directory 'dd' from its
+// cursor on, as dirents into 'dirents' and, if 'plus' is given, with
+// the type and size of each entry; return the number of entries, 0
+// at the end of the directory, -1 on error
+static int dir_next(int dd, dirent_t* dirents, Dir_Entry_t* plus, int max)
+{
+  if(dd < 0 || dd >= MAX_OPEN_DIRS || !open_dirs[dd].used) {
+    dprintf("... dd=%d not an open directory\n", dd);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+  char inode_buffer[SECTOR_SIZE];
+  inode_t* dir = load_inode(open_dirs[dd].inode, inode_buffer);
+  if(!dir) { osErrno = E_GENERAL; return -1; }
+
+  // the cached sector of inodes the entries point to; the entries of a
+  // directory tend to have neighbouring inodes
+  char child_buffer[SECTOR_SIZE];
+  int child_sector = -1;
+
+  int count = 0;
+  while(count < max && open_dirs[dd].pos < dir->size) {
+    int group = open_dirs[dd].pos/DIRENTS_PER_SECTOR;
+    char dirent_buffer[SECTOR_SIZE];
+    if(Disk_Read(dir->data[group], dirent_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+    dprintf("... load disk sector %d for dirent group %d\n", dir->data[group], group);
+
+    // take as many entries from this sector as we can
+    int i = open_dirs[dd].pos%DIRENTS_PER_SECTOR;
+    for(; i<DIRENTS_PER_SECTOR && count<max && open_dirs[dd].pos<dir->size; i++) {
+      dirent_t* dirent = (dirent_t*)dirent_buffer+i;
+      if(dirents) memcpy(&dirents[count], dirent, sizeof(dirent_t));
+      if(plus) {
+        int sector = inode_table_sector(dirent->inode);
+        if(sector != child_sector) {
+          if(Disk_Read(sector, child_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+          child_sector = sector;
+        }
+        inode_t* child = (inode_t*)child_buffer+dirent->inode%INODES_PER_SECTOR;
+        memcpy(plus[count].fname, dirent->fname, MAX_NAME);
+        plus[count].inode = dirent->inode;
+        plus[count].type = INODE_TYPE(child);
+        plus[count].size = child->size;
+      }
+      count++;
+      open_dirs[dd].pos++;
+    }
+  }
+  return count;
+}
+
+// the tree operations (Dir_UnlinkTree, Dir_Usage) go through a cache
+// of the inode table, and free inodes and sectors in the in-memory
+// bitmaps only, so that every sector is read and written at most once
+// however many inodes they touch
+static struct {
+  char* chunks[INODE_CHUNKS];  // cached inode table chunks, allocated as needed
+  char loaded[INODE_TABLE_SECTORS];
+  char dirty[INODE_TABLE_SECTORS];
+  int nfreed;                  // data sectors to be discarded
+  int freed[TOTAL_SECTORS];
+} batch;
+
+// the breadth-first list of inodes visited by a tree walk
+static int tree[MAX_FILES];
+
+// start a batch; the chunks cached by the previous one are dropped
+static void batch_begin()
+{
+  int i;
+  for(i=0; i<INODE_CHUNKS; i++) {
+    free(batch.chunks[i]);
+    batch.chunks[i] = NULL;
+  }
+  memset(batch.loaded, 0, sizeof(batch.loaded));
+  memset(batch.dirty, 0, sizeof(batch.dirty));
+  batch.nfreed = 0;
+}
+
+// return the cached copy of the i-th sector of the inode table
+static char* batch_sector(int i)
+{
+  return batch.chunks[i/INODE_CHUNK_SECTORS]+i%INODE_CHUNK_SECTORS*SECTOR_SIZE;
+}
+
+// return the given inode from the cache; NULL on read error
+static inode_t* batch_inode(int inode)
+{
+  int i = inode/INODES_PER_SECTOR;
+  if(!batch.loaded[i]) {
+    int chunk = inode/INODES_PER_CHUNK;
+    if(!batch.chunks[chunk] && !(batch.chunks[chunk] = malloc(INODE_CHUNK_SECTORS*SECTOR_SIZE))) return NULL;
+    if(Disk_Read(inode_table_sector(inode), batch_sector(i)) < 0) return NULL;
+    batch.loaded[i] = 1;
+  }
+  return (inode_t*)batch_sector(i)+inode%INODES_PER_SECTOR;
+}
+
+static int compare_int(const void* a, const void* b)
+{
+  return *(const int*)a-*(const int*)b;
+}
+
+// collect the subtree rooted at 'inode' into 'tree' in breadth-first
+// order, reading each directory's dirent sectors once; return the
+// number of inodes, or -1 on error
+static int tree_walk(int inode)
+{
+  int n = 1, i, group, j;
+  tree[0] = inode;
+  for(i=0; i<n; i++) {
+    inode_t* node = batch_inode(tree[i]);
+    if(!node) return -1;
+    if(INODE_TYPE(node) != 1) continue;
+    int size = node->size;
+    for(group=0; group*DIRENTS_PER_SECTOR<size; group++) {
+      char dirent_buffer[SECTOR_SIZE];
+      if(Disk_Read(node->data[group], dirent_buffer) < 0) return -1;
+      for(j=0; j<DIRENTS_PER_SECTOR && group*DIRENTS_PER_SECTOR+j<size; j++) {
+        if(n == MAX_FILES) return -1; // a cycle; can't happen on a sane disk
+        tree[n++] = ((dirent_t*)dirent_buffer)[j].inode;
+      }
+    }
+  }
+  return n;
+}
+
+// write back everything the batch changed: the dirty inode table
+// sectors, the bitmaps and the superblock; and discard the freed data
+// sectors in runs
+static int batch_flush()
+{
+  int i;
+  for(i=0; i<INODE_TABLE_SECTORS; i++) {
+    if(batch.dirty[i] && Disk_Write(inode_table_sector(i*INODES_PER_SECTOR), batch_sector(i)) < 0)
       return -1;
-    dprintf("... load disk sector %d corresponding the last dirent entry in group %d\n", parent->data[last_group], group);
+  }
+  if(metadata_write() < 0) return -1;
+
+  qsort(batch.freed, batch.nfreed, sizeof(int), compare_int);
+  int start = 0;
+  for(i=1; i<=batch.nfreed; i++) {
+    if(i == batch.nfreed || batch.freed[i] != batch.freed[i-1]+1) {
+      Disk_Discard(batch.freed[start], i-start);
+      start = i;
+    }
+  }
+  return 0;
+}
+
+// return 1 if the path 'inner' names 'outer' or something below it
+// (multiple '/' are ignored, as in follow_path)
+static int path_within(char* outer, char* inner)
+{
+  for(;;) {
+    while(*outer == '/') outer++;
+    while(*inner == '/') inner++;
+    if(*outer == '\0') return 1;
+    int n = strcspn(outer, "/");
+    if(strncmp(outer, inner, n) || (inner[n] != '/' && inner[n] != '\0')) return 0;
+    outer += n;
+    inner += n;
+  }
+}
+
+// move the file or directory (determined by 'type') at 'oldpath' to
+// 'newpath' by relinking its dirent; the inode and its data stay
+// where they are; used by both File_Rename() and Dir_Rename()
+static int rename_inode(int type, char* oldpath, char* newpath)
+{
+  int child_inode = -1;
+  int old_parent = follow_path(oldpath, &child_inode, NULL);
+  if(old_parent < 0 || child_inode < 0) {
+    dprintf("... '%s' does not exist\n", oldpath);
+    osErrno = type ? E_NO_SUCH_DIR : E_NO_SUCH_FILE;
+    return -1;
+  }
+  if(child_inode == 0) {
+    dprintf("... can't move the root directory\n");
+    osErrno = E_ROOT_DIR;
+    return -1;
+  }
+  char inode_buffer[SECTOR_SIZE];
+  inode_t* child = load_inode(child_inode, inode_buffer);
+  if(!child) { osErrno = E_GENERAL; return -1; }
+  if(INODE_TYPE(child) != type) {
+    dprintf("... '%s' is not a %s\n", oldpath, type ? "directory" : "file");
+    osErrno = type ? E_NO_SUCH_DIR : E_NO_SUCH_FILE;
+    return -1;
+  }
+  if(type == 1 && path_within(oldpath, newpath)) {
+    dprintf("... can't move '%s' into itself\n", oldpath);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  int new_inode = -1;
+  char new_fname[MAX_NAME];
+  int new_parent = follow_path(newpath, &new_inode, new_fname);
+  if(new_parent < 0 || new_inode == 0) {
+    dprintf("... error: something wrong with the file/path: '%s'\n", newpath);
+    osErrno = E_CREATE;
+    return -1;
+  }
+  if(new_inode >= 0) {
+    dprintf("... file/directory '%s' already exists, failed to move\n", newpath);
+    osErrno = E_CREATE;
+    return -1;
+  }
+
+  if(new_parent == old_parent) {
+    // just change the name in place
+    inode_t* parent = load_inode(old_parent, inode_buffer);
+    if(!parent) { osErrno = E_GENERAL; return -1; }
+    int group, i;
+    for(group=0; group*DIRENTS_PER_SECTOR<parent->size; group++) {
+      char dirent_buffer[SECTOR_SIZE];
+      if(Disk_Read(parent->data[group], dirent_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+      for(i=0; i<DIRENTS_PER_SECTOR && group*DIRENTS_PER_SECTOR+i<parent->size; i++) {
+        dirent_t* dirent = (dirent_t*)dirent_buffer+i;
+        if(dirent->inode != child_inode) continue;
+        strncpy(dirent->fname, new_fname, MAX_NAME);
+        if(Disk_Write(parent->data[group], dirent_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+        dprintf("... renamed inode %d to '%s' in disk sector %d\n", child_inode, new_fname, parent->data[group]);
+        return 0;
+      }
+    }
+    dprintf("... error: no dirent for inode %d\n", child_inode);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  // link into the new parent first, so that a failure (such as a full
+  // disk) leaves the old name in place
+  if(dirent_add(new_parent, new_fname, child_inode) < 0) {
+    dprintf("... error: can't link '%s'\n", newpath);
+    osErrno = E_CREATE;
+    return -1;
+  }
+  if(dirent_remove(old_parent, child_inode) < 0) {
+    dprintf("... error: can't unlink '%s'\n", oldpath);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... moved inode %d from '%s' to '%s'\n", child_inode, oldpath, newpath);
+  return 0;
+}
+
+// return 1 if an inode shares any of its sectors with a clone
+static int inode_shared(inode_t* node)
+{
+  int i;
+  for(i=0; !IS_INLINE(node) && i<MAX_SECTORS_PER_FILE; i++)
+    if(node->data[i] > 0 && sector_refs[node->data[i]] > 0) return 1;
+  return 0;
+}
+
+// return the number of runs of consecutive sectors an inode's data is
+// in (0 for none), and the number of its sectors through 'nsectors'
+static int inode_runs(inode_t* node, int* nsectors)
+{
+  int i, runs = 0, last = -1;
+  *nsectors = 0;
+  if(IS_INLINE(node)) return 0;
+  for(i=0; i<MAX_SECTORS_PER_FILE; i++) {
+    if(node->data[i] == 0) continue;
+    if(node->data[i] != last+1) runs++;
+    last = node->data[i];
+    (*nsectors)++;
+  }
+  return runs;
+}
+
+// move the sectors of inode 'inode' into one run of free sectors (the
+// first one after the inode, as for new data), keeping their order; the
+// inode (in 'inode_buffer', which is written back to 'inode_sector')
+// switches to the copies in a single write, and only then are the old
+// sectors freed; return 1 if moved, 0 if there is no free run big
+// enough, -1 on error (the inode is left as it was and the run is
+// freed again)
+static int inode_relocate(int inode, inode_t* node, int inode_sector, char* inode_buffer, int nsectors)
+{
+  int first = sectors_alloc(data_goal(inode, 0), nsectors);
+  if(first < 0) return 0;
+
+  int i, next = first, old[MAX_SECTORS_PER_FILE];
+  inode_t was = *node, moved = *node;
+  for(i=0; i<MAX_SECTORS_PER_FILE; i++) {
+    old[i] = node->data[i];
+    if(old[i] == 0) continue;
+    char buf[SECTOR_SIZE];
+    if(Disk_Read(old[i], buf) < 0 || Disk_Write(next, buf) < 0) break;
+    moved.data[i] = next++;
+  }
+  if(i == MAX_SECTORS_PER_FILE) {
+    *node = moved;
+    if(Disk_Write(inode_sector, inode_buffer) == 0) {
+      for(i=0; i<MAX_SECTORS_PER_FILE; i++) {
+        if(old[i] != 0 && sector_release(old[i])) Disk_Discard(old[i], 1);
+      }
+      return metadata_write() < 0 ? -1 : 1;
+    }
+    *node = was;
+  }
+
+  // the inode stays where it was, and the new run goes back
+  for(i=0; i<nsectors; i++) sector_release(first+i);
+  metadata_write();
+  return -1;
+}
+
+// add up how fragmented the files and directories are: the number of
+// them with any sectors, how many of those are in more than one run,
+// and the score: the percentage of steps from one sector of an inode
+// to its next that are not to the sector right after; return -1 on
+// read error
+static int frag_score(int* inodes, int* fragmented)
+{
+  int chunk, i, j, steps = 0, breaks = 0;
+  *inodes = *fragmented = 0;
+  for(chunk=0; chunk<INODE_CHUNKS; chunk++) {
+    if(inode_chunks[chunk] <= 0) continue;
+    for(i=0; i<INODE_CHUNK_SECTORS; i++) {
+      char inode_buffer[SECTOR_SIZE];
+      if(Disk_Read(inode_chunks[chunk]+i, inode_buffer) < 0) return -1;
+      for(j=0; j<INODES_PER_SECTOR; j++) {
+        int inode = chunk*INODES_PER_CHUNK+i*INODES_PER_SECTOR+j, n;
+        if(!bit_isset(inode_bitmap, inode)) continue;
+        int runs = inode_runs((inode_t*)inode_buffer+j, &n);
+        if(n == 0) continue;
+        (*inodes)++;
+        if(runs > 1) (*fragmented)++;
+        steps += n-1;
+        breaks += runs-1;
+      }
+    }
+  }
+  return steps ? breaks*100/steps : 0;
+}
+
+// the consistency check (FS_Check) works on a copy of the whole inode
+// table in memory; several threads go through it at once, a chunk of
+// the table at a time, and work out which inode uses each sector
+#define FSCK_MAX_THREADS 16
+#define FSCK_FREE -1  // a sector nothing uses
+#define FSCK_META -2  // a sector the file system itself uses
+
+static struct {
+  inode_t* table;     // the inode table, indexed by inode
+  char* tdirty;       // inode table sectors changed by the check
+  int* owner;         // the inode using each sector, or FSCK_FREE/FSCK_META
+  char* shared;       // sectors more than one inode claims
+  int* users;         // how many inodes may use each sector (see fsck_counts)
+  char* bad;          // inodes too broken to keep
+  char* reached;      // inodes found in the directory tree
+  int next_chunk;     // the next chunk of the table to hand to a thread
+  int repair;
+  FS_Check_t* report;
+} fsck;
+
+// record that 'inode' uses 'sector'; when several inodes do, the lowest
+// one keeps it and the sector is marked as shared
+static void fsck_claim(int sector, int inode)
+{
+  for(;;) {
+    int cur = __atomic_load_n(&fsck.owner[sector], __ATOMIC_RELAXED);
+    if(cur != FSCK_FREE) __atomic_store_n(&fsck.shared[sector], 1, __ATOMIC_RELAXED);
+    if(cur != FSCK_FREE && (cur == FSCK_META || cur < inode)) return;
+    if(__atomic_compare_exchange_n(&fsck.owner[sector], &cur, inode, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+  }
+}
+
+// check an inode that is in use on its own and claim its sectors; a bad
+// size or sector index is fixed in the copy of the table by dropping
+// the index, which leaves a hole in a file, and cutting a directory's
+// size back to the sectors that are left
+static void fsck_inode(int inode)
+{
+  inode_t* node = &fsck.table[inode];
+  int type = INODE_TYPE(node), flags = node->type & ~0xff;
+  if(type > 1 || (flags & ~(INODE_INLINE|INODE_COMPRESSED)) || flags == (INODE_INLINE|INODE_COMPRESSED) ||
+     (type == 1 && flags)) {
+    // nothing else about it can be trusted
+    fsck.bad[inode] = 1;
+    __sync_fetch_and_add(&fsck.report->bad_inodes, 1);
+    return;
+  }
+
+  int broken = 0, i;
+  int max = type == 1 ? MAX_SECTORS_PER_FILE*DIRENTS_PER_SECTOR : IS_INLINE(node) ? INLINE_SIZE : FILE_MAX(node);
+  if(node->size < 0 || node->size > max) {
+    node->size = node->size < 0 ? 0 : max;
+    broken = 1;
+  }
+  if(!IS_INLINE(node)) {
+    for(i=0; i<MAX_SECTORS_PER_FILE; i++) {
+      int sector = node->data[i];
+      if(sector != 0 && (sector < DATABLOCK_START_SECTOR || sector >= TOTAL_SECTORS)) {
+        node->data[i] = sector = 0;
+        broken = 1;
+      }
+      if(sector == 0 && type == 1 && node->size > i*DIRENTS_PER_SECTOR) {
+        node->size = i*DIRENTS_PER_SECTOR;
+        broken = 1;
+      }
+      if(sector) fsck_claim(sector, inode);
+    }
+  }
+  if(broken) {
+    dprintf("... inode %d: bad size or sector index\n", inode);
+    fsck.tdirty[inode/INODES_PER_SECTOR] = 1;
+    __sync_fetch_and_add(&fsck.report->bad_inodes, 1);
+  }
+}
+
+// thread body: check the inodes in use, one chunk of the table at a time
+static void* fsck_worker(void* arg)
+{
+  for(;;) {
+    int chunk = __sync_fetch_and_add(&fsck.next_chunk, 1);
+    if(chunk >= INODE_CHUNKS) return NULL;
+    if(inode_chunks[chunk] <= 0) continue;
+    int inode;
+    for(inode=chunk*INODES_PER_CHUNK; inode<(chunk+1)*INODES_PER_CHUNK; inode++)
+      if(bit_isset(inode_bitmap, inode)) fsck_inode(inode);
+  }
+}
+
+// give every inode but the owner of a shared sector a copy of its own,
+// unless the sector's reference count allows for it (files cloned with
+// File_Clone share sectors with their sources); return -1 on error
+static int fsck_unshare()
+{
+  int inode, i, next = DATABLOCK_START_SECTOR;
+  for(inode=0; inode<MAX_FILES; inode++) {
+    inode_t* node = &fsck.table[inode];
+    if(!bit_isset(inode_bitmap, inode) || fsck.bad[inode] || IS_INLINE(node)) continue;
+    for(i=0; i<MAX_SECTORS_PER_FILE; i++) {
+      int sector = node->data[i];
+      if(!sector || !fsck.shared[sector] || fsck.owner[sector] == inode) continue;
+      if(INODE_TYPE(node) == 0 && fsck.owner[sector] >= 0 && INODE_TYPE(&fsck.table[fsck.owner[sector]]) == 0 &&
+         fsck.users[sector] < sector_refs[sector]) {
+        fsck.users[sector]++;
+        continue;
+      }
+      dprintf("... inode %d shares sector %d\n", inode, sector);
+      fsck.report->double_sectors++;
+      if(!fsck.repair) continue;
+      while(next < TOTAL_SECTORS && fsck.owner[next] != FSCK_FREE) next++;
+      char buf[SECTOR_SIZE];
+      if(next < TOTAL_SECTORS) {
+        if(Disk_Read(sector, buf) < 0 || Disk_Write(next, buf) < 0) return -1;
+        fsck.owner[next] = inode;
+        sector_bitmap[next/8] = setNthBitSet(sector_bitmap[next/8], next%8);
+        node->data[i] = next;
+      } else {
+        // no room for a copy; the inode loses the sector, which leaves a
+        // hole in a file but cuts a directory short
+        node->data[i] = 0;
+        if(INODE_TYPE(node) == 1 && node->size > i*DIRENTS_PER_SECTOR) node->size = i*DIRENTS_PER_SECTOR;
+      }
+      fsck.tdirty[inode/INODES_PER_SECTOR] = 1;
+    }
+  }
+  return 0;
+}
+
+// walk the directory tree from the root, marking every inode reached;
+// a dirent with a bad name, an inode that is not in use or broken, or
+// an inode already reached through another dirent is dropped, and the
+// directory's remaining dirents are packed; return -1 on error
+static int fsck_walk()
+{
+  int* queue = malloc(MAX_FILES*sizeof(int));
+  if(!queue) return -1;
+  int n = 1, q, group, j;
+  queue[0] = 0;
+  fsck.reached[0] = 1;
+  for(q=0; q<n; q++) {
+    int dir_inode = queue[q];
+    inode_t* dir = &fsck.table[dir_inode];
+    if(INODE_TYPE(dir) != 1) continue;
+
+    dirent_t kept[MAX_SECTORS_PER_FILE*DIRENTS_PER_SECTOR];
+    int nkept = 0, dropped = 0;
+    for(group=0; group*DIRENTS_PER_SECTOR<dir->size; group++) {
+      char buf[SECTOR_SIZE];
+      if(Disk_Read(dir->data[group], buf) < 0) {
+        if(diskErrno != E_CHECKSUM) { free(queue); return -1; }
+        // the sector is lost, and so are the dirents in it
+        int lost = dir->size-group*DIRENTS_PER_SECTOR;
+        if(lost > DIRENTS_PER_SECTOR) lost = DIRENTS_PER_SECTOR;
+        dprintf("... directory inode %d: sector %d is corrupt, %d dirents lost\n", dir_inode, dir->data[group], lost);
+        fsck.report->bad_sectors++;
+        dropped += lost;
+        continue;
+      }
+      for(j=0; j<DIRENTS_PER_SECTOR && group*DIRENTS_PER_SECTOR+j<dir->size; j++) {
+        dirent_t* dirent = (dirent_t*)buf+j;
+        int child = dirent->inode;
+        if(!memchr(dirent->fname, '\0', MAX_NAME) || !dirent->fname[0] || illegal_filename(dirent->fname) ||
+           child <= 0 || child >= MAX_FILES || !bit_isset(inode_bitmap, child) || fsck.bad[child] || fsck.reached[child]) {
+          dprintf("... directory inode %d: dangling dirent for inode %d\n", dir_inode, child);
+          dropped++;
+          continue;
+        }
+        fsck.reached[child] = 1;
+        queue[n++] = child;
+        memcpy(&kept[nkept++], dirent, sizeof(dirent_t));
+      }
+    }
+    if(!dropped) continue;
+    fsck.report->dangling_dirents += dropped;
+
+    // write back the dirents left, and give up the sectors they no
+    // longer need
+    for(group=0; group*DIRENTS_PER_SECTOR<dir->size; group++) {
+      int first = group*DIRENTS_PER_SECTOR;
+      if(first < nkept) {
+        char buf[SECTOR_SIZE];
+        memset(buf, 0, SECTOR_SIZE);
+        for(j=0; j<DIRENTS_PER_SECTOR && first+j<nkept; j++)
+          memcpy((dirent_t*)buf+j, &kept[first+j], sizeof(dirent_t));
+        if(fsck.repair && Disk_Write(dir->data[group], buf) < 0) { free(queue); return -1; }
+      } else {
+        if(fsck.owner[dir->data[group]] == dir_inode) fsck.owner[dir->data[group]] = FSCK_FREE;
+        dir->data[group] = 0;
+      }
+    }
+    dir->size = nkept;
+    fsck.tdirty[dir_inode/INODES_PER_SECTOR] = 1;
+  }
+  free(queue);
+  return 0;
+}
+
+// free every inode in use that the walk didn't reach, with its sectors
+static void fsck_orphans()
+{
+  int inode, i;
+  for(inode=1; inode<MAX_FILES; inode++) {
+    if(!bit_isset(inode_bitmap, inode) || fsck.reached[inode]) continue;
+    inode_t* node = &fsck.table[inode];
+    if(!fsck.bad[inode]) {
+      dprintf("... inode %d is orphaned\n", inode);
+      fsck.report->orphaned_inodes++;
+      for(i=0; !IS_INLINE(node) && i<MAX_SECTORS_PER_FILE; i++)
+        if(node->data[i] && fsck.owner[node->data[i]] == inode) fsck.owner[node->data[i]] = FSCK_FREE;
+    }
+    memset(node, 0, sizeof(inode_t));
+    fsck.tdirty[inode/INODES_PER_SECTOR] = 1;
+    inode_bitmap[inode/8] &= ~(128>>(inode%8));
+  }
+}
+
+// make the sector bitmap, the reference counts and the superblock agree
+// with what the check found in use; the users of each sector are counted
+// again from the final table, as an orphan may have shared its sectors
+static void fsck_counts()
+{
+  int sector, inode, i, run = 0, refs_off = 0;
+  memset(fsck.users, 0, TOTAL_SECTORS*sizeof(int));
+  for(inode=0; inode<MAX_FILES; inode++) {
+    inode_t* node = &fsck.table[inode];
+    if(!bit_isset(inode_bitmap, inode) || IS_INLINE(node)) continue;
+    for(i=0; i<MAX_SECTORS_PER_FILE; i++)
+      if(node->data[i]) fsck.users[node->data[i]]++;
+  }
+  superblock_t sb;
+  memset(&sb, 0, sizeof(sb));
+  sb.magic = OS_MAGIC;
+  sb.refs_start = super.sb.refs_start;
+  for(sector=0; sector<=TOTAL_SECTORS; sector++) {
+    int used = sector == TOTAL_SECTORS || fsck.owner[sector] == FSCK_META || fsck.users[sector] > 0;
+    if(sector < TOTAL_SECTORS) {
+      int refs = fsck.users[sector] > 0 ? fsck.users[sector]-1 : 0;
+      if(sector_refs[sector] != refs) {
+        dprintf("... sector %d has %d references, not %d\n", sector, sector_refs[sector], refs);
+        refs_off = 1;
+        sector_refs[sector] = refs;
+        refs_dirty[sector/REFS_PER_SECTOR] = 1;
+      }
+      int marked = bit_isset(sector_bitmap, sector);
+      if(marked && !used) {
+        dprintf("... sector %d is leaked\n", sector);
+        fsck.report->leaked_sectors++;
+        sector_bitmap[sector/8] &= ~(128>>(sector%8));
+      } else if(!marked && used) {
+        dprintf("... sector %d is in use but marked free\n", sector);
+        fsck.report->lost_sectors++;
+        sector_bitmap[sector/8] = setNthBitSet(sector_bitmap[sector/8], sector%8);
+      }
+      if(!used) sb.free_sectors++;
+    }
+    if(!used) run++;
+    else if(run > 0) {
+      sb.extents[extent_bucket(run)]++;
+      run = 0;
+    }
+  }
+  for(inode=0; inode<MAX_FILES; inode++)
+    if(!bit_isset(inode_bitmap, inode)) sb.free_inodes++;
+    else if(INODE_TYPE(&fsck.table[inode]) == 1) sb.ag_dirs[INODE_AG(inode)]++;
+  ag_tally(&sb);
+  if(memcmp(&sb, &super.sb, sizeof(sb))) {
+    dprintf("... superblock counts are off\n");
+    fsck.report->bad_counts++;
+    memcpy(&super.sb, &sb, sizeof(sb));
+  }
+  if(refs_off) fsck.report->bad_counts++;
+}
 
-    //get the last dirent
-    int start_entry = last_group*DIRENTS_PER_SECTOR;
-    offset = parent->size-start_entry-1;
-    dirent_t* last_dirent = (dirent_t*)(last_dirent_buffer+offset*sizeof(dirent_t));   //This is the last dirent to swap with the dirent that we are deleting
-    
-    //Now find the sector where is the child dirent    
-    for(group = 0; group<MAX_SECTORS_PER_FILE; group++){       //Go through all the groups  data[group] in the parent inode
-      if(Disk_Read(parent->data[group], dirent_buffer) < 0)    //Read the sector in this group
-        return -1;
-      dprintf("... load disk sector %d for dirent group %d\n", parent->data[last_group], group);
-      for(entry = 0; entry<DIRENTS_PER_SECTOR; entry++){      //Go through all the dirents inside this group
-         current_dirent = (dirent_t*)(dirent_buffer+entry*sizeof(dirent_t));
-         if(current_dirent->inode == child_inode){
-            strncpy(current_dirent->fname, last_dirent->fname, MAX_NAME);
-            current_dirent->inode = last_dirent->inode; 
-
-            char * blank = "";
-            strncpy(last_dirent->fname, blank, MAX_NAME);
-            last_dirent->inode = -1;
-                     
-            memset(last_dirent, 0 , sizeof(dirent_t));
-            if(Disk_Write(parent->data[group], dirent_buffer) < 0) return -1;     //Here update the sector where we replace the removed node
-            dprintf("... update dirent %d (name='%s', inode=%d) to group %d, update disk sector %d\n", (group*30)+entry, current_dirent->fname, current_dirent->inode, group, parent->data[group]);
-            if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;     //Here update the parent inode sector
-            group = MAX_SECTORS_PER_FILE; //just to break the outer loop
-            break;
-         }
+// the body of FS_Check, once the image is loaded and the buffers of
+// 'fsck' are set up; return the number of problems found, -1 on error
+static int fsck_run()
+{
+  FS_Check_t* report = fsck.report;
+  int sector, chunk, inode, i, chunks_changed = 0;
+  for(sector=0; sector<TOTAL_SECTORS; sector++)
+    fsck.owner[sector] = sector < DATABLOCK_START_SECTOR ? FSCK_META : FSCK_FREE;
+
+  // read in the inode table, a whole chunk at a time; a chunk that is
+  // out of place loses its inodes, and so does a corrupt sector of one
+  for(chunk=0; chunk<INODE_CHUNKS; chunk++) {
+    int start = inode_chunks[chunk];
+    if(start == 0) continue;
+    int ok = start >= DATABLOCK_START_SECTOR && start+INODE_CHUNK_SECTORS <= TOTAL_SECTORS;
+    for(i=0; ok && i<INODE_CHUNK_SECTORS; i++) ok = fsck.owner[start+i] == FSCK_FREE;
+    if(!ok) {
+      dprintf("... inode table chunk %d has a bad place (sector %d)\n", chunk, start);
+      inode_chunks[chunk] = 0;
+      chunks_changed = 1;
+      continue;
+    }
+    char* buf = (char*)(fsck.table+chunk*INODES_PER_CHUNK);
+    for(i=0; i<INODE_CHUNK_SECTORS; i++) {
+      fsck.owner[start+i] = FSCK_META;
+      if(Disk_Read(start+i, buf+i*SECTOR_SIZE) >= 0) continue;
+      if(diskErrno != E_CHECKSUM) return -1;
+      dprintf("... inode table sector %d is corrupt\n", start+i);
+      report->bad_sectors++;
+      memset(buf+i*SECTOR_SIZE, 0, SECTOR_SIZE);
+      fsck.tdirty[chunk*INODE_CHUNK_SECTORS+i] = 1;
+      for(inode=(chunk*INODE_CHUNK_SECTORS+i)*INODES_PER_SECTOR; inode<(chunk*INODE_CHUNK_SECTORS+i+1)*INODES_PER_SECTOR; inode++) {
+        if(bit_isset(inode_bitmap, inode)) {
+          fsck.bad[inode] = 1;
+          report->bad_inodes++;
+        }
       }
     }
   }
+  // the reference counts, if there are any, must not overlap the table;
+  // without them every shared sector gets copied
+  if(super.sb.refs_start > 0) {
+    int ok = 1;
+    for(i=0; ok && i<REFS_SECTORS; i++) ok = fsck.owner[super.sb.refs_start+i] == FSCK_FREE;
+    if(!ok) {
+      dprintf("... the reference counts overlap the inode table (sector %d)\n", super.sb.refs_start);
+      report->bad_counts++;
+      super.sb.refs_start = 0;
+      memset(sector_refs, 0, sizeof(sector_refs));
+    }
+    for(i=0; ok && i<REFS_SECTORS; i++) fsck.owner[super.sb.refs_start+i] = FSCK_META;
+  }
+  for(inode=0; inode<MAX_FILES; inode++) {
+    if(bit_isset(inode_bitmap, inode) && inode_chunks[inode/INODES_PER_CHUNK] == 0) {
+      fsck.bad[inode] = 1;
+      report->bad_inodes++;
+    }
+  }
 
-  // update parent inode and write to disk
-  parent->size--;
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... update parent inode on disk sector %d\n", inode_sector);
- 
-  return 0;
-  /********* END OUR CODE **********/ 
-  
-}
-
-// representing an open file
-typedef struct _open_file {
-  int inode; // pointing to the inode of the file (0 means entry not used)
-  int size;  // file size cached here for convenience
-  int pos;   // read/write position
-} open_file_t;
-static open_file_t open_files[MAX_OPEN_FILES];
+  // check the inodes themselves in parallel
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(nthreads < 1) nthreads = 1;
+  if(nthreads > FSCK_MAX_THREADS) nthreads = FSCK_MAX_THREADS;
+  pthread_t tid[FSCK_MAX_THREADS];
+  int started = 0;
+  while(started < nthreads && pthread_create(&tid[started], NULL, fsck_worker, NULL) == 0) started++;
+  fsck_worker(NULL); // whatever the threads haven't taken yet
+  for(i=0; i<started; i++) pthread_join(tid[i], NULL);
+  dprintf("... checked the inodes with %d threads\n", started+1);
+
+  if(!bit_isset(inode_bitmap, 0) || fsck.bad[0] || INODE_TYPE(&fsck.table[0]) != 1) {
+    dprintf("... the root directory is damaged\n");
+    return -1;
+  }
 
-// return true if the file pointed to by inode has already been open
-int is_file_open(int inode)
-{
-  int i;
-  for(i=0; i<MAX_OPEN_FILES; i++) {
-    if(open_files[i].inode == inode)
-      return 1;
+  // then everything that needs the whole picture
+  if(fsck_unshare() < 0 || fsck_walk() < 0) return -1;
+  fsck_orphans();
+  fsck_counts();
+
+  int problems = report->bad_inodes+report->orphaned_inodes+report->dangling_dirents+
+    report->double_sectors+report->leaked_sectors+report->lost_sectors+report->bad_counts+
+    report->bad_sectors;
+  if(!fsck.repair || problems == 0) {
+    // forget what was changed in memory
+    if(load_metadata() < 0) return -1;
+    return problems;
   }
-  return 0;
-}
 
-// return a new file descriptor not used; -1 if full
-int new_file_fd()
-{
-  int i;
-  for(i=0; i<MAX_OPEN_FILES; i++) {
-    if(open_files[i].inode <= 0)
-      return i;
+  for(i=0; i<INODE_TABLE_SECTORS; i++) {
+    int start = inode_chunks[i/INODE_CHUNK_SECTORS];
+    if(fsck.tdirty[i] && start > 0 &&
+       Disk_Write(start+i%INODE_CHUNK_SECTORS, (char*)fsck.table+i*SECTOR_SIZE) < 0) return -1;
   }
-  return -1;
+  for(i=0; chunks_changed && i<INODE_CHUNK_MAP_SECTORS; i++)
+    if(Disk_Write(INODE_CHUNK_MAP_START_SECTOR+i, (char*)inode_chunks+i*SECTOR_SIZE) < 0) return -1;
+  memset(meta_dirty, 1, sizeof(meta_dirty));
+  if(metadata_write() < 0 || Disk_Save(bs_filename) < 0) return -1;
+  dedup_reset();
+  cluster_cache_drop(-1);
+  summary_build();
+  fx_build();
+  dprintf("... repaired the file system\n");
+  return problems;
 }
 
 /* end of internal helper functions, start of API functions */
@@ -752,10 +2493,15 @@ int FS_Boot(char* backstore_fname)
     if(diskErrno == E_OPENING_FILE) {
       dprintf("... couldn't open file, create new file system\n");
 
-      // format superblock
+      // format superblock; the free space is one extent after the
+      // first chunk of the inode table
       char buf[SECTOR_SIZE];
       memset(buf, 0, SECTOR_SIZE);
-      *(int*)buf = OS_MAGIC;
+      superblock_t* sb = (superblock_t*)buf;
+      sb->magic = OS_MAGIC;
+      sb->free_inodes = MAX_FILES-1;
+      sb->free_sectors = TOTAL_SECTORS-DATABLOCK_START_SECTOR-INODE_CHUNK_SECTORS;
+      sb->extents[extent_bucket(sb->free_sectors)] = 1;
       if(Disk_Write(SUPERBLOCK_START_SECTOR, buf) < 0) {
 	    dprintf("... failed to format superblock\n");
 	    osErrno = E_GENERAL;
@@ -769,27 +2515,48 @@ int FS_Boot(char* backstore_fname)
       dprintf("... formatted inode bitmap (start=%d, num=%d)\n", (int)INODE_BITMAP_START_SECTOR, (int)INODE_BITMAP_SECTORS);
       
       // format sector bitmap (reserve the first few sectors to
-      // superblock, inode bitmap, sector bitmap, and inode table)
-      bitmap_init(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,DATABLOCK_START_SECTOR);
+      // superblock, inode bitmap, sector bitmap, and inode chunk map,
+      // plus the first chunk of the inode table)
+      bitmap_init(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, DATABLOCK_START_SECTOR+INODE_CHUNK_SECTORS);
       dprintf("... formatted sector bitmap (start=%d, num=%d)\n",(int)SECTOR_BITMAP_START_SECTOR, (int)SECTOR_BITMAP_SECTORS);
-      
-      // format inode tables
+
+      // format inode chunk map; only the first chunk, which holds the
+      // root directory, exists so far
       int i;
-      for(i=0; i<INODE_TABLE_SECTORS; i++) {
-	       memset(buf, 0, SECTOR_SIZE);
-	       if(i==0) {
-	       // the first inode table entry is the root directory
-	         ((inode_t*)buf)->size = 0;
-	         ((inode_t*)buf)->type = 1;
-	       }
-	       if(Disk_Write(INODE_TABLE_START_SECTOR+i, buf) < 0) {
-  	        dprintf("... failed to format inode table\n");
-  	        osErrno = E_GENERAL;
-  	        return -1;	
-          } 
+      memset(inode_chunks, 0, sizeof(inode_chunks));
+      inode_chunks[0] = DATABLOCK_START_SECTOR;
+      for(i=0; i<INODE_CHUNK_MAP_SECTORS; i++) {
+        if(Disk_Write(INODE_CHUNK_MAP_START_SECTOR+i, (char*)inode_chunks+i*SECTOR_SIZE) < 0) {
+          dprintf("... failed to format inode chunk map\n");
+          osErrno = E_GENERAL;
+          return -1;
         }
+      }
+      dprintf("... formatted inode chunk map (start=%d, num=%d)\n",(int)INODE_CHUNK_MAP_START_SECTOR, (int)INODE_CHUNK_MAP_SECTORS);
+
+      // the first inode table entry is the root directory; the rest of
+      // the chunk is still zero on the new disk
+      memset(buf, 0, SECTOR_SIZE);
+      ((inode_t*)buf)->size = 0;
+      ((inode_t*)buf)->type = 1;
+      if(Disk_Write(inode_chunks[0], buf) < 0) {
+        dprintf("... failed to format inode table\n");
+        osErrno = E_GENERAL;
+        return -1;
+      }
+      dprintf("... formatted inode table (start=%d, num=%d)\n", inode_chunks[0], (int)INODE_CHUNK_SECTORS);
 
-      dprintf("... formatted inode table (start=%d, num=%d)\n",(int)INODE_TABLE_START_SECTOR, (int)INODE_TABLE_SECTORS);
+      // the counts of the allocation groups are easiest to take from
+      // the bitmaps just written; the root is group 0's one directory
+      if(load_metadata() < 0) {
+        dprintf("... failed to load the formatted disk\n");
+        osErrno = E_GENERAL;
+        return -1;
+      }
+      ag_tally(&super.sb);
+      super.sb.ag_dirs[0] = 1;
+      meta_dirty[SUPERBLOCK_START_SECTOR] = 1;
+      if(metadata_write() < 0) return -1;
       
       // we need to synchronize the disk to the backstore file (so that we don't lose the formatted disk)
       if(Disk_Save(bs_filename) < 0) {
@@ -801,6 +2568,7 @@ int FS_Boot(char* backstore_fname)
       	// everything's good now, boot is successful
       	dprintf("... successfully formatted disk, boot successful\n");
       	memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
+  memset(open_dirs, 0, MAX_OPEN_DIRS*sizeof(open_dir_t));
       	return 0;
       }
     } else {
@@ -812,28 +2580,15 @@ int FS_Boot(char* backstore_fname)
   }else {
       dprintf("... load disk from file '%s' successful\n", bs_filename);
     
-      // we successfully loaded the disk, we need to do two more checks,
-      // first the file size must be exactly the size as expected (this
-      // supposedly should be folded in Disk_Load(); and it's not)
-      int sz = 0;
-      FILE* f = fopen(bs_filename, "r");
-      if(f) {
-        fseek(f, 0, SEEK_END);
-        sz = ftell(f);
-        fclose(f);
-      }
-      if(sz != SECTOR_SIZE*TOTAL_SECTORS) {
-        dprintf("... check size of file '%s' failed\n", bs_filename);
-        osErrno = E_GENERAL;
-        return -1;
-      }
-      dprintf("... check size of file '%s' successful\n", bs_filename);
-    
+      // we successfully loaded the disk; Disk_Load() already made sure
+      // the image (or each member of a composite image) has exactly the
+      // size expected, so only the magic number is left to check
       // check magic
-      if(check_magic()) {
+      if(check_magic() && load_metadata() == 0) {
         // everything's good by now, boot is successful
         dprintf("... check magic successful\n");
         memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
+  memset(open_dirs, 0, MAX_OPEN_DIRS*sizeof(open_dir_t));
         return 0;
       } else {      
         // mismatched magic number
@@ -858,6 +2613,434 @@ int FS_Sync()
   }  
 }
 
+int FS_Snapshot()
+{
+  dprintf("FS_Snapshot():\n");
+  int snap = Disk_Snapshot();
+  if(snap < 0) {
+    dprintf("... failed to take a snapshot of the disk\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... snapshot %d taken\n", snap);
+  return snap;
+}
+
+int FS_Rollback(int snap)
+{
+  dprintf("FS_Rollback(%d):\n", snap);
+  // open files may not exist in the snapshot
+  int i;
+  for(i=0; i<MAX_OPEN_FILES; i++) {
+    if(open_files[i].inode > 0) {
+      dprintf("... fd=%d is still open, can't roll back\n", i);
+      osErrno = E_FILE_IN_USE;
+      return -1;
+    }
+  }
+  for(i=0; i<MAX_OPEN_DIRS; i++) {
+    if(open_dirs[i].used) {
+      dprintf("... dd=%d is still open, can't roll back\n", i);
+      osErrno = E_FILE_IN_USE;
+      return -1;
+    }
+  }
+  if(Disk_Rollback(snap) < 0) {
+    dprintf("... no such snapshot\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  // the snapshot has its own bitmaps and chunks of the inode table
+  if(load_metadata() < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... rolled back to snapshot %d\n", snap);
+  return 0;
+}
+
+int FS_ReleaseSnapshot(int snap)
+{
+  dprintf("FS_ReleaseSnapshot(%d):\n", snap);
+  if(Disk_ReleaseSnapshot(snap) < 0) {
+    dprintf("... no such snapshot\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
+}
+
+int FS_Stat(FS_Stat_t* stat)
+{
+  dprintf("FS_Stat():\n");
+  if(!stat) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  // the disk runs out of room for the inode table long before MAX_FILES
+  stat->free_inodes = inodes_reachable();
+  stat->total_inodes = MAX_FILES-super.sb.free_inodes+stat->free_inodes;
+  stat->total_sectors = TOTAL_SECTORS;
+  stat->free_sectors = super.sb.free_sectors;
+  memcpy(stat->extents, super.sb.extents, sizeof(stat->extents));
+  stat->largest_extent = fx[fx_root].longest;
+  dprintf("... %d free inodes, %d free sectors\n", stat->free_inodes, stat->free_sectors);
+  return 0;
+}
+
+int FS_Defrag(FS_Defrag_t* report)
+{
+  dprintf("FS_Defrag():\n");
+  if(!report) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  memset(report, 0, sizeof(FS_Defrag_t));
+  int i, free_extents = 0;
+  for(i=0; i<FS_EXTENT_BUCKETS; i++) free_extents += super.sb.extents[i];
+  report->free_extents_before = free_extents;
+  report->score_before = frag_score(&report->inodes, &report->fragmented);
+  if(report->score_before < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  // move every fragmented file or directory into the first free run
+  // after its inode that fits it whole; the free space left by one may
+  // well make room for the next; files sharing sectors with a clone
+  // stay where they are, since moving them would undo the sharing
+  int chunk, j;
+  for(chunk=0; chunk<INODE_CHUNKS; chunk++) {
+    if(inode_chunks[chunk] <= 0) continue;
+    for(i=0; i<INODE_CHUNK_SECTORS; i++) {
+      int inode_sector = inode_chunks[chunk]+i;
+      char inode_buffer[SECTOR_SIZE];
+      if(Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+      for(j=0; j<INODES_PER_SECTOR; j++) {
+        int inode = chunk*INODES_PER_CHUNK+i*INODES_PER_SECTOR+j, n;
+        inode_t* node = (inode_t*)inode_buffer+j;
+        if(!bit_isset(inode_bitmap, inode) || inode_runs(node, &n) <= 1 || inode_shared(node)) continue;
+        int rc = inode_relocate(inode, node, inode_sector, inode_buffer, n);
+        if(rc < 0) {
+          dprintf("... failed to move inode %d\n", inode);
+          osErrno = E_GENERAL;
+          return -1;
+        }
+        if(rc > 0) {
+          dprintf("... moved the %d sectors of inode %d into one run\n", n, inode);
+          report->moved++;
+        }
+      }
+    }
+  }
+
+  free_extents = 0;
+  for(i=0; i<FS_EXTENT_BUCKETS; i++) free_extents += super.sb.extents[i];
+  report->free_extents_after = free_extents;
+  int inodes, fragmented;
+  report->score_after = frag_score(&inodes, &fragmented);
+  if(report->score_after < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... moved %d of %d fragmented inodes, score %d -> %d\n", report->moved, report->fragmented,
+          report->score_before, report->score_after);
+  return 0;
+}
+
+int FS_SetDedup(int on)
+{
+  dprintf("FS_SetDedup(%d):\n", on);
+  int was = dedup_on;
+  dedup_on = on != 0;
+  return was;
+}
+
+int FS_Dedup(FS_Dedup_t* report)
+{
+  dprintf("FS_Dedup():\n");
+  if(!report) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  memset(report, 0, sizeof(FS_Dedup_t));
+  if(refs_alloc() < 0) {
+    osErrno = E_NO_SPACE;
+    return -1;
+  }
+  int free_before = super.sb.free_sectors;
+
+  // index the data of every file from scratch; a sector with the same
+  // content as one seen before is dropped and the inode switched over
+  // to the earlier one (each inode sector is written once, after its
+  // inodes are done)
+  dedup_reset();
+  int chunk, i, j, k;
+  for(chunk=0; chunk<INODE_CHUNKS; chunk++) {
+    if(inode_chunks[chunk] <= 0) continue;
+    for(i=0; i<INODE_CHUNK_SECTORS; i++) {
+      int inode_sector = inode_chunks[chunk]+i, changed = 0;
+      char inode_buffer[SECTOR_SIZE];
+      if(Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+      for(j=0; j<INODES_PER_SECTOR; j++) {
+        int inode = chunk*INODES_PER_CHUNK+i*INODES_PER_SECTOR+j;
+        inode_t* node = (inode_t*)inode_buffer+j;
+        if(!bit_isset(inode_bitmap, inode) || INODE_TYPE(node) != 0 || IS_INLINE(node)) continue;
+        report->files++;
+        for(k=0; k<MAX_SECTORS_PER_FILE; k++) {
+          if(node->data[k] <= 0) continue;
+          char buf[SECTOR_SIZE];
+          if(Disk_Read(node->data[k], buf) < 0) { osErrno = E_GENERAL; return -1; }
+          report->sectors++;
+          unsigned int hash = dedup_hash_of(buf);
+          int same = dedup_find(buf, hash);
+          if(same == 0) dedup_insert(node->data[k], hash);
+          if(same == 0 || same == node->data[k]) continue;
+          sector_refs[same]++;
+          refs_dirty[same/REFS_PER_SECTOR] = 1;
+          sector_release(node->data[k]);
+          node->data[k] = same;
+          changed = 1;
+          report->shared++;
+        }
+      }
+      // as with File_Clone, the counts go out before the inodes
+      if(changed && (metadata_write() < 0 || Disk_Write(inode_sector, inode_buffer) < 0)) {
+        osErrno = E_GENERAL;
+        return -1;
+      }
+    }
+  }
+  report->freed = super.sb.free_sectors-free_before;
+  dprintf("... %d of %d sectors in %d files shared, %d sectors freed\n", report->shared, report->sectors,
+          report->files, report->freed);
+  return 0;
+}
+
+int FS_Check(char* backstore_fname, int repair, FS_Check_t* report)
+{
+  dprintf("FS_Check('%s', %d):\n", backstore_fname, repair);
+  if(!report) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  memset(report, 0, sizeof(FS_Check_t));
+
+  // load the image as FS_Boot does, except that a missing image is an
+  // error rather than a reason to format one
+  strncpy(bs_filename, backstore_fname, 1024);
+  bs_filename[1023] = '\0'; // for safety
+  if(Disk_Init() < 0 || Disk_Load(bs_filename) < 0 || !check_magic() || load_metadata() < 0) {
+    dprintf("... can't load a file system from '%s'\n", bs_filename);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
+  memset(open_dirs, 0, MAX_OPEN_DIRS*sizeof(open_dir_t));
+
+  memset(&fsck, 0, sizeof(fsck));
+  fsck.repair = repair;
+  fsck.report = report;
+  fsck.table = calloc(MAX_FILES, sizeof(inode_t));
+  fsck.tdirty = calloc(INODE_TABLE_SECTORS, 1);
+  fsck.owner = malloc(TOTAL_SECTORS*sizeof(int));
+  fsck.shared = calloc(TOTAL_SECTORS, 1);
+  fsck.users = calloc(TOTAL_SECTORS, sizeof(int));
+  fsck.bad = calloc(MAX_FILES, 1);
+  fsck.reached = calloc(MAX_FILES, 1);
+  int problems = -1;
+  if(fsck.table && fsck.tdirty && fsck.owner && fsck.shared && fsck.users && fsck.bad && fsck.reached)
+    problems = fsck_run();
+  free(fsck.table);
+  free(fsck.tdirty);
+  free(fsck.owner);
+  free(fsck.shared);
+  free(fsck.users);
+  free(fsck.bad);
+  free(fsck.reached);
+  if(problems < 0) {
+    dprintf("... check failed\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... %d problems found\n", problems);
+  return problems;
+}
+
+int FS_Build(char* backstore_fname, FS_Node_t* root)
+{
+  dprintf("FS_Build('%s'):\n", backstore_fname);
+  if(!root || root->type != 1) {
+    dprintf("... root is not a directory\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  // number the nodes breadth first, so that each directory's entries
+  // get consecutive inodes; everything is checked before the current
+  // disk is touched, so a bad tree leaves the file system as it was
+  static FS_Node_t* order[MAX_FILES];
+  static int first_child[MAX_FILES];
+  int nnodes = 1, nsectors = DATABLOCK_START_SECTOR;
+  int i, j, k;
+  order[0] = root;
+  for(i=0; i<nnodes; i++) {
+    FS_Node_t* node = order[i];
+    if(node->type == 1) {
+      if(node->nchildren < 0 || node->nchildren > MAX_SECTORS_PER_FILE*DIRENTS_PER_SECTOR) {
+        dprintf("... too many entries in directory '%s'\n", node->name);
+        osErrno = E_FILE_TOO_BIG;
+        return -1;
+      }
+      first_child[i] = nnodes;
+      for(j=0; j<node->nchildren; j++) {
+        FS_Node_t* child = &node->children[j];
+        if(!child->name || !*child->name || illegal_filename(child->name)) {
+          dprintf("... illegal file name: '%s'\n", child->name ? child->name : "");
+          osErrno = E_CREATE;
+          return -1;
+        }
+        for(k=0; k<j; k++) {
+          if(!strcmp(node->children[k].name, child->name)) {
+            dprintf("... duplicate file name: '%s'\n", child->name);
+            osErrno = E_CREATE;
+            return -1;
+          }
+        }
+        if(nnodes == MAX_FILES) {
+          dprintf("... error: inode table is full\n");
+          osErrno = E_CREATE;
+          return -1;
+        }
+        order[nnodes++] = child;
+      }
+      nsectors += (node->nchildren+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR;
+    } else if(node->type == 0) {
+      if(node->size < 0 || node->size > MAX_FILE_SIZE || (node->size > 0 && !node->data)) {
+        dprintf("... file '%s' is too big\n", node->name);
+        osErrno = E_FILE_TOO_BIG;
+        return -1;
+      }
+      if(node->size > INLINE_SIZE) nsectors += (node->size+SECTOR_SIZE-1)/SECTOR_SIZE;
+    } else {
+      dprintf("... bad node type %d\n", node->type);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    if(nsectors > TOTAL_SECTORS) {
+      dprintf("... error: disk is full\n");
+      osErrno = E_NO_SPACE;
+      return -1;
+    }
+  }
+  // the inode table goes in front of the data, in as many chunks as
+  // the inodes need
+  int nchunks = (nnodes+INODES_PER_CHUNK-1)/INODES_PER_CHUNK;
+  nsectors += nchunks*INODE_CHUNK_SECTORS;
+  if(nsectors > TOTAL_SECTORS) {
+    dprintf("... error: disk is full\n");
+    osErrno = E_NO_SPACE;
+    return -1;
+  }
+  dprintf("... %d inodes, %d data sectors\n", nnodes, (int)(nsectors-DATABLOCK_START_SECTOR-nchunks*INODE_CHUNK_SECTORS));
+
+  // start over with a blank disk
+  if(Disk_Init() < 0) {
+    dprintf("... disk init failed\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  strncpy(bs_filename, backstore_fname, 1024);
+  bs_filename[1023] = '\0'; // for safety
+  memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
+  memset(open_dirs, 0, MAX_OPEN_DIRS*sizeof(open_dir_t));
+
+  // all inodes and sectors in use are at the front, so the bitmaps
+  // are a run of ones each and the free space is a single extent
+  memset(&super, 0, sizeof(super));
+  super.sb.magic = OS_MAGIC;
+  super.sb.free_inodes = MAX_FILES-nnodes;
+  super.sb.free_sectors = TOTAL_SECTORS-nsectors;
+  extent_count(super.sb.free_sectors, 1);
+  memset(inode_bitmap, 0, sizeof(inode_bitmap));
+  bitmap_fill(inode_bitmap, nnodes);
+  memset(sector_bitmap, 0, sizeof(sector_bitmap));
+  bitmap_fill(sector_bitmap, nsectors);
+  memset(sector_refs, 0, sizeof(sector_refs)); // nothing is shared yet
+  memset(refs_dirty, 0, sizeof(refs_dirty));
+  dedup_reset();
+  cluster_cache_drop(-1);
+  summary_build();
+  fx_build();
+  ag_tally(&super.sb);
+  for(i=0; i<nnodes; i++)
+    if(order[i]->type == 1) super.sb.ag_dirs[INODE_AG(i)]++;
+  memset(meta_dirty, 1, sizeof(meta_dirty));
+  if(metadata_write() < 0) goto write_failed;
+
+  char buf[SECTOR_SIZE];
+  memset(inode_chunks, 0, sizeof(inode_chunks));
+  for(i=0; i<nchunks; i++) inode_chunks[i] = DATABLOCK_START_SECTOR+i*INODE_CHUNK_SECTORS;
+  for(i=0; i<INODE_CHUNK_MAP_SECTORS; i++)
+    if(Disk_Write(INODE_CHUNK_MAP_START_SECTOR+i, (char*)inode_chunks+i*SECTOR_SIZE) < 0) goto write_failed;
+
+  // lay out the data in inode order, one sector after another, and
+  // fill in the inode table as we go; the rest of the table stays zero
+  int next = DATABLOCK_START_SECTOR+nchunks*INODE_CHUNK_SECTORS;
+  for(i=0; i*INODES_PER_SECTOR<nnodes; i++) {
+    char inode_buffer[SECTOR_SIZE];
+    memset(inode_buffer, 0, SECTOR_SIZE);
+    for(k=0; k<INODES_PER_SECTOR && i*INODES_PER_SECTOR+k<nnodes; k++) {
+      int ino = i*INODES_PER_SECTOR+k;
+      FS_Node_t* node = order[ino];
+      inode_t* inode = (inode_t*)(inode_buffer+k*sizeof(inode_t));
+      inode->type = node->type;
+      if(node->type == 1) {
+        inode->size = node->nchildren;
+        for(j=0; j<node->nchildren; j++) {
+          if(j%DIRENTS_PER_SECTOR == 0) memset(buf, 0, SECTOR_SIZE);
+          dirent_t* dirent = (dirent_t*)buf+j%DIRENTS_PER_SECTOR;
+          strncpy(dirent->fname, node->children[j].name, MAX_NAME);
+          dirent->inode = first_child[ino]+j;
+          if(j%DIRENTS_PER_SECTOR == DIRENTS_PER_SECTOR-1 || j == node->nchildren-1) {
+            inode->data[j/DIRENTS_PER_SECTOR] = next;
+            if(Disk_Write(next++, buf) < 0) goto write_failed;
+          }
+        }
+      } else {
+        inode->size = node->size;
+        if(node->size <= INLINE_SIZE) {
+          inode->type |= INODE_INLINE;
+          memcpy(inode->data, node->data, node->size);
+          continue;
+        }
+        for(j=0; j*SECTOR_SIZE<node->size; j++) {
+          int n = node->size-j*SECTOR_SIZE;
+          if(n > SECTOR_SIZE) n = SECTOR_SIZE;
+          memset(buf, 0, SECTOR_SIZE);
+          memcpy(buf, node->data+j*SECTOR_SIZE, n);
+          inode->data[j] = next;
+          if(Disk_Write(next++, buf) < 0) goto write_failed;
+        }
+      }
+    }
+    if(Disk_Write(inode_table_sector(i*INODES_PER_SECTOR), inode_buffer) < 0) goto write_failed;
+  }
+
+  if(Disk_Save(bs_filename) < 0) {
+    dprintf("... failed to save disk to file '%s'\n", bs_filename);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... successfully built file system in '%s'\n", bs_filename);
+  return 0;
+
+ write_failed:
+  dprintf("... failed to write the disk\n");
+  osErrno = E_GENERAL;
+  return -1;
+}
+
 int File_Create(char* file)
 {
   dprintf("File_Create('%s'):\n", file);
@@ -929,20 +3112,20 @@ int File_Open(char* file)
   follow_path(file, &child_inode, NULL);
   if(child_inode >= 0) { // child is the one
     // load the disk sector containing the inode
-    int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
+    int inode_sector = inode_table_sector(child_inode);
     char inode_buffer[SECTOR_SIZE];
     if(Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
     dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
 
     // get the inode
-    int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
+    int inode_start_entry = child_inode-child_inode%INODES_PER_SECTOR;
     int offset = child_inode-inode_start_entry;
     assert(0 <= offset && offset < INODES_PER_SECTOR);
     inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
     dprintf("... inode %d (size=%d, type=%d)\n",
 	    child_inode, child->size, child->type);
 
-    if(child->type != 0) {
+    if(INODE_TYPE(child) != 0) {
       dprintf("... error: '%s' is not a file\n", file);
       osErrno = E_GENERAL;
       return -1;
@@ -952,6 +3135,7 @@ int File_Open(char* file)
     open_files[fd].inode = child_inode;
     open_files[fd].size = child->size;
     open_files[fd].pos = 0;
+    open_files[fd].max = FILE_MAX(child);
     return fd;
   } else {
     dprintf("... file '%s' is not found\n", file);
@@ -960,89 +3144,119 @@ int File_Open(char* file)
   }  
 }
 
+// every descriptor open on 'inode' sees its new 'size'
+static void open_files_resize(int inode, int size)
+{
+  int i;
+  for(i=0; i<MAX_OPEN_FILES; i++)
+    if(open_files[i].inode == inode) open_files[i].size = size;
+}
+
 int File_Read(int fd, void* buffer, int size)
 {
   //Begin Our code
   dprintf("... Reading File \n");
-  //int bufCounter = 0;
   int i;
- 
-  if(is_file_open(open_files[fd].inode) != 1){ //going through open_file array to check if file is open
+
+  if(fd < 0 || fd >= MAX_OPEN_FILES || open_files[fd].inode <= 0){ //the descriptor has to refer to an open file
         osErrno=E_BAD_FD;
         return -1; 
       }
 
   dprintf("... open_files.nodes = %d and size %d  and initial position %d \n", open_files[fd].inode, open_files[fd].size, open_files[fd].pos );
-	int toRead=(open_files[fd].pos + size);//position of where read is to end
-	if(toRead > open_files[fd].size){ //if reading is bigger than the file size, we'll read until the end of the file
-		toRead=(open_files[fd].size);
-	}
-
+  if(size < 0){
+    osErrno = E_GENERAL;
+    return -1;
+  }
   	//getting child inode
 	int child_inode=open_files[fd].inode;		
-	int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR; 
+	int inode_sector = inode_table_sector(child_inode); 
 	char inode_buffer[SECTOR_SIZE];
 	if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
 		dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
 
 	// get the point where to start reading the data from
-	int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
+	int inode_start_entry = child_inode-child_inode%INODES_PER_SECTOR;
 	int offset = child_inode-inode_start_entry;
   assert(0 <= offset && offset < INODES_PER_SECTOR);
   inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
 
-  if(child->type != 0) {
+  if(INODE_TYPE(child) != 0) {
       dprintf("... error: this inode is not a file\n");
       osErrno = E_GENERAL;
       return -1;
   }
 
 	dprintf("... reading inode %d (size=%d, type=%d)\n",child_inode, child->size, child->type);	
- 
-  int bytesToRead = toRead - open_files[fd].pos;                      //Total bytes to read 
-  int saveBytesRead = bytesToRead;                                    //Number of bytes read to return at the end
 
-  int offsetSectorToLoad = open_files[fd].pos / SECTOR_SIZE;          //This is the first index in the data sectors to load in order to read 
-  int positionInsideSector = open_files[fd].pos % SECTOR_SIZE;         //Number of bytes to start reading in the first sector
+	int toRead = size;                   //if reading is bigger than the file size, we'll read until the end of the file
+	if(toRead > child->size - open_files[fd].pos){     //the size on disk: another descriptor may have changed it
+		toRead = child->size - open_files[fd].pos;
+	}
+  if(toRead <= 0){
+    dprintf("... The position of the pointer is at the end of the file\n");
+    return 0;
+  }
 
-  
-  int bytesInSector = bytesToRead < SECTOR_SIZE? bytesToRead: SECTOR_SIZE-positionInsideSector;           //Amount of bytes to read inside a sector  (This will be the first sector)
-  int bufIndex = 0; 
-  
-  int numberOfSectorsToRead = (toRead - (SECTOR_SIZE-positionInsideSector)) / SECTOR_SIZE;    //Amount of sectors to read
+  if(IS_INLINE(child)){                 //The content is right here in the inode
+    memcpy(buffer, (char*)child->data + open_files[fd].pos, toRead);
+    open_files[fd].pos += toRead;
+    dprintf("... We read %d inline bytes in this file\n", toRead );
+    return toRead;
+  }
 
-  char buf[SECTOR_SIZE];
-  
-  if(open_files[fd].size <= open_files[fd].pos){
-         dprintf("... The position of the pointer is at the end of the file\n");
-          return 0;
+  if(IS_COMPRESSED(child)){             //A cluster at a time, decompressed (or found in the cache)
+    unsigned short map[MAX_CLUSTERS];
+    char cluster[CLUSTER_SIZE];
+    if(cluster_map_read(child_inode, child, map) < 0){
+      osErrno = E_GENERAL;
+      return -1;
     }
+    int bufIndex = 0;
+    while(bufIndex < toRead){
+      int at = open_files[fd].pos % CLUSTER_SIZE;
+      int bytesInCluster = CLUSTER_SIZE - at;
+      if(bytesInCluster > toRead - bufIndex) bytesInCluster = toRead - bufIndex;
+      int err = cluster_load(child_inode, child, map, open_files[fd].pos / CLUSTER_SIZE, cluster);
+      if(err){
+        osErrno = err;
+        return -1;
+      }
+      memcpy((char*)buffer + bufIndex, cluster + at, bytesInCluster);
+      open_files[fd].pos += bytesInCluster;
+      bufIndex += bytesInCluster;
+    }
+    dprintf("... We read %d bytes in this compressed file\n", toRead );
+    return toRead;
+  }
 
-  for(i = offsetSectorToLoad; i<offsetSectorToLoad + numberOfSectorsToRead+1; i++){       //Go through all the file data  
-
-   if(i>MAX_SECTORS_PER_FILE){ //This check is just for safety
-      osErrno=E_FILE_TOO_BIG;
-      return -1;              //File will be too big if we write this size
-   }   
-
-   if(Disk_Read(child->data[i], buf) == 0){     //get data from disk    
-
-       if(memcpy(buffer + bufIndex, buf + positionInsideSector , bytesInSector)==NULL) return -1;     //Read from memory to the buffer
-       
-       open_files[fd].pos +=  bytesInSector;        //Update the file position
-       bufIndex += bytesInSector;                   //Update the buffer index
-       bytesToRead -=bytesInSector;
-       bytesInSector = bytesToRead < SECTOR_SIZE? bytesToRead: SECTOR_SIZE; 
-
+  //Go sector by sector from the current position; whole sectors are read straight
+  //into the caller's buffer, only the partial ones at either end go through 'buf'
+  char buf[SECTOR_SIZE];
+  int bufIndex = 0;
+  for(i = open_files[fd].pos / SECTOR_SIZE; bufIndex < toRead; i++){
+    int positionInsideSector = open_files[fd].pos % SECTOR_SIZE;      //Where to start reading inside this sector
+    int bytesInSector = SECTOR_SIZE - positionInsideSector;            //Amount of bytes to read inside this sector
+    if(bytesInSector > toRead - bufIndex) bytesInSector = toRead - bufIndex;
+
+    int whole = (bytesInSector == SECTOR_SIZE);
+    if(child->data[i] == 0){                   //A hole reads back as zeros, without going to the disk
+      memset((char*)buffer + bufIndex, 0, bytesInSector);
     }else{
-      dprintf("... failed to read sector %d\n", child->data[i]);
-       osErrno = E_GENERAL; 
-       return -1; 
-    }    
+      if(Disk_Read(child->data[i], whole ? (char*)buffer + bufIndex : buf) < 0){     //get data from disk
+        dprintf("... failed to read sector %d\n", child->data[i]);
+        osErrno = E_GENERAL; 
+        return -1; 
+      }
+      if(!whole) memcpy((char*)buffer + bufIndex, buf + positionInsideSector, bytesInSector);
+    }
+
+    open_files[fd].pos += bytesInSector;        //Update the file position
+    bufIndex += bytesInSector;                  //Update the buffer index
   }
   
-  dprintf("... We read %d bytes in this file\n", saveBytesRead );
-  return saveBytesRead;
+  dprintf("... We read %d bytes in this file\n", toRead );
+  return toRead;
   
   //End Our code
 }
@@ -1052,14 +3266,18 @@ int File_Write(int fd, void* buffer, int size)
   /*********** Begin our CODE ***************/
   dprintf("... Writing File \n");
 
-  if(is_file_open(open_files[fd].inode) != 1){ //going through open_file array to check if file is open
+  if(fd < 0 || fd >= MAX_OPEN_FILES || open_files[fd].inode <= 0){ //the descriptor has to refer to an open file
         osErrno=E_BAD_FD;
         return -1;              //File is not opened
   }
 
   dprintf("... open_files.nodes = %d \n", open_files[fd].inode);
 
-  if(open_files[fd].size + size > MAX_FILE_SIZE){
+  if(size < 0){
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(open_files[fd].pos + size > open_files[fd].max){
       osErrno=E_FILE_TOO_BIG;
       return -1;              //File will be too big if we write this size
   }
@@ -1067,87 +3285,146 @@ int File_Write(int fd, void* buffer, int size)
   //getting child inode
   int child_inode=open_files[fd].inode;
     
-  int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
+  int inode_sector = inode_table_sector(child_inode);
  
   char inode_buffer[SECTOR_SIZE];
   if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
     dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
 
   // get the point where to start reading the data from
-  int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
+  int inode_start_entry = child_inode-child_inode%INODES_PER_SECTOR;
   int offset = child_inode-inode_start_entry;
   assert(0 <= offset && offset < INODES_PER_SECTOR);
   inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
 
-  if(child->type != 0) {
+  if(INODE_TYPE(child) != 0) {
       dprintf("... error: this inode is not a file\n");
       osErrno = E_GENERAL;
       return -1;
   }
 
   dprintf("... traying to write inode %d (size=%d, type=%d)\n",child_inode, child->size, child->type);
-  int offsetSectorToLoad = open_files[fd].pos / SECTOR_SIZE;          //Offset sector to load inside the data array of the inode from the position to write
-  int positionInsideSector = open_files[fd].pos % SECTOR_SIZE;         //Number of bytes to start writing in the first sector
 
+  if(IS_INLINE(child)){
+    if(open_files[fd].pos + size <= INLINE_SIZE){         //Still fits in the inode: no data sector needed
+      memcpy((char*)child->data + open_files[fd].pos, buffer, size);
+      open_files[fd].pos += size;
+      if(open_files[fd].pos > child->size) child->size = open_files[fd].pos;
+      if(Disk_Write(inode_sector, inode_buffer) < 0) {
+        dprintf("... failed to write sector %d\n", inode_sector);
+        osErrno = E_GENERAL;
+        return -1;
+      }
+      open_files_resize(child_inode, child->size);
+      dprintf("... wrote %d inline bytes, final position %d\n", size, open_files[fd].pos);
+      return size;
+    }
+
+    //The file outgrows the inode: move what it holds to its first data sector
+    int err = inline_spill(child_inode, child);
+    if(err) {
+      osErrno = err;
+      return -1;
+    }
+  }
 
-  int remainderBytesToCopy = (MAX_FILE_SIZE < open_files[fd].pos +size)? MAX_FILE_SIZE- open_files[fd].pos : size;
-  int bytesInSector = SECTOR_SIZE-positionInsideSector;
+  //Writing past the end leaves a gap that has to read back as zeros: the sectors
+  //in between stay holes, but the end of the last sector may still hold old data
+  int error = 0;
+  if(IS_COMPRESSED(child)){           //Whole clusters are compressed again instead (see clusters_write)
+    int done = 0;
+    error = clusters_write(child_inode, child, open_files[fd].pos, buffer, size, &done);
+    open_files[fd].pos += done;
+  }else if(open_files[fd].pos > child->size) error = file_clear_tail(child_inode, child);
+
+  //Go sector by sector from the current position; whole sectors are written straight
+  //from the caller's buffer, only the partial ones at either end need the old contents
+  char buf[SECTOR_SIZE];
   int bufIndex = 0;
-  
-  int numberOfSectorsToWrite = (size - (SECTOR_SIZE-positionInsideSector)) / SECTOR_SIZE;    //How many sectors beside compleating the first one I need to write         
-
-  char buf[SECTOR_SIZE]; //buffer to receive all the data of the file
   int i;
-  
-  for(i = offsetSectorToLoad; i<numberOfSectorsToWrite+1; i++){       //Go through all the file data
-    
-    if(i>MAX_SECTORS_PER_FILE){ //This check is just for safety
-      osErrno=E_FILE_TOO_BIG;
-      return -1;              //File will be too big if we write this size
+  for(i = open_files[fd].pos / SECTOR_SIZE; !error && !IS_COMPRESSED(child) && bufIndex < size; i++){
+    int positionInsideSector = open_files[fd].pos % SECTOR_SIZE;      //Where to start writing inside this sector
+    int bytesInSector = SECTOR_SIZE - positionInsideSector;            //Amount of bytes to write inside this sector
+    if(bytesInSector > size - bufIndex) bytesInSector = size - bufIndex;
+
+    //With dedup on, a whole sector that is already on disk somewhere is shared, not written again
+    int whole = dedup_on && bytesInSector == SECTOR_SIZE;
+    unsigned int hash = 0;
+    if(whole){
+      hash = dedup_hash_of((char*)buffer + bufIndex);
+      int same = dedup_find((char*)buffer + bufIndex, hash);
+      if(same > 0 && same != child->data[i] && refs_alloc() == 0){
+        if(child->data[i] > 0) sector_release(child->data[i]);   //Our old copy goes, unless a clone still has it
+        sector_refs[same]++;
+        refs_dirty[same/REFS_PER_SECTOR] = 1;
+        child->data[i] = same;
+        if(metadata_write() < 0){
+          error = E_GENERAL;
+          break;
+        }
+        dprintf("... sharing disk sector %d at index child->data[%d]\n", same, i);
+      }
+      if(same > 0 && same == child->data[i]){   //Nothing to write
+        open_files[fd].pos += bytesInSector;
+        bufIndex += bytesInSector;
+        continue;
+      }
     }
-    
+
+    int fresh = 0;
     if(child->data[i] == 0){    //This sector is not being use, so we need to initialize it 
-        child->data[i] = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);    //Request a new sector
-        if(child->data[i] < 0) {
+        int newsec = sectors_alloc(data_goal(child_inode, i > 0 ? child->data[i-1] : 0), 1);    //Request a new sector, next to the one before it
+        if(newsec < 0) {
           dprintf("... error: disk is full\n");
-           osErrno = E_NO_SPACE;
-          return -1;
+          error = E_NO_SPACE;
+          break;
         }
+        child->data[i] = newsec;
+        fresh = 1;
+    }else if(sector_refs[child->data[i]] > 0){   //Shared with a clone: this file gets its own copy first
+        error = sector_unshare(child_inode, child, i, bytesInSector < SECTOR_SIZE);
+        if(error) break;
     }
-      dprintf("... writing bytes into disk sector %d at index child->data[%d]\n" , child->data[i], i);
-     
-    if(Disk_Read(child->data[i], buf) == 0){     //get data from disk     
-
-       if(memcpy(buf + positionInsideSector , buffer + bufIndex, bytesInSector)==NULL) return -1;   //Copying from buffer to memory sector
-       open_files[fd].pos += bytesInSector;
-       bufIndex += bytesInSector;
-       remainderBytesToCopy -=bytesInSector;
-       bytesInSector = remainderBytesToCopy < SECTOR_SIZE? remainderBytesToCopy: SECTOR_SIZE;
-
-
-      if(Disk_Write(child->data[i], buf) < 0) {
-            dprintf("... failed to write sector %d\n", child->data[i]);     //Write back the data sector 
-            osErrno = E_GENERAL;
-            return -1;  
+    dprintf("... writing bytes into disk sector %d at index child->data[%d]\n" , child->data[i], i);
+
+    char* src = (char*)buffer + bufIndex;
+    if(bytesInSector < SECTOR_SIZE){           //Merge with what is already in the sector
+      if(fresh) memset(buf, 0, SECTOR_SIZE);
+      else if(Disk_Read(child->data[i], buf) < 0){
+        dprintf("... failed to read sector %d\n", child->data[i]);
+        error = E_GENERAL;
+        break;
       }
+      memcpy(buf + positionInsideSector, src, bytesInSector);
+      src = buf;
+    }
+    if(Disk_Write(child->data[i], src) < 0) {
+      dprintf("... failed to write sector %d\n", child->data[i]);     //Write back the data sector 
+      error = E_GENERAL;
+      break;
+    }
+    if(whole) dedup_insert(child->data[i], hash);   //Later writes of the same content can share it
+    else dedup_forget(child->data[i]);
 
-    }else{
-      dprintf("... failed to read sector %d\n", child->data[i]);
-       osErrno = E_GENERAL; 
-       return -1; 
-    }    
+    open_files[fd].pos += bytesInSector;
+    bufIndex += bytesInSector;
   }
 
-  //At this point the writing was succefully 
-  open_files[fd].size = open_files[fd].pos;
-  child->size =  open_files[fd].pos;
+  //Whatever made it to the disk is kept, even if we could not write it all; the
+  //size is the one on disk, as another descriptor may have grown the file since
+  if(open_files[fd].pos > child->size) child->size = open_files[fd].pos;
 
   if(Disk_Write(inode_sector, inode_buffer) < 0) {
             dprintf("... failed to write sector %d\n", inode_sector);     //Write back the inode sector 
             osErrno = E_GENERAL;
             return -1;  
   }
+  open_files_resize(child_inode, child->size);
   dprintf("... successfully wrote inode sector %d\n", inode_sector );
+  if(error){
+    osErrno = error;
+    return -1;
+  }
 
     dprintf("... Final position of the pointer inside this file = %d\n", open_files[fd].pos);
   return size;
@@ -1158,13 +3435,13 @@ int File_Write(int fd, void* buffer, int size)
 int File_Seek(int fd, int offset)
 {
   /* Begin our CODE */
-  if(is_file_open(open_files[fd].inode) != 1){ //going through open_file array to check if file is open
+  if(fd < 0 || fd >= MAX_OPEN_FILES || open_files[fd].inode <= 0){ //the descriptor has to refer to an open file
         osErrno=E_BAD_FD;
         return -1; 
   }
 
   dprintf("... Inside file seek open_files[%d].size= %d\n",fd, open_files[fd].size);
-	if(open_files[fd].size<offset || open_files[fd].size<0){
+	if(offset > open_files[fd].max || offset<0){      //Seeking past the end is fine: a write there leaves a hole
 		
 		osErrno = E_SEEK_OUT_OF_BOUNDS;
 		return -1;
@@ -1176,10 +3453,157 @@ int File_Seek(int fd, int offset)
   //End our code
 }
 
+// load the inode of the file open as 'fd' into 'inode_buffer' and
+// return it, with the sector it is in through 'inode_sector'; return
+// NULL (and set osErrno) if 'fd' is not an open file
+static inode_t* open_file_inode(int fd, char* inode_buffer, int* inode_sector)
+{
+  if(fd < 0 || fd >= MAX_OPEN_FILES || open_files[fd].inode <= 0) {
+    osErrno = E_BAD_FD;
+    return NULL;
+  }
+  int inode = open_files[fd].inode;
+  *inode_sector = inode_table_sector(inode);
+  if(Disk_Read(*inode_sector, inode_buffer) < 0) {
+    osErrno = E_GENERAL;
+    return NULL;
+  }
+  return (inode_t*)(inode_buffer+(inode%INODES_PER_SECTOR)*sizeof(inode_t));
+}
+
+int File_Truncate(int fd, int size)
+{
+  dprintf("File_Truncate(%d, %d):\n", fd, size);
+  char inode_buffer[SECTOR_SIZE];
+  int inode_sector;
+  inode_t* child = open_file_inode(fd, inode_buffer, &inode_sector);
+  if(!child) return -1;
+  if(size < 0 || size > FILE_MAX(child)) {
+    osErrno = size < 0 ? E_GENERAL : E_FILE_TOO_BIG;
+    return -1;
+  }
+  int inode = open_files[fd].inode;
+
+  if(IS_COMPRESSED(child)) {
+    // the end of the last cluster is cleared right away, so growing
+    // needs nothing but the new size
+    int err = size < child->size ? clusters_shrink(inode, child, size) : 0;
+    if(err) {
+      Disk_Write(inode_sector, inode_buffer);
+      osErrno = err;
+      return -1;
+    }
+    child->size = size;
+  } else if(size < child->size) {
+    if(file_shrink(child, size) < 0) return -1;
+  } else if(size > child->size) {
+    // a file grows with a hole: no sectors are taken, only the rest of
+    // its last sector is cleared
+    if(IS_INLINE(child) && size > INLINE_SIZE) {
+      int err = inline_spill(inode, child);
+      if(err) {
+        osErrno = err;
+        return -1;
+      }
+    }
+    int err = file_clear_tail(inode, child);
+    if(err) {
+      // the inode may have a new last sector by now
+      Disk_Write(inode_sector, inode_buffer);
+      osErrno = err;
+      return -1;
+    }
+    child->size = size;
+  }
+  if(Disk_Write(inode_sector, inode_buffer) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  // every descriptor of the file sees the new size
+  int i;
+  for(i=0; i<MAX_OPEN_FILES; i++) {
+    if(open_files[i].inode != inode) continue;
+    open_files[i].size = size;
+    if(open_files[i].pos > size) open_files[i].pos = size;
+  }
+  dprintf("... inode %d is now %d bytes\n", inode, size);
+  return 0;
+}
+
+int File_Preallocate(int fd, int size)
+{
+  dprintf("File_Preallocate(%d, %d):\n", fd, size);
+  char inode_buffer[SECTOR_SIZE];
+  int inode_sector;
+  inode_t* child = open_file_inode(fd, inode_buffer, &inode_sector);
+  if(!child) return -1;
+  if(size < 0 || size > FILE_MAX(child)) {
+    osErrno = size < 0 ? E_GENERAL : E_FILE_TOO_BIG;
+    return -1;
+  }
+  // how many sectors a compressed file needs isn't known until it is
+  // written, so there is nothing to reserve
+  if(IS_COMPRESSED(child)) return 0;
+  int err = file_reserve(open_files[fd].inode, child, size);
+  if(Disk_Write(inode_sector, inode_buffer) < 0) err = E_GENERAL;
+  if(err) {
+    osErrno = err;
+    return -1;
+  }
+  return 0;
+}
+
+// move the position of the file open as 'fd' to the first offset at or
+// after 'offset' that is in a hole (hole=1) or in data (hole=0), and
+// return it; holes are whole sectors (whole clusters in a compressed
+// file), and the end of the file counts as either
+static int seek_hole_or_data(int fd, int offset, int hole)
+{
+  char inode_buffer[SECTOR_SIZE];
+  int inode_sector;
+  inode_t* child = open_file_inode(fd, inode_buffer, &inode_sector);
+  if(!child) return -1;
+  if(offset < 0) {
+    osErrno = E_SEEK_OUT_OF_BOUNDS;
+    return -1;
+  }
+  if(IS_INLINE(child)) {
+    if(hole) offset = child->size;
+  } else if(IS_COMPRESSED(child)) {
+    // a hole is a cluster of zeroes
+    unsigned short map[MAX_CLUSTERS];
+    if(cluster_map_read(open_files[fd].inode, child, map) < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    while(offset < child->size && (map[offset/CLUSTER_SIZE] == 0) != hole)
+      offset = (offset/CLUSTER_SIZE+1)*CLUSTER_SIZE;
+  } else {
+    while(offset < child->size && (child->data[offset/SECTOR_SIZE] == 0) != hole)
+      offset = (offset/SECTOR_SIZE+1)*SECTOR_SIZE;
+  }
+  if(offset > child->size) offset = child->size;
+  open_files[fd].pos = offset;
+  return offset;
+}
+
+int File_SeekData(int fd, int offset)
+{
+  dprintf("File_SeekData(%d, %d):\n", fd, offset);
+  return seek_hole_or_data(fd, offset, 0);
+}
+
+int File_SeekHole(int fd, int offset)
+{
+  dprintf("File_SeekHole(%d, %d):\n", fd, offset);
+  return seek_hole_or_data(fd, offset, 1);
+}
+
 int File_Close(int fd)
 {
   dprintf("File_Close(%d):\n", fd);
-  if(0 > fd || fd > MAX_OPEN_FILES) {
+  if(0 > fd || fd >= MAX_OPEN_FILES) {
     dprintf("... fd=%d out of bound\n", fd);
     osErrno = E_BAD_FD;
     return -1;
@@ -1211,6 +3635,11 @@ int Dir_Unlink(char* path)
   int parent_inode = follow_path(path, &child_inode, last_fname);   //Get the father inode
   
   if(parent_inode >= 0) {         //Father inode found 
+    if(child_inode == 0) {        //The root directory is always there
+      dprintf("... can't remove the root directory\n");
+      osErrno = E_ROOT_DIR;
+      return -1;
+    }
     if(child_inode >= 0) {        //Child inode found      
       
       int result;
@@ -1258,19 +3687,19 @@ int Dir_Size(char* path)
     dprintf("... found file '%s' at inode: %d\n", path, child_inode); 
      
       // load the disk sector containing the inode
-      int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
+      int inode_sector = inode_table_sector(child_inode);
       char inode_buffer[SECTOR_SIZE];
       if(Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
       dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
 
       // get the inode
-      int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
+      int inode_start_entry = child_inode-child_inode%INODES_PER_SECTOR;
       int offset = child_inode-inode_start_entry;
       assert(0 <= offset && offset < INODES_PER_SECTOR);
       inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
       dprintf("... inode %d (size=%d, type=%d)\n",child_inode, child->size, child->type);
 
-      if(child->type == 0) {      //This is a file
+      if(INODE_TYPE(child) == 0) {      //This is a file
           dprintf("... Error the inode found is a file not a directory '%s' \n", path);
           osErrno = E_GENERAL;
           return -1;
@@ -1291,7 +3720,7 @@ int Dir_Read(char* path, void* buffer, int size)
 {
   /* Begin OUR CODE */
   //First we need to get the child inode referenced by path
-  int child_inode;
+  int child_inode = -1;
   char last_fname[MAX_NAME];
   follow_path(path, &child_inode, last_fname);  
   int counter = 0;              //This counter will keep track of how many dirent we have visited
@@ -1300,25 +3729,29 @@ int Dir_Read(char* path, void* buffer, int size)
 
   if(child_inode >= 0) {        //If the child Inode exists 
 
-    if(size<Dir_Size(path)){      //We check if the size is big enough to allocate the dirent objects
-      dprintf("... The buffer size passed: %d id to small for this dierectory\n", size);
-      osErrno = E_BUFFER_TOO_SMALL;
-      return -1;
-    }
-
     // load the disk sector containing the inode
-      int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
+      int inode_sector = inode_table_sector(child_inode);
       char inode_buffer[SECTOR_SIZE];
       if(Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
       dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
 
       // get the inode
-      int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
+      int inode_start_entry = child_inode-child_inode%INODES_PER_SECTOR;
       int offset = child_inode-inode_start_entry;
       assert(0 <= offset && offset < INODES_PER_SECTOR);
       inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
       dprintf("... inode %d (size=%d, type=%d)\n",child_inode, child->size, child->type);
 
+    if(INODE_TYPE(child) != 1){         //Only directories can be listed
+      dprintf("... Error the inode found is a file not a directory '%s' \n", path);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    if(size < child->size*(int)sizeof(dirent_t)){      //We check if the size is big enough to allocate the dirent objects
+      dprintf("... The buffer size passed: %d id to small for this dierectory\n", size);
+      osErrno = E_BUFFER_TOO_SMALL;
+      return -1;
+    }
      
     //If we reach this point it mean this inode is a directorie so we need to go through all it dirents
     int i;
@@ -1329,7 +3762,7 @@ int Dir_Read(char* path, void* buffer, int size)
         int j;
         for(j=0; ((j<DIRENTS_PER_SECTOR) && (counter < child->size)); j++){   //Going through all the dirents in this directory
               current_dirent = (dirent_t*)(data_buffer+j*sizeof(dirent_t));              
-              if(memcpy(buffer + j *(sizeof(dirent_t)), current_dirent, sizeof(dirent_t))==NULL) return -1;                                                                      
+              if(memcpy(buffer + counter*(sizeof(dirent_t)), current_dirent, sizeof(dirent_t))==NULL) return -1;                                                                      
               counter++;        
         }
         //we could be out of this loop for 2 reazons
@@ -1350,3 +3783,384 @@ int Dir_Read(char* path, void* buffer, int size)
   /* End OUR CODE */
   return -1;
 }
+
+int Dir_Open(char* path)
+{
+  dprintf("Dir_Open('%s'):\n", path);
+  int dd;
+  for(dd=0; dd<MAX_OPEN_DIRS; dd++)
+    if(!open_dirs[dd].used) break;
+  if(dd == MAX_OPEN_DIRS) {
+    dprintf("... max open directories reached\n");
+    osErrno = E_TOO_MANY_OPEN_FILES;
+    return -1;
+  }
+
+  int child_inode;
+  if(follow_path(path, &child_inode, NULL) < 0 || child_inode < 0) {
+    dprintf("... directory '%s' is not found\n", path);
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+  char inode_buffer[SECTOR_SIZE];
+  inode_t* child = load_inode(child_inode, inode_buffer);
+  if(!child) { osErrno = E_GENERAL; return -1; }
+  if(INODE_TYPE(child) != 1) {
+    dprintf("... error: '%s' is not a directory\n", path);
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+
+  open_dirs[dd].inode = child_inode;
+  open_dirs[dd].used = 1;
+  open_dirs[dd].pos = 0;
+  dprintf("... directory '%s' (inode %d, %d entries) open as dd=%d\n", path, child_inode, child->size, dd);
+  return dd;
+}
+
+int Dir_Next(int dd, void* buffer, int max)
+{
+  dprintf("Dir_Next(%d):\n", dd);
+  return dir_next(dd, (dirent_t*)buffer, NULL, max);
+}
+
+int Dir_NextPlus(int dd, Dir_Entry_t* entries, int max)
+{
+  dprintf("Dir_NextPlus(%d):\n", dd);
+  return dir_next(dd, NULL, entries, max);
+}
+
+int Dir_Close(int dd)
+{
+  dprintf("Dir_Close(%d):\n", dd);
+  if(dd < 0 || dd >= MAX_OPEN_DIRS || !open_dirs[dd].used) {
+    dprintf("... dd=%d not an open directory\n", dd);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+  open_dirs[dd].used = 0;
+  return 0;
+}
+
+int Dir_UnlinkTree(char* path)
+{
+  dprintf("Dir_UnlinkTree('%s'):\n", path);
+  int child_inode = -1;
+  int parent_inode = follow_path(path, &child_inode, NULL);
+  if(parent_inode < 0 || child_inode < 0) {
+    dprintf("... '%s' does not exist, failed to delete\n", path);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  if(child_inode == 0) {
+    dprintf("... can't remove the root directory\n");
+    osErrno = E_ROOT_DIR;
+    return -1;
+  }
+
+  // find everything below the child first, so that nothing changes
+  // if some of it is still in use
+  batch_begin();
+  int n = tree_walk(child_inode);
+  if(n < 0) {
+    dprintf("... failed to walk the tree\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  int i, j;
+  for(i=0; i<n; i++) {
+    if(is_file_open(tree[i])) {
+      dprintf("... inode %d is an open file\n", tree[i]);
+      osErrno = E_FILE_IN_USE;
+      return -1;
+    }
+    for(j=0; j<MAX_OPEN_DIRS; j++) {
+      if(open_dirs[j].used && open_dirs[j].inode == tree[i]) {
+        dprintf("... inode %d is an open directory\n", tree[i]);
+        osErrno = E_FILE_IN_USE;
+        return -1;
+      }
+    }
+  }
+
+  // free all the inodes and their sectors in memory
+  for(i=0; i<n; i++) {
+    inode_t* node = batch_inode(tree[i]);
+    int type = INODE_TYPE(node);
+    for(j=0; !IS_INLINE(node) && j<MAX_SECTORS_PER_FILE; j++) {
+      if(node->data[j] > 0 && sector_release(node->data[j]))
+        batch.freed[batch.nfreed++] = node->data[j];
+    }
+    memset(node, 0, sizeof(inode_t));
+    batch.dirty[tree[i]/INODES_PER_SECTOR] = 1;
+    inode_release(tree[i], type);
+  }
+  if(batch_flush() < 0) {
+    dprintf("... failed to write back the freed tree\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... freed %d inodes and %d sectors\n", n, batch.nfreed);
+
+  // only the parent directory of the tree is left to update
+  if(dirent_remove(parent_inode, child_inode) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
+}
+
+int Dir_Usage(char* path, Dir_Usage_t* usage)
+{
+  dprintf("Dir_Usage('%s'):\n", path);
+  int child_inode = -1;
+  if(follow_path(path, &child_inode, NULL) < 0 || child_inode < 0) {
+    dprintf("... '%s' does not exist\n", path);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+
+  batch_begin();
+  int n = tree_walk(child_inode);
+  if(n < 0) {
+    dprintf("... failed to walk the tree\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  memset(usage, 0, sizeof(Dir_Usage_t));
+  int i, j;
+  for(i=0; i<n; i++) {
+    inode_t* node = batch_inode(tree[i]);
+    if(INODE_TYPE(node) == 1) usage->dirs++;
+    else {
+      usage->files++;
+      usage->bytes += node->size;
+    }
+    for(j=0; !IS_INLINE(node) && j<MAX_SECTORS_PER_FILE; j++)
+      if(node->data[j] > 0) usage->sectors++;
+  }
+  dprintf("... %d files, %d directories, %d bytes, %d sectors\n", usage->files, usage->dirs, usage->bytes, usage->sectors);
+  return 0;
+}
+
+int File_Rename(char* oldpath, char* newpath)
+{
+  dprintf("File_Rename('%s', '%s'):\n", oldpath, newpath);
+  return rename_inode(0, oldpath, newpath);
+}
+
+int File_Clone(char* src, char* dst)
+{
+  dprintf("File_Clone('%s', '%s'):\n", src, dst);
+  int src_inode;
+  if(follow_path(src, &src_inode, NULL) < 0 || src_inode < 0) {
+    dprintf("... file '%s' not found\n", src);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  char inode_buffer[SECTOR_SIZE];
+  inode_t* node = load_inode(src_inode, inode_buffer);
+  if(!node) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(INODE_TYPE(node) != 0) {
+    dprintf("... '%s' is not a file\n", src);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  inode_t copy = *node;
+  if(!IS_INLINE(&copy) && refs_alloc() < 0) {
+    osErrno = E_NO_SPACE;
+    return -1;
+  }
+  if(create_file_or_directory(0, dst) < 0) return -1;
+  int dst_inode;
+  int dst_parent = follow_path(dst, &dst_inode, NULL);
+
+  // the counts are written before the inode that uses them, so a crash
+  // in between leaves a sector that is never freed rather than one freed
+  // too early; a sector already shared REFS_MAX times (which only dedup
+  // gets to) is copied instead
+  int i;
+  for(i=0; !IS_INLINE(&copy) && i<MAX_SECTORS_PER_FILE; i++) {
+    if(copy.data[i] <= 0) continue;
+    if(sector_refs[copy.data[i]] < REFS_MAX) {
+      sector_refs[copy.data[i]]++;
+      refs_dirty[copy.data[i]/REFS_PER_SECTOR] = 1;
+      continue;
+    }
+    char buf[SECTOR_SIZE];
+    int newsec = sectors_alloc(data_goal(dst_inode, i > 0 ? copy.data[i-1] : 0), 1);
+    if(newsec < 0 || Disk_Read(copy.data[i], buf) < 0 || Disk_Write(newsec, buf) < 0) {
+      dprintf("... failed to copy sector %d\n", copy.data[i]);
+      osErrno = newsec < 0 ? E_NO_SPACE : E_GENERAL;
+      // give back what was taken so far, and the new file with it
+      if(newsec > 0) sector_release(newsec);
+      while(--i >= 0)
+        if(copy.data[i] > 0) sector_release(copy.data[i]);
+      metadata_write();
+      remove_inode(0, dst_parent, dst_inode);
+      return -1;
+    }
+    copy.data[i] = newsec;
+  }
+  if(metadata_write() < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  node = load_inode(dst_inode, inode_buffer);
+  if(!node) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  *node = copy;
+  if(Disk_Write(inode_table_sector(dst_inode), inode_buffer) < 0) {
+    dprintf("... failed to write the inode of '%s'\n", dst);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... '%s' (inode %d) now shares the %d bytes of '%s' (inode %d)\n", dst, dst_inode, copy.size, src, src_inode);
+  return 0;
+}
+
+// read the whole content of a file (inode 'inode', in 'node') into
+// 'data'; return 0 if successful, or the osErrno code if not
+static int file_content(int inode, inode_t* node, char* data)
+{
+  int i;
+  if(IS_INLINE(node)) {
+    memcpy(data, node->data, node->size);
+  } else if(IS_COMPRESSED(node)) {
+    unsigned short map[MAX_CLUSTERS];
+    char cluster[CLUSTER_SIZE];
+    if(cluster_map_read(inode, node, map) < 0) return E_GENERAL;
+    for(i=0; i*CLUSTER_SIZE<node->size; i++) {
+      int err = cluster_load(inode, node, map, i, cluster);
+      if(err) return err;
+      int n = node->size-i*CLUSTER_SIZE < CLUSTER_SIZE ? node->size-i*CLUSTER_SIZE : CLUSTER_SIZE;
+      memcpy(data+i*CLUSTER_SIZE, cluster, n);
+    }
+  } else {
+    char buf[SECTOR_SIZE];
+    for(i=0; i*SECTOR_SIZE<node->size; i++) {
+      int n = node->size-i*SECTOR_SIZE < SECTOR_SIZE ? node->size-i*SECTOR_SIZE : SECTOR_SIZE;
+      if(node->data[i] == 0) memset(buf, 0, SECTOR_SIZE);
+      else if(Disk_Read(node->data[i], buf) < 0) return E_GENERAL;
+      memcpy(data+i*SECTOR_SIZE, buf, n);
+    }
+  }
+  return 0;
+}
+
+// lay out 'size' bytes of 'data' for a file (inode 'inode') in the
+// empty inode 'node', compressed or not as its type says; runs of
+// zeroes are left as holes; return 0 if successful, or the osErrno
+// code if not (what was taken so far stays with 'node')
+static int file_fill(int inode, inode_t* node, char* data, int size)
+{
+  int i, j;
+  if(IS_COMPRESSED(node)) {
+    unsigned short map[MAX_CLUSTERS];
+    char cluster[CLUSTER_SIZE];
+    memset(map, 0, sizeof(map));
+    for(i=0; i*CLUSTER_SIZE<size; i++) {
+      int n = size-i*CLUSTER_SIZE < CLUSTER_SIZE ? size-i*CLUSTER_SIZE : CLUSTER_SIZE;
+      memset(cluster, 0, CLUSTER_SIZE);
+      memcpy(cluster, data+i*CLUSTER_SIZE, n);
+      for(j=0; j<n && !cluster[j]; j++);
+      if(j == n) continue;
+      int err = cluster_store(inode, node, map, i, cluster);
+      if(err) return err;
+    }
+  } else if(size <= INLINE_SIZE) {
+    node->type |= INODE_INLINE;
+    memcpy(node->data, data, size);
+  } else {
+    char buf[SECTOR_SIZE];
+    for(i=0; i*SECTOR_SIZE<size; i++) {
+      int n = size-i*SECTOR_SIZE < SECTOR_SIZE ? size-i*SECTOR_SIZE : SECTOR_SIZE;
+      memset(buf, 0, SECTOR_SIZE);
+      memcpy(buf, data+i*SECTOR_SIZE, n);
+      for(j=0; j<n && !buf[j]; j++);
+      if(j == n) continue;
+      int sector = sectors_alloc(data_goal(inode, i > 0 ? node->data[i-1] : 0), 1);
+      if(sector < 0) return E_NO_SPACE;
+      node->data[i] = sector;
+      if(Disk_Write(sector, buf) < 0) return E_GENERAL;
+    }
+  }
+  node->size = size;
+  return 0;
+}
+
+int File_Compress(char* file, int on)
+{
+  dprintf("File_Compress('%s', %d):\n", file, on);
+  int inode;
+  if(follow_path(file, &inode, NULL) < 0 || inode < 0) {
+    dprintf("... file '%s' not found\n", file);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  if(is_file_open(inode)) {
+    dprintf("... file '%s' is open\n", file);
+    osErrno = E_FILE_IN_USE;
+    return -1;
+  }
+  char inode_buffer[SECTOR_SIZE];
+  inode_t* node = load_inode(inode, inode_buffer);
+  if(!node) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(INODE_TYPE(node) != 0) {
+    dprintf("... '%s' is not a file\n", file);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  on = on != 0;
+  if(IS_COMPRESSED(node) == on) return 0;
+  if(node->size > (on ? MAX_COMPRESSED_FILE_SIZE : MAX_FILE_SIZE)) {
+    osErrno = E_FILE_TOO_BIG;
+    return -1;
+  }
+
+  // the content is read in whole and laid out again the other way in a
+  // new inode; the file is switched over with a single write of its
+  // inode, and keeps what it had if anything goes wrong before that
+  char* data = malloc(MAX_COMPRESSED_FILE_SIZE);
+  if(!data) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  inode_t old = *node, conv;
+  memset(&conv, 0, sizeof(conv));
+  conv.type = on ? INODE_COMPRESSED : 0;
+  int err = file_content(inode, &old, data), i;
+  cluster_cache_drop(inode);
+  if(!err) err = file_fill(inode, &conv, data, old.size);
+  free(data);
+  if(!err) {
+    *node = conv;
+    if(Disk_Write(inode_table_sector(inode), inode_buffer) < 0) err = E_GENERAL;
+  }
+  // whichever of the two is not used any more is given back
+  inode_t* gone = err ? &conv : &old;
+  for(i=0; !IS_INLINE(gone) && i<MAX_SECTORS_PER_FILE; i++)
+    if(gone->data[i] > 0 && sector_release(gone->data[i])) Disk_Discard(gone->data[i], 1);
+  if(err) cluster_cache_drop(inode);
+  if(metadata_write() < 0 && !err) err = E_GENERAL;
+  if(err) {
+    osErrno = err;
+    return -1;
+  }
+  dprintf("... '%s' (inode %d) is now %s, %d bytes\n", file, inode, on ? "compressed" : "not compressed", conv.size);
+  return 0;
+}
+
+int Dir_Rename(char* oldpath, char* newpath)
+{
+  dprintf("Dir_Rename('%s', '%s'):\n", oldpath, newpath);
+  return rename_inode(1, oldpath, newpath);
+}
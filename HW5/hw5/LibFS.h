@@ -28,8 +28,10 @@ extern int osErrno;
 // a few file system parameters
 
 // the total number of files and directories in the file system has a
-// maximum limit of 1000
-#define MAX_FILES 1000
+// maximum limit of 65536; the inode table only takes up disk space for
+// the inodes actually handed out, 16 sectors for every 64 of them, so
+// the disk fills up well before the limit is reached
+#define MAX_FILES 65536
 
 // each file can have a maximum of 30 sectors; we treat the data
 // blocks of the file/director the same as sectors
@@ -38,10 +40,104 @@ extern int osErrno;
 // the size of a file or directory is limited
 #define MAX_FILE_SIZE (MAX_SECTORS_PER_FILE*SECTOR_SIZE)
 
+// a file kept compressed (see File_Compress) may hold up to twice as
+// much, as long as it still fits in its sectors once compressed: C
+// source gets to about 1.7 times MAX_FILE_SIZE and prose to about 1.5
+// times, while data that doesn't compress stays a bit short of it
+#define MAX_COMPRESSED_FILE_SIZE (2*MAX_FILE_SIZE)
+
 // file system generic calls
 int FS_Boot(char *path);
 int FS_Sync();
 
+// cheap checkpoints of the whole file system; a snapshot shares all
+// sectors with the disk until they are written (see Disk_Snapshot)
+int FS_Snapshot();
+int FS_Rollback(int snap);
+int FS_ReleaseSnapshot(int snap);
+
+// free space, as counted all along in the superblock, so it can be
+// polled as often as needed; extents[i] is the number of free extents
+// (runs of free sectors) of 2^i up to 2^(i+1)-1 sectors, with the last
+// entry also counting all bigger ones
+#define FS_EXTENT_BUCKETS 16
+typedef struct _fs_stat {
+  int total_inodes;   // the inodes in use and free_inodes
+  int free_inodes;    // the free inodes there is room for in the inode
+                      // table, which fills the disk before MAX_FILES
+  int total_sectors;  // all sectors of the disk, metadata included
+  int free_sectors;
+  int extents[FS_EXTENT_BUCKETS];
+  int largest_extent; // the longest run of free sectors
+} FS_Stat_t;
+int FS_Stat(FS_Stat_t *stat);
+
+// online defragmentation: every file or directory whose sectors are
+// not in one run is copied into the first free run that fits it whole
+// and switched over with a single write of its inode; the score is the
+// percentage of steps from one sector of a file or directory to its
+// next that are not to the sector right after (0 if none is broken)
+typedef struct _fs_defrag {
+  int inodes;              // files and directories with any sectors
+  int fragmented;          // of those, the ones in more than one run
+  int moved;               // the ones moved into one run
+  int score_before;
+  int score_after;
+  int free_extents_before; // runs of free sectors
+  int free_extents_after;
+} FS_Defrag_t;
+int FS_Defrag(FS_Defrag_t *report);
+
+// deduplication: identical sectors of file data are shared, as with
+// File_Clone, and copied again only when written to; FS_Dedup goes over
+// all the files on disk once, and with FS_SetDedup(1) (off by default)
+// every whole sector a file writes afterwards is first looked up among
+// the sectors seen so far and shared instead of written if it is found;
+// FS_SetDedup returns the previous setting
+typedef struct _fs_dedup {
+  int files;               // files with any sectors
+  int sectors;             // their sectors
+  int shared;              // of those, the ones switched to an identical one
+  int freed;               // sectors freed by that
+} FS_Dedup_t;
+int FS_Dedup(FS_Dedup_t *report);
+int FS_SetDedup(int on);
+
+// offline image building: a whole tree of files and directories
+// described in memory is laid out in a brand-new image, which is
+// written out in one go (and booted); see mkfs
+typedef struct _fs_node {
+  char* name;                 // file or directory name (ignored for the root)
+  int type;                   // 0 means regular file; 1 means directory
+  int size;                   // size of the file content
+  char* data;                 // the file content
+  int nchildren;              // number of directory entries
+  struct _fs_node* children;  // the directory entries
+} FS_Node_t;
+int FS_Build(char *path, FS_Node_t *root);
+
+// consistency check of a disk image (see fsck): the inodes, the
+// directory tree, both bitmaps and the superblock counts are checked
+// against each other, and a corrupt inode table or directory sector
+// is given up for lost; with 'repair' set, what is found is fixed and
+// the image saved; either way the image is left booted; return the
+// number of problems found (broken down in 'report'), or -1 if the
+// image can't be checked at all
+typedef struct _fs_check {
+  int bad_inodes;       // inodes with a bad type, size or sector index
+  int orphaned_inodes;  // inodes in use that no directory points to
+  int dangling_dirents; // dirents with a bad name, or pointing to an
+                        // inode not in use, broken or linked already
+  int double_sectors;   // sectors used by more than one inode
+  int leaked_sectors;   // sectors marked in use that nothing uses
+  int lost_sectors;     // sectors in use but marked free
+  int bad_counts;       // superblock counts that were off
+  int bad_sectors;      // inode table or directory sectors that failed
+                        // their checksum (their inodes or dirents are
+                        // dropped)
+} FS_Check_t;
+int FS_Check(char *path, int repair, FS_Check_t *report);
+
 // file ops
 int File_Create(char *file);
 int File_Open(char *file);
@@ -51,10 +147,74 @@ int File_Seek(int fd, int offset);
 int File_Close(int fd);
 int File_Unlink(char *file);
 
+// File_Truncate sets the size of an open file: a shorter file loses
+// the sectors past its new end, and a longer one reads back zeroes up
+// to it; File_Preallocate gives an open file sectors for its first
+// 'size' bytes up front, as one run where possible, without changing
+// its size, so later writes up to there need no allocation
+int File_Truncate(int fd, int size);
+int File_Preallocate(int fd, int size);
+
+// files may have holes: File_Seek may go past the end of a file, and
+// a write there leaves the sectors in between unallocated; they read
+// back as zeroes; File_SeekData and File_SeekHole move the position to
+// the first offset at or after 'offset' in data or in a hole (holes
+// are whole sectors, and the end of the file counts as both) and
+// return it, so that copying a file can skip its holes
+int File_SeekData(int fd, int offset);
+int File_SeekHole(int fd, int offset);
+
+// moving a file or directory only relinks its directory entry: the
+// old and new parent directories change, the inode and data don't
+int File_Rename(char *oldpath, char *newpath);
+int Dir_Rename(char *oldpath, char *newpath);
+
+// File_Clone makes 'dst' a new file with the content of the file 'src'
+// without copying it: the two share their sectors until one of them
+// writes to a sector, which then gets a copy of its own
+int File_Clone(char *src, char *dst);
+
+// File_Compress(file, 1) keeps a file compressed from then on, in
+// clusters that are decompressed as they are read (the most recently
+// used ones are cached); such a file may grow to
+// MAX_COMPRESSED_FILE_SIZE as long as it fits in its sectors (a write
+// that doesn't fails with E_FILE_TOO_BIG); File_Compress(file, 0)
+// stores it plainly again; either way the file must not be open
+int File_Compress(char *file, int on);
+
 // directory ops
 int Dir_Create(char *path);
 int Dir_Unlink(char *path);
 int Dir_Size(char *path);
 int Dir_Read(char *path, void *buffer, int size);
 
+// streaming directory listing: an open directory is read back a batch
+// at a time from a cursor, so huge directories need no huge buffer;
+// Dir_Next() returns entries in the same format as Dir_Read(), while
+// Dir_NextPlus() also returns what each entry's inode says; removing
+// an entry moves the directory's last entry into its place, which an
+// open cursor that is already past that place won't see
+typedef struct _dir_entry {
+  char fname[16]; // name of the file or directory
+  int inode;      // its inode
+  int type;       // 0 means regular file; 1 means directory
+  int size;       // bytes in the file or entries in the directory
+} Dir_Entry_t;
+int Dir_Open(char *path);
+int Dir_Next(int dd, void *buffer, int max);
+int Dir_NextPlus(int dd, Dir_Entry_t *entries, int max);
+int Dir_Close(int dd);
+
+// whole-tree operations: each walks the tree once; Dir_UnlinkTree()
+// removes a file or a directory with everything below it, and
+// Dir_Usage() adds up what a tree holds
+typedef struct _dir_usage {
+  int files;      // regular files
+  int dirs;       // directories (including the top one)
+  int bytes;      // bytes in all the files
+  int sectors;    // data sectors used by files and directories
+} Dir_Usage_t;
+int Dir_UnlinkTree(char *path);
+int Dir_Usage(char *path, Dir_Usage_t *usage);
+
 #endif /* __LibFS_h__ */
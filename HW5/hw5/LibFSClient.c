@@ -0,0 +1,315 @@
+/*
+ * LibFSClient.c
+ *
+ * A drop-in replacement for LibFS that forwards every call to a running
+ * file system daemon (fsd) instead of loading the disk itself. FS_Boot
+ * connects to the daemon serving the given disk image; programs written
+ * against LibFS.h work unchanged when linked with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "LibFS.h"
+#include "FSProto.h"
+
+// global errno value here
+int osErrno;
+
+// the connection to the daemon
+static int sock = -1;
+
+static int read_full(int fd, void* buf, int len)
+{
+  char* p = buf;
+  while(len > 0) {
+    int n = read(fd, p, len);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return -1;
+    p += n; len -= n;
+  }
+  return 0;
+}
+
+static int write_full(int fd, void* buf, int len)
+{
+  char* p = buf;
+  while(len > 0) {
+    int n = write(fd, p, len);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return -1;
+    p += n; len -= n;
+  }
+  return 0;
+}
+
+// send one request and wait for its reply; up to 'outcap' bytes of the
+// reply data are stored in 'out'; return what the daemon's LibFS call
+// returned (and set osErrno accordingly)
+static int call(int op, int arg0, int arg1, char* path0, char* path1,
+                void* data, int datalen, void* out, int outcap)
+{
+  if(sock < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  fsp_request_t req;
+  req.op = op;
+  req.arg0 = arg0;
+  req.arg1 = arg1;
+  req.len0 = path0 ? strlen(path0) : 0;
+  req.len1 = path1 ? strlen(path1) : 0;
+  req.datalen = datalen;
+  if(datalen < 0 || datalen > FSP_MAX_DATA) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  fsp_reply_t rep;
+  if(write_full(sock, &req, sizeof(req)) < 0 ||
+     write_full(sock, path0, req.len0) < 0 ||
+     write_full(sock, path1, req.len1) < 0 ||
+     write_full(sock, data, datalen) < 0 ||
+     read_full(sock, &rep, sizeof(rep)) < 0 ||
+     rep.datalen < 0 || rep.datalen > outcap ||
+     read_full(sock, out, rep.datalen) < 0) {
+    // the connection is no good any more
+    close(sock);
+    sock = -1;
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(rep.ret < 0) osErrno = rep.err;
+  return rep.ret;
+}
+
+int FS_Boot(char* backstore_fname)
+{
+  if(sock >= 0) close(sock);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(snprintf(addr.sun_path, sizeof(addr.sun_path), "%s%s", backstore_fname,
+              FSP_SOCKET_SUFFIX) >= sizeof(addr.sun_path)) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    if(sock >= 0) close(sock);
+    sock = -1;
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return call(FSP_HELLO, 0, 0, NULL, NULL, NULL, 0, NULL, 0);
+}
+
+int FS_Sync()
+{
+  return call(FSP_SYNC, 0, 0, NULL, NULL, NULL, 0, NULL, 0);
+}
+
+int FS_Snapshot()
+{
+  return call(FSP_SNAPSHOT, 0, 0, NULL, NULL, NULL, 0, NULL, 0);
+}
+
+int FS_Rollback(int snap)
+{
+  return call(FSP_ROLLBACK, snap, 0, NULL, NULL, NULL, 0, NULL, 0);
+}
+
+int FS_ReleaseSnapshot(int snap)
+{
+  return call(FSP_RELEASE, snap, 0, NULL, NULL, NULL, 0, NULL, 0);
+}
+
+int FS_Stat(FS_Stat_t* stat)
+{
+  return call(FSP_STAT, 0, 0, NULL, NULL, NULL, 0, stat, sizeof(FS_Stat_t));
+}
+
+int FS_Defrag(FS_Defrag_t* report)
+{
+  return call(FSP_DEFRAG, 0, 0, NULL, NULL, NULL, 0, report, sizeof(FS_Defrag_t));
+}
+
+int FS_Dedup(FS_Dedup_t* report)
+{
+  return call(FSP_DEDUP, 0, 0, NULL, NULL, NULL, 0, report, sizeof(FS_Dedup_t));
+}
+
+int FS_SetDedup(int on)
+{
+  return call(FSP_SET_DEDUP, on, 0, NULL, NULL, NULL, 0, NULL, 0);
+}
+
+int FS_Build(char* backstore_fname, FS_Node_t* root)
+{
+  // images are built offline, never through the daemon
+  osErrno = E_GENERAL;
+  return -1;
+}
+
+int FS_Check(char* backstore_fname, int repair, FS_Check_t* report)
+{
+  // images are checked offline too
+  osErrno = E_GENERAL;
+  return -1;
+}
+
+int File_Create(char* file)
+{
+  return call(FSP_FILE_CREATE, 0, 0, file, NULL, NULL, 0, NULL, 0);
+}
+
+int File_Open(char* file)
+{
+  return call(FSP_FILE_OPEN, 0, 0, file, NULL, NULL, 0, NULL, 0);
+}
+
+int File_Read(int fd, void* buffer, int size)
+{
+  // large reads are split to fit the protocol's payload limit
+  int done = 0;
+  while(size > 0) {
+    int chunk = size < FSP_MAX_DATA ? size : FSP_MAX_DATA;
+    int n = call(FSP_FILE_READ, fd, chunk, NULL, NULL, NULL, 0, (char*)buffer+done, chunk);
+    if(n < 0) return done > 0 ? done : -1;
+    done += n; size -= n;
+    if(n < chunk) break;
+  }
+  return done;
+}
+
+int File_Write(int fd, void* buffer, int size)
+{
+  int done = 0;
+  while(size > 0) {
+    int chunk = size < FSP_MAX_DATA ? size : FSP_MAX_DATA;
+    int n = call(FSP_FILE_WRITE, fd, 0, NULL, NULL, (char*)buffer+done, chunk, NULL, 0);
+    if(n < 0) return -1;
+    done += n; size -= n;
+    if(n < chunk) break;
+  }
+  return done;
+}
+
+int File_Seek(int fd, int offset)
+{
+  return call(FSP_FILE_SEEK, fd, offset, NULL, NULL, NULL, 0, NULL, 0);
+}
+
+int File_Truncate(int fd, int size)
+{
+  return call(FSP_FILE_TRUNCATE, fd, size, NULL, NULL, NULL, 0, NULL, 0);
+}
+
+int File_Preallocate(int fd, int size)
+{
+  return call(FSP_FILE_PREALLOCATE, fd, size, NULL, NULL, NULL, 0, NULL, 0);
+}
+
+int File_SeekData(int fd, int offset)
+{
+  return call(FSP_FILE_SEEK_DATA, fd, offset, NULL, NULL, NULL, 0, NULL, 0);
+}
+
+int File_SeekHole(int fd, int offset)
+{
+  return call(FSP_FILE_SEEK_HOLE, fd, offset, NULL, NULL, NULL, 0, NULL, 0);
+}
+
+int File_Close(int fd)
+{
+  return call(FSP_FILE_CLOSE, fd, 0, NULL, NULL, NULL, 0, NULL, 0);
+}
+
+int File_Unlink(char* file)
+{
+  return call(FSP_FILE_UNLINK, 0, 0, file, NULL, NULL, 0, NULL, 0);
+}
+
+int File_Rename(char* oldpath, char* newpath)
+{
+  return call(FSP_FILE_RENAME, 0, 0, oldpath, newpath, NULL, 0, NULL, 0);
+}
+
+int File_Clone(char* src, char* dst)
+{
+  return call(FSP_FILE_CLONE, 0, 0, src, dst, NULL, 0, NULL, 0);
+}
+
+int File_Compress(char* file, int on)
+{
+  return call(FSP_FILE_COMPRESS, on, 0, file, NULL, NULL, 0, NULL, 0);
+}
+
+int Dir_Create(char* path)
+{
+  return call(FSP_DIR_CREATE, 0, 0, path, NULL, NULL, 0, NULL, 0);
+}
+
+int Dir_Unlink(char* path)
+{
+  return call(FSP_DIR_UNLINK, 0, 0, path, NULL, NULL, 0, NULL, 0);
+}
+
+int Dir_Rename(char* oldpath, char* newpath)
+{
+  return call(FSP_DIR_RENAME, 0, 0, oldpath, newpath, NULL, 0, NULL, 0);
+}
+
+int Dir_Size(char* path)
+{
+  return call(FSP_DIR_SIZE, 0, 0, path, NULL, NULL, 0, NULL, 0);
+}
+
+int Dir_Read(char* path, void* buffer, int size)
+{
+  return call(FSP_DIR_READ, 0, size, path, NULL, NULL, 0, buffer, size);
+}
+
+int Dir_Open(char* path)
+{
+  return call(FSP_DIR_OPEN, 0, 0, path, NULL, NULL, 0, NULL, 0);
+}
+
+// a batch is allowed to come back short, so it is simply capped to
+// what fits in one reply
+
+int Dir_Next(int dd, void* buffer, int max)
+{
+  int cap = FSP_MAX_DATA/FSP_DIRENT_SIZE;
+  if(max > cap) max = cap;
+  return call(FSP_DIR_NEXT, dd, max, NULL, NULL, NULL, 0, buffer, max < 0 ? 0 : max*FSP_DIRENT_SIZE);
+}
+
+int Dir_NextPlus(int dd, Dir_Entry_t* entries, int max)
+{
+  int cap = FSP_MAX_DATA/sizeof(Dir_Entry_t);
+  if(max > cap) max = cap;
+  return call(FSP_DIR_NEXT_PLUS, dd, max, NULL, NULL, NULL, 0, entries, max < 0 ? 0 : max*sizeof(Dir_Entry_t));
+}
+
+int Dir_Close(int dd)
+{
+  return call(FSP_DIR_CLOSE, dd, 0, NULL, NULL, NULL, 0, NULL, 0);
+}
+
+int Dir_UnlinkTree(char* path)
+{
+  return call(FSP_DIR_UNLINK_TREE, 0, 0, path, NULL, NULL, 0, NULL, 0);
+}
+
+int Dir_Usage(char* path, Dir_Usage_t* usage)
+{
+  return call(FSP_DIR_USAGE, 0, 0, path, NULL, NULL, 0, usage, sizeof(Dir_Usage_t));
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// write as much of a unix text file into a compressed file as fits,
+// and check that it reads back the same: in pieces, after a write in
+// the middle, after the disk is booted again, and on the way to a
+// plain file and back; the exit status is 0 if all went well
+
+#define CHUNK 1000
+
+static char text[MAX_COMPRESSED_FILE_SIZE], got[MAX_COMPRESSED_FILE_SIZE];
+static int errors;
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_file> <unix_text_file>\n", prog);
+  exit(1);
+}
+
+// read the whole file back a piece at a time and compare it with the
+// first 'size' bytes of 'text'
+static void check(char* fn, int size, char* when)
+{
+  int fd = File_Open(fn), n = 0, k;
+  if(fd < 0) {
+    printf("ERROR: can't open file '%s' %s\n", fn, when);
+    errors++;
+    return;
+  }
+  while(n < MAX_COMPRESSED_FILE_SIZE && (k = File_Read(fd, got+n, CHUNK-7)) > 0) n += k;
+  File_Close(fd);
+  if(n != size || memcmp(got, text, size)) {
+    printf("ERROR: file '%s' reads back wrong %s (%d bytes, not %d)\n", fn, when, n, size);
+    errors++;
+  } else printf("file '%s' reads back right %s\n", fn, when);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 3) usage(argv[0]);
+
+  if(FS_Boot(argv[1]) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", argv[1]);
+    return -1;
+  } else printf("file system booted from file '%s'\n", argv[1]);
+
+  FILE* f = fopen(argv[2], "r");
+  if(!f) {
+    printf("ERROR: can't open unix file '%s'\n", argv[2]);
+    return -1;
+  }
+  int len = fread(text, 1, sizeof(text), f);
+  fclose(f);
+
+  char* fn = "/compressed";
+  if(File_Create(fn) < 0 || File_Compress(fn, 1) < 0) {
+    printf("ERROR: can't create compressed file '%s'\n", fn);
+    return -1;
+  }
+
+  // append a piece at a time until the file is full
+  int fd = File_Open(fn), size = 0;
+  while(size < len) {
+    int n = len-size < CHUNK ? len-size : CHUNK;
+    if(File_Write(fd, text+size, n) != n) break;
+    size += n;
+  }
+  if(size < len) {
+    if(osErrno != E_FILE_TOO_BIG) {
+      printf("ERROR: can't write file '%s' (error %d)\n", fn, osErrno);
+      errors++;
+    }
+    File_Truncate(fd, size);
+  }
+  File_Close(fd);
+  printf("%d of %d bytes of '%s' fit in compressed file '%s'\n", size, len, argv[2], fn);
+  if(size < len && size <= MAX_FILE_SIZE) {
+    printf("ERROR: no more than an uncompressed file holds\n");
+    errors++;
+  }
+  check(fn, size, "");
+
+  // a write in the middle changes the length of its cluster, so the
+  // ones after it have to move; in a full file it may not fit, and then
+  // nothing may change (the bytes written stay within one cluster, as
+  // clusters are a multiple of 1024 bytes)
+  char saved[16];
+  int mid = (size/2 & ~1023)+100, n = size-mid < 16 ? size-mid : 16;
+  if(n < 0) mid = n = 0;
+  memcpy(saved, text+mid, n);
+  memcpy(text+mid, "0123456789abcdef", n);
+  fd = File_Open(fn);
+  File_Seek(fd, mid);
+  if(File_Write(fd, text+mid, n) < 0) {
+    if(osErrno != E_FILE_TOO_BIG) {
+      printf("ERROR: can't write the middle of file '%s'\n", fn);
+      errors++;
+    } else printf("a write in the middle doesn't fit in full file '%s'\n", fn);
+    memcpy(text+mid, saved, n);
+  }
+  File_Close(fd);
+  check(fn, size, "after a write in the middle");
+
+  if(FS_Sync() < 0 || FS_Boot(argv[1]) < 0) {
+    printf("ERROR: can't sync and boot file system from file '%s' again\n", argv[1]);
+    return -1;
+  }
+  check(fn, size, "after booting again");
+
+  // whatever fits in a plain file fits in a compressed one too
+  if(size > MAX_FILE_SIZE) {
+    fd = File_Open(fn);
+    File_Truncate(fd, MAX_FILE_SIZE);
+    File_Close(fd);
+    size = MAX_FILE_SIZE;
+  }
+  if(File_Compress(fn, 0) < 0) {
+    printf("ERROR: can't uncompress file '%s'\n", fn);
+    errors++;
+  }
+  check(fn, size, "uncompressed");
+  if(File_Compress(fn, 1) < 0) {
+    printf("ERROR: can't compress file '%s' again\n", fn);
+    errors++;
+  }
+  check(fn, size, "compressed again");
+
+  if(File_Unlink(fn) < 0 || FS_Sync() < 0) {
+    printf("ERROR: can't remove file '%s'\n", fn);
+    errors++;
+  }
+  return errors ? 1 : 0;
+}
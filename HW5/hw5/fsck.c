@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+// check a disk image for inconsistencies, and with -r repair them; the
+// exit status is 0 if the image is clean, 1 if it was repaired, 2 if
+// problems were found but left alone
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-r] disk\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile;
+  int repair = 0, argi = 1;
+  if(argi < argc && !strcmp(argv[argi], "-r")) {
+    repair = 1;
+    argi++;
+  }
+  if(argc-argi != 1) usage(argv[0]);
+  diskfile = argv[argi];
+
+  FS_Check_t r;
+  int problems = FS_Check(diskfile, repair, &r);
+  if(problems < 0) {
+    printf("ERROR: can't check file system in file '%s'\n", diskfile);
+    return -1;
+  }
+  printf("%-20s\t%d\n", "bad inodes", r.bad_inodes);
+  printf("%-20s\t%d\n", "orphaned inodes", r.orphaned_inodes);
+  printf("%-20s\t%d\n", "dangling dirents", r.dangling_dirents);
+  printf("%-20s\t%d\n", "shared sectors", r.double_sectors);
+  printf("%-20s\t%d\n", "leaked sectors", r.leaked_sectors);
+  printf("%-20s\t%d\n", "unmarked sectors", r.lost_sectors);
+  printf("%-20s\t%d\n", "bad counts", r.bad_counts);
+  printf("%-20s\t%d\n", "corrupt sectors", r.bad_sectors);
+  if(problems == 0) {
+    printf("'%s' is clean\n", diskfile);
+    return 0;
+  }
+  if(repair) {
+    printf("'%s': %d problems repaired\n", diskfile, problems);
+    return 1;
+  }
+  printf("'%s': %d problems found, run with -r to repair them\n", diskfile, problems);
+  return 2;
+}
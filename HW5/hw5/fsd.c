@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "LibFS.h"
+#include "FSProto.h"
+
+// a long-running file system server: the disk is booted once and the
+// LibFS calls of any number of clients (see LibFSClient.c) are served
+// over a Unix domain socket until the daemon is told to stop
+
+#define MAX_CLIENTS 64
+#define MAX_CLIENT_FDS 256
+#define MAX_CLIENT_DDS 64
+#define MAX_PATH_LEN 256
+
+typedef struct client {
+  int sock;                  // -1 if the slot is free
+  int nfds;                  // LibFS files opened by this client
+  int fds[MAX_CLIENT_FDS];
+  int ndds;                  // LibFS directories opened by this client
+  int dds[MAX_CLIENT_DDS];
+} client_t;
+
+static client_t clients[MAX_CLIENTS];
+
+static volatile sig_atomic_t stopping = 0;
+
+static int dirty = 0;          // the disk changed since the last sync
+static int sync_pending = 0;   // a client asked for a sync
+static int sync_delay = 5;     // seconds a requested sync may be held back
+static time_t last_sync = 0;
+static int sync_failing = 0;   // the last sync failed: wait at least SYNC_RETRY before the next
+static int sync_failed = 0;    // a sync failed and no later one made good: the next FSP_SYNC says so
+
+#define SYNC_RETRY 5
+
+static char* diskfile = "default-disk";
+
+static char data_buf[FSP_MAX_DATA];
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-c] [-D] [-d seconds] [disk [socket]]\n", prog);
+  exit(1);
+}
+
+static void on_signal(int sig)
+{
+  stopping = 1;
+}
+
+static int read_full(int fd, void* buf, int len)
+{
+  char* p = buf;
+  while(len > 0) {
+    int n = read(fd, p, len);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return -1;
+    p += n; len -= n;
+  }
+  return 0;
+}
+
+static int write_full(int fd, void* buf, int len)
+{
+  char* p = buf;
+  while(len > 0) {
+    int n = write(fd, p, len);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return -1;
+    p += n; len -= n;
+  }
+  return 0;
+}
+
+// read a path of 'len' bytes into 'path' (which has room for
+// MAX_PATH_LEN); one too long for it is read and thrown away, leaving
+// 'path' empty; return 1 if the path was too long, -1 on error
+static int read_path(int fd, char* path, int len)
+{
+  if(len < MAX_PATH_LEN) {
+    if(read_full(fd, path, len) < 0) return -1;
+    path[len] = '\0';
+    return 0;
+  }
+  path[0] = '\0';
+  while(len > 0) {
+    int n = len < FSP_MAX_DATA ? len : FSP_MAX_DATA;
+    if(read_full(fd, data_buf, n) < 0) return -1;
+    len -= n;
+  }
+  return 1;
+}
+
+// seconds to wait after the last sync before the next one
+static int sync_wait()
+{
+  return sync_failing && sync_delay < SYNC_RETRY ? SYNC_RETRY : sync_delay;
+}
+
+// write the disk back if anything changed; 'force' ignores the delay;
+// return -1 if the sync failed, and keep the changes to try again later
+static int flush(int force)
+{
+  if(!dirty || !sync_pending) return 0;
+  if(!force && time(NULL)-last_sync < sync_wait()) return 0;
+  last_sync = time(NULL);
+  if(FS_Sync() < 0) {
+    sync_failing = 1;
+    sync_failed = 1;
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    fflush(stdout);
+    return -1;
+  }
+  dirty = 0;
+  sync_pending = 0;
+  sync_failing = 0;
+  sync_failed = 0;
+  return 0;
+}
+
+// remove 'x' from a client's list of open files or directories
+static void forget(int* list, int* n, int x)
+{
+  int i;
+  for(i=0; i<*n; i++) {
+    if(list[i] == x) {
+      list[i] = list[--(*n)];
+      return;
+    }
+  }
+}
+
+// return 1 if 'x' is in a client's list of open files or directories
+static int owns(int* list, int n, int x)
+{
+  int i;
+  for(i=0; i<n; i++)
+    if(list[i] == x) return 1;
+  return 0;
+}
+
+// return 1 unless the request names a file or directory descriptor
+// that the client didn't open itself (descriptors are shared by all
+// clients inside LibFS, so nothing else keeps them apart)
+static int may_use(client_t* c, fsp_request_t* req)
+{
+  switch(req->op) {
+  case FSP_FILE_READ:
+  case FSP_FILE_WRITE:
+  case FSP_FILE_SEEK:
+  case FSP_FILE_TRUNCATE:
+  case FSP_FILE_PREALLOCATE:
+  case FSP_FILE_SEEK_DATA:
+  case FSP_FILE_SEEK_HOLE:
+  case FSP_FILE_CLOSE:
+    return owns(c->fds, c->nfds, req->arg0);
+  case FSP_DIR_NEXT:
+  case FSP_DIR_NEXT_PLUS:
+  case FSP_DIR_CLOSE:
+    return owns(c->dds, c->ndds, req->arg0);
+  default:
+    return 1;
+  }
+}
+
+// close whatever the client left open and free its slot
+static void drop_client(client_t* c)
+{
+  int i;
+  for(i=0; i<c->nfds; i++) File_Close(c->fds[i]);
+  for(i=0; i<c->ndds; i++) Dir_Close(c->dds[i]);
+  c->nfds = c->ndds = 0;
+  close(c->sock);
+  c->sock = -1;
+}
+
+// read one request from the client, run it and send back the reply;
+// return -1 if the connection should be dropped
+static int serve_request(client_t* c)
+{
+  fsp_request_t req;
+  char path0[MAX_PATH_LEN], path1[MAX_PATH_LEN];
+  if(read_full(c->sock, &req, sizeof(req)) < 0) return -1;
+  if(req.len0 < 0 || req.len1 < 0 || req.datalen < 0 || req.datalen > FSP_MAX_DATA)
+    return -1;
+  int long0 = read_path(c->sock, path0, req.len0), long1 = long0 < 0 ? -1 : read_path(c->sock, path1, req.len1);
+  if(long0 < 0 || long1 < 0 || read_full(c->sock, data_buf, req.datalen) < 0)
+    return -1;
+
+  fsp_reply_t rep;
+  rep.datalen = 0;
+  osErrno = 0;
+  // a byte count (or, for the Dir_Next calls, an entry count)
+  int size = req.arg1 < 0 ? 0 : (req.arg1 > FSP_MAX_DATA ? FSP_MAX_DATA : req.arg1);
+
+  if(long0 || long1) {
+    // no path that long can name anything
+    rep.ret = -1;
+    osErrno = E_GENERAL;
+  } else if(!may_use(c, &req)) {
+    rep.ret = -1;
+    osErrno = E_BAD_FD;
+  } else switch(req.op) {
+  case FSP_HELLO:       rep.ret = 0; break;
+  case FSP_SYNC:
+    sync_pending = 1;
+    flush(sync_delay == 0);
+    // a sync that failed, now or while held back, is this client's to hear about
+    rep.ret = sync_failed ? -1 : 0;
+    if(sync_failed) osErrno = E_GENERAL;
+    sync_failed = 0;
+    break;
+  case FSP_SNAPSHOT:    rep.ret = FS_Snapshot(); break;
+  case FSP_ROLLBACK:    rep.ret = FS_Rollback(req.arg0); dirty |= rep.ret == 0; break;
+  case FSP_RELEASE:     rep.ret = FS_ReleaseSnapshot(req.arg0); break;
+  case FSP_FILE_CREATE: rep.ret = File_Create(path0); dirty |= rep.ret == 0; break;
+  case FSP_FILE_OPEN:
+    rep.ret = File_Open(path0);
+    if(rep.ret >= 0) {
+      if(c->nfds < MAX_CLIENT_FDS) c->fds[c->nfds++] = rep.ret;
+      else {
+        File_Close(rep.ret);
+        rep.ret = -1;
+        osErrno = E_TOO_MANY_OPEN_FILES;
+      }
+    }
+    break;
+  case FSP_FILE_READ:
+    rep.ret = File_Read(req.arg0, data_buf, size);
+    if(rep.ret > 0) rep.datalen = rep.ret;
+    break;
+  case FSP_FILE_WRITE:  rep.ret = File_Write(req.arg0, data_buf, req.datalen); dirty |= rep.ret > 0; break;
+  case FSP_FILE_SEEK:   rep.ret = File_Seek(req.arg0, req.arg1); break;
+  case FSP_FILE_TRUNCATE: rep.ret = File_Truncate(req.arg0, req.arg1); dirty |= rep.ret == 0; break;
+  case FSP_FILE_PREALLOCATE: rep.ret = File_Preallocate(req.arg0, req.arg1); dirty |= rep.ret == 0; break;
+  case FSP_FILE_SEEK_DATA: rep.ret = File_SeekData(req.arg0, req.arg1); break;
+  case FSP_FILE_SEEK_HOLE: rep.ret = File_SeekHole(req.arg0, req.arg1); break;
+  case FSP_FILE_CLOSE:
+    rep.ret = File_Close(req.arg0);
+    if(rep.ret == 0) forget(c->fds, &c->nfds, req.arg0);
+    break;
+  case FSP_FILE_UNLINK: rep.ret = File_Unlink(path0); dirty |= rep.ret == 0; break;
+  case FSP_DIR_CREATE:  rep.ret = Dir_Create(path0); dirty |= rep.ret == 0; break;
+  case FSP_DIR_UNLINK:  rep.ret = Dir_Unlink(path0); dirty |= rep.ret == 0; break;
+  case FSP_DIR_SIZE:    rep.ret = Dir_Size(path0); break;
+  case FSP_DIR_READ:
+    rep.ret = Dir_Read(path0, data_buf, size);
+    if(rep.ret > 0) rep.datalen = Dir_Size(path0);
+    if(rep.datalen < 0 || rep.datalen > size) rep.datalen = 0;
+    break;
+  case FSP_DIR_OPEN:
+    rep.ret = Dir_Open(path0);
+    if(rep.ret >= 0) {
+      if(c->ndds < MAX_CLIENT_DDS) c->dds[c->ndds++] = rep.ret;
+      else {
+        Dir_Close(rep.ret);
+        rep.ret = -1;
+        osErrno = E_TOO_MANY_OPEN_FILES;
+      }
+    }
+    break;
+  case FSP_DIR_NEXT:
+    rep.ret = Dir_Next(req.arg0, data_buf, size < FSP_MAX_DATA/FSP_DIRENT_SIZE ? size : FSP_MAX_DATA/FSP_DIRENT_SIZE);
+    if(rep.ret > 0) rep.datalen = rep.ret*FSP_DIRENT_SIZE;
+    break;
+  case FSP_DIR_NEXT_PLUS:
+    rep.ret = Dir_NextPlus(req.arg0, (Dir_Entry_t*)data_buf, size < FSP_MAX_DATA/sizeof(Dir_Entry_t) ? size : FSP_MAX_DATA/sizeof(Dir_Entry_t));
+    if(rep.ret > 0) rep.datalen = rep.ret*sizeof(Dir_Entry_t);
+    break;
+  case FSP_DIR_CLOSE:
+    rep.ret = Dir_Close(req.arg0);
+    if(rep.ret == 0) forget(c->dds, &c->ndds, req.arg0);
+    break;
+  case FSP_FILE_RENAME: rep.ret = File_Rename(path0, path1); dirty |= rep.ret == 0; break;
+  case FSP_DIR_RENAME:  rep.ret = Dir_Rename(path0, path1); dirty |= rep.ret == 0; break;
+  case FSP_FILE_CLONE:  rep.ret = File_Clone(path0, path1); dirty |= rep.ret == 0; break;
+  case FSP_FILE_COMPRESS: rep.ret = File_Compress(path0, req.arg0); dirty |= rep.ret == 0; break;
+  case FSP_DIR_UNLINK_TREE: rep.ret = Dir_UnlinkTree(path0); dirty |= rep.ret == 0; break;
+  case FSP_DIR_USAGE:
+    rep.ret = Dir_Usage(path0, (Dir_Usage_t*)data_buf);
+    if(rep.ret == 0) rep.datalen = sizeof(Dir_Usage_t);
+    break;
+  case FSP_STAT:
+    rep.ret = FS_Stat((FS_Stat_t*)data_buf);
+    if(rep.ret == 0) rep.datalen = sizeof(FS_Stat_t);
+    break;
+  case FSP_DEFRAG:
+    rep.ret = FS_Defrag((FS_Defrag_t*)data_buf);
+    if(rep.ret == 0) rep.datalen = sizeof(FS_Defrag_t);
+    dirty |= rep.ret == 0;
+    break;
+  case FSP_DEDUP:
+    rep.ret = FS_Dedup((FS_Dedup_t*)data_buf);
+    if(rep.ret == 0) rep.datalen = sizeof(FS_Dedup_t);
+    dirty |= rep.ret == 0;
+    break;
+  case FSP_SET_DEDUP:   rep.ret = FS_SetDedup(req.arg0); break;
+  default:
+    rep.ret = -1;
+    osErrno = E_GENERAL;
+    break;
+  }
+  rep.err = osErrno;
+
+  if(write_full(c->sock, &rep, sizeof(rep)) < 0 ||
+     write_full(c->sock, data_buf, rep.datalen) < 0)
+    return -1;
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  char *sockname = NULL;
+  char sockbuf[1024];
+  int argi = 1, check = 0, dedup = 0;
+  for(;;) {
+    if(argi < argc && !strcmp(argv[argi], "-c")) {
+      check = 1;
+      argi++;
+    } else if(argi < argc && !strcmp(argv[argi], "-D")) {
+      dedup = 1;
+      argi++;
+    } else if(argi+1 < argc && !strcmp(argv[argi], "-d")) {
+      sync_delay = atoi(argv[argi+1]);
+      argi += 2;
+    } else break;
+  }
+  if(argc-argi > 2) usage(argv[0]);
+  if(argi < argc) diskfile = argv[argi++];
+  if(argi < argc) sockname = argv[argi++];
+  if(sockname == NULL) {
+    snprintf(sockbuf, sizeof(sockbuf), "%s%s", diskfile, FSP_SOCKET_SUFFIX);
+    sockname = sockbuf;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(sockname) >= sizeof(addr.sun_path)) {
+    printf("ERROR: socket name '%s' is too long\n", sockname);
+    return -1;
+  }
+  strcpy(addr.sun_path, sockname);
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+  // with -c, the image is checked and repaired before it is served
+  // (FS_Check leaves it booted)
+  if(check) {
+    FS_Check_t report;
+    int problems = FS_Check(diskfile, 1, &report);
+    if(problems < 0) {
+      printf("ERROR: can't check file system in file '%s'\n", diskfile);
+      return -1;
+    }
+    if(problems > 0) printf("repaired %d problems in '%s'\n", problems, diskfile);
+  }
+  // with -D, whole sectors written are shared with identical ones
+  if(dedup) FS_SetDedup(1);
+  last_sync = time(NULL);
+
+  int lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(sockname);
+  if(lsock < 0 || bind(lsock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(lsock, 16) < 0) {
+    printf("ERROR: can't listen on socket '%s'\n", sockname);
+    return -2;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  int i;
+  for(i=0; i<MAX_CLIENTS; i++) clients[i].sock = -1;
+  printf("serving '%s' on '%s'\n", diskfile, sockname);
+  fflush(stdout);
+
+  while(!stopping) {
+    struct pollfd pfd[MAX_CLIENTS+1];
+    int who[MAX_CLIENTS+1];
+    int n = 0;
+    pfd[n].fd = lsock; pfd[n].events = POLLIN; who[n++] = -1;
+    for(i=0; i<MAX_CLIENTS; i++) {
+      if(clients[i].sock < 0) continue;
+      pfd[n].fd = clients[i].sock; pfd[n].events = POLLIN; who[n++] = i;
+    }
+
+    // wake up in time for a held-back sync
+    int timeout = -1;
+    if(dirty && sync_pending) {
+      int left = (int)(last_sync+sync_wait()-time(NULL));
+      timeout = left > 0 ? left*1000 : 0;
+    }
+    if(poll(pfd, n, timeout) < 0) {
+      if(errno == EINTR) continue;
+      break;
+    }
+
+    for(i=1; i<n; i++) {
+      if(pfd[i].revents & (POLLIN|POLLHUP|POLLERR)) {
+        client_t* c = &clients[who[i]];
+        if(serve_request(c) < 0) drop_client(c);
+      }
+    }
+
+    if(pfd[0].revents & POLLIN) {
+      int sock = accept(lsock, NULL, NULL);
+      if(sock >= 0) {
+        for(i=0; i<MAX_CLIENTS; i++) if(clients[i].sock < 0) break;
+        if(i == MAX_CLIENTS) close(sock);
+        else {
+          clients[i].sock = sock;
+          clients[i].nfds = 0;
+          clients[i].ndds = 0;
+        }
+      }
+    }
+
+    flush(0);
+  }
+
+  // write back whatever is still outstanding before going away
+  for(i=0; i<MAX_CLIENTS; i++)
+    if(clients[i].sock >= 0) drop_client(&clients[i]);
+  close(lsock);
+  unlink(sockname);
+  sync_pending = 1;
+  if(flush(1) < 0) return -3;
+  return 0;
+}
@@ -0,0 +1,640 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// a batch command interpreter: the disk is booted once and all the
+// commands of a script (or standard input) run against it, one per
+// line; the disk is synced at the end, or every N commands with -n
+
+#define BFSZ 1024
+#define BATCH 64
+#define MAX_LINE 1024
+#define MAX_ARGS 4
+#define MAX_PATH 256
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-n N] [disk] [script]\n", prog);
+  printf("commands: ls dir | mkdir dir | touch file | cat file | rm file |\n"
+         "          rm -r path | mv from_path to_path | cp from_file to_file |\n"
+         "          rmdir dir | du path | df | defrag | dedup [on|off] |\n"
+         "          truncate file size | prealloc file size |\n"
+         "          compress file | uncompress file |\n"
+         "          import [-z] file from_unix_file |\n"
+         "          export file to_unix_file | import -r dir from_unix_dir |\n"
+         "          export -r dir to_unix_dir | sync\n");
+  exit(1);
+}
+
+static int do_ls(char* path)
+{
+  int dd = Dir_Open(path);
+  if(dd < 0) {
+    printf("ERROR: can't list '%s'\n", path);
+    return -1;
+  }
+
+  Dir_Entry_t ents[BATCH];
+  int entries, i, idx = 0;
+  while((entries = Dir_NextPlus(dd, ents, BATCH)) > 0) {
+    if(idx == 0)
+      printf("directory '%s':\n     %-15s\t%-s\t%-s\t%-s\n", path, "NAME", "INODE", "TYPE", "SIZE");
+    for(i=0; i<entries; i++, idx++)
+      printf("%-4d %-15s\t%-d\t%-s\t%-d\n", idx, ents[i].fname, ents[i].inode,
+             ents[i].type ? "dir" : "file", ents[i].size);
+  }
+  Dir_Close(dd);
+  if(entries < 0) {
+    printf("ERROR: can't list '%s'\n", path);
+    return -1;
+  }
+  if(idx == 0) printf("directory '%s': empty\n", path);
+  return 0;
+}
+
+static int do_cat(char* path)
+{
+  int fd = File_Open(path);
+  if(fd < 0) {
+    printf("ERROR: can't open file '%s'\n", path);
+    return -1;
+  }
+  char buf[BFSZ]; int sz;
+  while((sz = File_Read(fd, buf, BFSZ)) > 0)
+    fwrite(buf, 1, sz, stdout);
+  File_Close(fd);
+  if(sz < 0) {
+    printf("ERROR: can't read file '%s'\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+// read a whole unix file (at most 'max' bytes) into 'data', which has
+// room for one more; return its size, or -1 on error
+static int read_unix(char* fname, char* data, int max)
+{
+  int fd = open(fname, O_RDONLY);
+  if(fd < 0) {
+    printf("ERROR: can't open file '%s' to import\n", fname);
+    return -1;
+  }
+  int size = 0, n = 0;
+  while(size <= max && (n = read(fd, data+size, max+1-size)) > 0)
+    size += n;
+  close(fd);
+  if(n < 0) {
+    printf("ERROR: can't read file '%s'\n", fname);
+    return -1;
+  }
+  if(size > max) {
+    printf("ERROR: file '%s' is too big\n", fname);
+    return -1;
+  }
+  return size;
+}
+
+static int write_unix(char* fname, char* data, int size)
+{
+  int fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if(fd < 0) {
+    printf("ERROR: can't open file '%s' to export\n", fname);
+    return -1;
+  }
+  int done = 0, n;
+  while(done < size && (n = write(fd, data+done, size-done)) > 0)
+    done += n;
+  if(close(fd) < 0 || done < size) {
+    printf("ERROR: can't write file '%s'\n", fname);
+    return -1;
+  }
+  return 0;
+}
+
+// create a file in our file system holding 'size' bytes of 'data',
+// which is written with a single File_Write(); a compressed file is
+// switched over while still empty
+static int put_file(char* path, char* data, int size, int compressed)
+{
+  if(File_Create(path) < 0) {
+    printf("ERROR: can't create file '%s'\n", path);
+    return -1;
+  }
+  if(compressed && File_Compress(path, 1) < 0) {
+    printf("ERROR: can't compress file '%s'\n", path);
+    return -1;
+  }
+  int fd = File_Open(path);
+  if(fd < 0) {
+    printf("ERROR: can't open file '%s'\n", path);
+    return -1;
+  }
+  // the whole size is known, so the sectors are taken in one go
+  File_Preallocate(fd, size);
+  int rc = 0;
+  if(size > 0 && File_Write(fd, data, size) != size) {
+    printf("ERROR: can't write file '%s'\n", path);
+    rc = -1;
+  }
+  File_Close(fd);
+  return rc;
+}
+
+// read a whole file of our file system into 'data' (which has room
+// for MAX_COMPRESSED_FILE_SIZE bytes); return its size, or -1 on error
+static int get_file(char* path, char* data)
+{
+  int fd = File_Open(path);
+  if(fd < 0) {
+    printf("ERROR: can't open file '%s'\n", path);
+    return -1;
+  }
+  int size = File_Read(fd, data, MAX_COMPRESSED_FILE_SIZE);
+  File_Close(fd);
+  if(size < 0) printf("ERROR: can't read file '%s'\n", path);
+  return size;
+}
+
+static int do_import(char* path, char* fname, int compressed)
+{
+  static char data[MAX_COMPRESSED_FILE_SIZE+1];
+  int size = read_unix(fname, data, compressed ? MAX_COMPRESSED_FILE_SIZE : MAX_FILE_SIZE);
+  if(size < 0) return -1;
+  return put_file(path, data, size, compressed);
+}
+
+static int do_export(char* path, char* fname)
+{
+  static char data[MAX_COMPRESSED_FILE_SIZE];
+  int size = get_file(path, data);
+  if(size < 0) return -1;
+  return write_unix(fname, data, size);
+}
+
+// recursive import and export: whole trees are copied with a pool of
+// worker threads doing the unix file I/O, while this (main) thread
+// stays the only one calling into LibFS; up to MAX_INFLIGHT files are
+// kept in memory, so the host I/O of some files overlaps the file
+// system work on others
+
+#define MAX_WORKERS 8
+#define MAX_INFLIGHT 64
+
+typedef struct xfer {
+  char path[MAX_PATH];   // the file in our file system
+  char* fname;           // the unix file
+  char* data;            // the content, while in flight
+  int size;
+  int state;             // 0 while pending, 1 once loaded, -1 on error
+} xfer_t;
+
+static xfer_t* xfers;
+static int nxfers, maxxfers;
+static int next_xfer;    // the next transfer a worker picks up
+static int ready;        // the transfers handed to the workers so far (export)
+static int finished;     // the transfers completed so far
+static pthread_mutex_t xfer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t xfer_cond = PTHREAD_COND_INITIALIZER;
+
+static void add_xfer(char* path, char* fname)
+{
+  if(nxfers == maxxfers) {
+    maxxfers = maxxfers ? 2*maxxfers : 256;
+    xfers = realloc(xfers, maxxfers*sizeof(xfer_t));
+  }
+  xfer_t* x = &xfers[nxfers++];
+  strcpy(x->path, path);
+  x->fname = strdup(fname);
+  x->data = NULL;
+  x->size = 0;
+  x->state = 0;
+}
+
+static void clear_xfers()
+{
+  int i;
+  for(i=0; i<nxfers; i++) {
+    free(xfers[i].fname);
+    free(xfers[i].data);
+  }
+  nxfers = next_xfer = ready = finished = 0;
+}
+
+// join a directory and a name, in our file system or on unix; return
+// -1 if the result doesn't fit
+static int join(char* buf, int cap, char* dir, char* name)
+{
+  int len = strlen(dir);
+  int n = snprintf(buf, cap, "%s%s%s", dir, len > 0 && dir[len-1] == '/' ? "" : "/", name);
+  if(n >= cap) {
+    printf("ERROR: path '%s/%s' is too long\n", dir, name);
+    return -1;
+  }
+  return 0;
+}
+
+// worker thread for import: load unix files, in order, no further
+// ahead of the writer than MAX_INFLIGHT
+static void* import_worker(void* arg)
+{
+  for(;;) {
+    pthread_mutex_lock(&xfer_lock);
+    while(next_xfer < nxfers && next_xfer >= finished+MAX_INFLIGHT)
+      pthread_cond_wait(&xfer_cond, &xfer_lock);
+    int i = next_xfer++;
+    pthread_mutex_unlock(&xfer_lock);
+    if(i >= nxfers) return NULL;
+
+    xfer_t* x = &xfers[i];
+    char* data = malloc(MAX_FILE_SIZE+1);
+    int size = read_unix(x->fname, data, MAX_FILE_SIZE);
+
+    pthread_mutex_lock(&xfer_lock);
+    x->data = data;
+    x->size = size;
+    x->state = size < 0 ? -1 : 1;
+    pthread_cond_broadcast(&xfer_cond);
+    pthread_mutex_unlock(&xfer_lock);
+  }
+}
+
+// worker thread for export: store the files the main thread has read
+static void* export_worker(void* arg)
+{
+  for(;;) {
+    pthread_mutex_lock(&xfer_lock);
+    while(next_xfer < nxfers && next_xfer >= ready)
+      pthread_cond_wait(&xfer_cond, &xfer_lock);
+    int i = next_xfer++;
+    pthread_mutex_unlock(&xfer_lock);
+    if(i >= nxfers) return NULL;
+
+    xfer_t* x = &xfers[i];
+    if(x->state > 0 && write_unix(x->fname, x->data, x->size) < 0) x->state = -1;
+    free(x->data);
+    x->data = NULL;
+
+    pthread_mutex_lock(&xfer_lock);
+    finished++;
+    pthread_cond_broadcast(&xfer_cond);
+    pthread_mutex_unlock(&xfer_lock);
+  }
+}
+
+static int make_dir(char* path)
+{
+  if(Dir_Size(path) >= 0) return 0; // already there
+  if(Dir_Create(path) < 0) {
+    printf("ERROR: can't create diretory '%s'\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+// create the directories of the unix tree 'fname' under 'path' and
+// queue up its files
+static int scan_unix(char* path, char* fname)
+{
+  if(make_dir(path) < 0) return -1;
+  DIR* d = opendir(fname);
+  if(!d) {
+    printf("ERROR: can't open directory '%s'\n", fname);
+    return -1;
+  }
+  int rc = 0;
+  struct dirent* de;
+  while((de = readdir(d)) != NULL) {
+    if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+    char child[MAX_PATH], uchild[FILENAME_MAX];
+    struct stat st;
+    if(join(child, MAX_PATH, path, de->d_name) < 0 ||
+       join(uchild, FILENAME_MAX, fname, de->d_name) < 0) {
+      rc = -1;
+    } else if(lstat(uchild, &st) < 0) {
+      printf("ERROR: can't stat file '%s'\n", uchild);
+      rc = -1;
+    } else if(S_ISDIR(st.st_mode)) {
+      if(scan_unix(child, uchild) < 0) rc = -1;
+    } else if(S_ISREG(st.st_mode)) {
+      add_xfer(child, uchild);
+    } else {
+      printf("skipping '%s': not a regular file or directory\n", uchild);
+    }
+  }
+  closedir(d);
+  return rc;
+}
+
+// create the directories of our tree 'path' under the unix directory
+// 'fname' and queue up its files
+static int scan_fs(char* path, char* fname)
+{
+  if(mkdir(fname, 0777) < 0 && errno != EEXIST) {
+    printf("ERROR: can't create directory '%s'\n", fname);
+    return -1;
+  }
+  // collect the entries first, so that no directory is kept open
+  // while its subdirectories are scanned
+  int dd = Dir_Open(path);
+  if(dd < 0) {
+    printf("ERROR: can't list '%s'\n", path);
+    return -1;
+  }
+  Dir_Entry_t* ents = NULL;
+  int nents = 0, n;
+  do {
+    ents = realloc(ents, (nents+BATCH)*sizeof(Dir_Entry_t));
+    n = Dir_NextPlus(dd, ents+nents, BATCH);
+    if(n > 0) nents += n;
+  } while(n > 0);
+  Dir_Close(dd);
+  if(n < 0) {
+    printf("ERROR: can't list '%s'\n", path);
+    free(ents);
+    return -1;
+  }
+
+  int i, rc = 0;
+  for(i=0; i<nents; i++) {
+    char child[MAX_PATH], uchild[FILENAME_MAX];
+    if(join(child, MAX_PATH, path, ents[i].fname) < 0 ||
+       join(uchild, FILENAME_MAX, fname, ents[i].fname) < 0) rc = -1;
+    else if(ents[i].type == 1) {
+      if(scan_fs(child, uchild) < 0) rc = -1;
+    }
+    else add_xfer(child, uchild);
+  }
+  free(ents);
+  return rc;
+}
+
+static int start_workers(pthread_t* tid, void* (*worker)(void*))
+{
+  int n = sysconf(_SC_NPROCESSORS_ONLN);
+  if(n < 1) n = 1;
+  if(n > MAX_WORKERS) n = MAX_WORKERS;
+  if(n > nxfers) n = nxfers;
+  int i;
+  for(i=0; i<n; i++) pthread_create(&tid[i], NULL, worker, NULL);
+  return n;
+}
+
+static int do_import_tree(char* path, char* fname)
+{
+  // a part of the tree that can't be copied doesn't stop the rest
+  int rc = scan_unix(path, fname);
+
+  pthread_t tid[MAX_WORKERS];
+  int nworkers = start_workers(tid, import_worker);
+  int i;
+  for(i=0; i<nxfers; i++) {
+    xfer_t* x = &xfers[i];
+    pthread_mutex_lock(&xfer_lock);
+    while(x->state == 0) pthread_cond_wait(&xfer_cond, &xfer_lock);
+    pthread_mutex_unlock(&xfer_lock);
+
+    if(x->state < 0 || put_file(x->path, x->data, x->size, 0) < 0) rc = -1;
+    free(x->data);
+    x->data = NULL;
+
+    pthread_mutex_lock(&xfer_lock);
+    finished++;
+    pthread_cond_broadcast(&xfer_cond);
+    pthread_mutex_unlock(&xfer_lock);
+  }
+  for(i=0; i<nworkers; i++) pthread_join(tid[i], NULL);
+  clear_xfers();
+  return rc;
+}
+
+static int do_export_tree(char* path, char* fname)
+{
+  int rc = scan_fs(path, fname);
+
+  pthread_t tid[MAX_WORKERS];
+  int nworkers = start_workers(tid, export_worker);
+  int i;
+  for(i=0; i<nxfers; i++) {
+    xfer_t* x = &xfers[i];
+    pthread_mutex_lock(&xfer_lock);
+    while(i >= finished+MAX_INFLIGHT) pthread_cond_wait(&xfer_cond, &xfer_lock);
+    pthread_mutex_unlock(&xfer_lock);
+
+    char* data = malloc(MAX_COMPRESSED_FILE_SIZE);
+    int size = get_file(x->path, data);
+
+    pthread_mutex_lock(&xfer_lock);
+    x->data = data;
+    x->size = size;
+    x->state = size < 0 ? -1 : 1;
+    ready = i+1;
+    pthread_cond_broadcast(&xfer_cond);
+    pthread_mutex_unlock(&xfer_lock);
+  }
+  for(i=0; i<nworkers; i++) pthread_join(tid[i], NULL);
+  for(i=0; i<nxfers; i++) if(xfers[i].state < 0) rc = -1;
+  clear_xfers();
+  return rc;
+}
+
+// run one command; return 0 if it succeeded, -1 otherwise
+static int run(int argc, char* argv[], char* diskfile)
+{
+  char* cmd = argv[0];
+  if(!strcmp(cmd, "ls") && argc == 2) return do_ls(argv[1]);
+  if(!strcmp(cmd, "cat") && argc == 2) return do_cat(argv[1]);
+  if(!strcmp(cmd, "import") && argc == 3) return do_import(argv[1], argv[2], 0);
+  if(!strcmp(cmd, "import") && argc == 4 && !strcmp(argv[1], "-z")) return do_import(argv[2], argv[3], 1);
+  if(!strcmp(cmd, "export") && argc == 3) return do_export(argv[1], argv[2]);
+  if(!strcmp(cmd, "import") && argc == 4 && !strcmp(argv[1], "-r")) return do_import_tree(argv[2], argv[3]);
+  if(!strcmp(cmd, "export") && argc == 4 && !strcmp(argv[1], "-r")) return do_export_tree(argv[2], argv[3]);
+  if(!strcmp(cmd, "mkdir") && argc == 2) {
+    if(Dir_Create(argv[1]) < 0) {
+      printf("ERROR: can't create diretory '%s'\n", argv[1]);
+      return -1;
+    }
+    return 0;
+  }
+  if(!strcmp(cmd, "touch") && argc == 2) {
+    if(File_Create(argv[1]) < 0) {
+      printf("ERROR: can't create file '%s'\n", argv[1]);
+      return -1;
+    }
+    return 0;
+  }
+  if(!strcmp(cmd, "rm") && argc == 2) {
+    if(File_Unlink(argv[1]) < 0) {
+      printf("ERROR: can't remove file '%s'\n", argv[1]);
+      return -1;
+    }
+    return 0;
+  }
+  if(!strcmp(cmd, "rm") && argc == 3 && !strcmp(argv[1], "-r")) {
+    if(Dir_UnlinkTree(argv[2]) < 0) {
+      printf("ERROR: can't remove '%s'\n", argv[2]);
+      return -1;
+    }
+    return 0;
+  }
+  if(!strcmp(cmd, "du") && argc == 2) {
+    Dir_Usage_t u;
+    if(Dir_Usage(argv[1], &u) < 0) {
+      printf("ERROR: can't add up '%s'\n", argv[1]);
+      return -1;
+    }
+    printf("'%s': %d files, %d directories, %d bytes, %d sectors\n",
+           argv[1], u.files, u.dirs, u.bytes, u.sectors);
+    return 0;
+  }
+  if(!strcmp(cmd, "df") && argc == 1) {
+    FS_Stat_t st;
+    if(FS_Stat(&st) < 0) {
+      printf("ERROR: can't get the free space\n");
+      return -1;
+    }
+    printf("%d of %d inodes free, %d of %d sectors free\n",
+           st.free_inodes, st.total_inodes, st.free_sectors, st.total_sectors);
+    return 0;
+  }
+  if(!strcmp(cmd, "dedup") && argc == 1) {
+    FS_Dedup_t d;
+    if(FS_Dedup(&d) < 0) {
+      printf("ERROR: can't deduplicate\n");
+      return -1;
+    }
+    printf("shared %d of %d sectors in %d files, %d sectors freed\n",
+           d.shared, d.sectors, d.files, d.freed);
+    return 0;
+  }
+  if(!strcmp(cmd, "dedup") && argc == 2 && (!strcmp(argv[1], "on") || !strcmp(argv[1], "off"))) {
+    FS_SetDedup(!strcmp(argv[1], "on"));
+    return 0;
+  }
+  if(!strcmp(cmd, "defrag") && argc == 1) {
+    FS_Defrag_t d;
+    if(FS_Defrag(&d) < 0) {
+      printf("ERROR: can't defragment\n");
+      return -1;
+    }
+    printf("moved %d of %d fragmented inodes, score %d -> %d\n",
+           d.moved, d.fragmented, d.score_before, d.score_after);
+    return 0;
+  }
+  if((!strcmp(cmd, "truncate") || !strcmp(cmd, "prealloc")) && argc == 3) {
+    int fd = File_Open(argv[1]);
+    if(fd < 0) {
+      printf("ERROR: can't open file '%s'\n", argv[1]);
+      return -1;
+    }
+    int size = atoi(argv[2]);
+    int rc = !strcmp(cmd, "truncate") ? File_Truncate(fd, size) : File_Preallocate(fd, size);
+    File_Close(fd);
+    if(rc < 0) {
+      printf("ERROR: can't %s file '%s' to %d bytes\n", cmd, argv[1], size);
+      return -1;
+    }
+    return 0;
+  }
+  if(!strcmp(cmd, "mv") && argc == 3) {
+    if(File_Rename(argv[1], argv[2]) < 0 &&
+       (osErrno != E_NO_SUCH_FILE || Dir_Rename(argv[1], argv[2]) < 0)) {
+      printf("ERROR: can't move '%s' to '%s'\n", argv[1], argv[2]);
+      return -1;
+    }
+    return 0;
+  }
+  if(!strcmp(cmd, "cp") && argc == 3) {
+    // a clone: nothing is copied until one of the two files changes
+    if(File_Clone(argv[1], argv[2]) < 0) {
+      printf("ERROR: can't copy '%s' to '%s'\n", argv[1], argv[2]);
+      return -1;
+    }
+    return 0;
+  }
+  if((!strcmp(cmd, "compress") || !strcmp(cmd, "uncompress")) && argc == 2) {
+    if(File_Compress(argv[1], !strcmp(cmd, "compress")) < 0) {
+      printf("ERROR: can't %s file '%s'\n", cmd, argv[1]);
+      return -1;
+    }
+    return 0;
+  }
+  if(!strcmp(cmd, "rmdir") && argc == 2) {
+    if(Dir_Unlink(argv[1]) < 0) {
+      printf("ERROR: can't remove directory '%s'\n", argv[1]);
+      return -1;
+    }
+    return 0;
+  }
+  if(!strcmp(cmd, "sync") && argc == 1) {
+    if(FS_Sync() < 0) {
+      printf("ERROR: can't sync disk '%s'\n", diskfile);
+      return -1;
+    }
+    return 0;
+  }
+  printf("ERROR: bad command '%s'\n", cmd);
+  return -1;
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk", *script = NULL;
+  int every = 0; // sync every this many commands (0: only at the end)
+  int argi = 1;
+  if(argi+1 < argc && !strcmp(argv[argi], "-n")) {
+    every = atoi(argv[argi+1]);
+    argi += 2;
+  }
+  if(argc-argi > 2) usage(argv[0]);
+  if(argi < argc) diskfile = argv[argi++];
+  if(argi < argc) script = argv[argi++];
+
+  FILE* in = stdin;
+  if(script && !(in = fopen(script, "r"))) {
+    printf("ERROR: can't open script '%s'\n", script);
+    return -1;
+  }
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  char line[MAX_LINE];
+  int lineno = 0, ncmds = 0, failed = 0;
+  while(fgets(line, MAX_LINE, in)) {
+    lineno++;
+    char* args[MAX_ARGS+1];
+    int nargs = 0;
+    char* tok = strtok(line, " \t\r\n");
+    while(tok && *tok != '#' && nargs <= MAX_ARGS) {
+      args[nargs++] = tok;
+      tok = strtok(NULL, " \t\r\n");
+    }
+    if(nargs == 0) continue; // blank line or comment
+    if(nargs > MAX_ARGS || run(nargs, args, diskfile) < 0) {
+      printf("ERROR: line %d failed\n", lineno);
+      failed++;
+    }
+    ncmds++;
+    if(every > 0 && ncmds%every == 0 && FS_Sync() < 0) {
+      printf("ERROR: can't sync disk '%s'\n", diskfile);
+      return -3;
+    }
+  }
+  if(in != stdin) fclose(in);
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return failed ? -2 : 0;
+}
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// build a brand-new disk image, either empty or holding a copy of a
+// unix directory tree; the host files are read by a pool of threads
+// and the image is laid out and written in one pass (see FS_Build)
+
+#define MAX_THREADS 16
+
+// a host file whose content is still to be read into its node
+typedef struct job {
+  char* path;
+  FS_Node_t* node;
+} job_t;
+
+static job_t* jobs;
+static int njobs, maxjobs;
+static int next_job;
+static int failed;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-d from_unix_dir] disk\n", prog);
+  exit(1);
+}
+
+// fill in the directory node 'dir' with the entries of the unix
+// directory 'path'; return 0 if successful, -1 otherwise
+static int scan(char* path, FS_Node_t* dir)
+{
+  DIR* d = opendir(path);
+  if(!d) {
+    printf("ERROR: can't open directory '%s'\n", path);
+    return -1;
+  }
+
+  int cap = 0, rc = 0;
+  struct dirent* de;
+  while(rc == 0 && (de = readdir(d)) != NULL) {
+    if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+
+    char child[FILENAME_MAX];
+    snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+    struct stat st;
+    if(lstat(child, &st) < 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+      printf("skipping '%s': not a regular file or directory\n", child);
+      continue;
+    }
+    if(S_ISREG(st.st_mode) && st.st_size > MAX_FILE_SIZE) {
+      printf("ERROR: file '%s' is too big\n", child);
+      rc = -1;
+      break;
+    }
+
+    if(dir->nchildren == cap) {
+      cap = cap ? 2*cap : 16;
+      dir->children = realloc(dir->children, cap*sizeof(FS_Node_t));
+    }
+    FS_Node_t* node = &dir->children[dir->nchildren++];
+    memset(node, 0, sizeof(FS_Node_t));
+    node->name = strdup(de->d_name);
+    node->type = S_ISDIR(st.st_mode);
+    node->size = node->type ? 0 : st.st_size;
+    if(node->type) rc = scan(child, node);
+  }
+  closedir(d);
+  return rc;
+}
+
+// queue up every file below the (now complete) directory node 'dir'
+static void collect(char* path, FS_Node_t* dir)
+{
+  int i;
+  for(i=0; i<dir->nchildren; i++) {
+    FS_Node_t* node = &dir->children[i];
+    char child[FILENAME_MAX];
+    snprintf(child, sizeof(child), "%s/%s", path, node->name);
+    if(node->type) collect(child, node);
+    else if(node->size > 0) {
+      if(njobs == maxjobs) {
+        maxjobs = maxjobs ? 2*maxjobs : 256;
+        jobs = realloc(jobs, maxjobs*sizeof(job_t));
+      }
+      jobs[njobs].path = strdup(child);
+      jobs[njobs].node = node;
+      njobs++;
+    }
+  }
+}
+
+// worker thread: read queued host files until there are none left
+static void* reader(void* arg)
+{
+  for(;;) {
+    pthread_mutex_lock(&job_lock);
+    int j = failed ? njobs : next_job++;
+    pthread_mutex_unlock(&job_lock);
+    if(j >= njobs) return NULL;
+
+    FS_Node_t* node = jobs[j].node;
+    node->data = malloc(node->size);
+    int fd = open(jobs[j].path, O_RDONLY);
+    int done = 0;
+    while(fd >= 0 && done < node->size) {
+      int n = read(fd, node->data+done, node->size-done);
+      if(n <= 0) break;
+      done += n;
+    }
+    if(fd >= 0) close(fd);
+    if(done < node->size) {
+      printf("ERROR: can't read file '%s'\n", jobs[j].path);
+      pthread_mutex_lock(&job_lock);
+      failed = 1;
+      pthread_mutex_unlock(&job_lock);
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *hostdir = NULL;
+  int argi = 1;
+  if(argi+1 < argc && !strcmp(argv[argi], "-d")) {
+    hostdir = argv[argi+1];
+    argi += 2;
+  }
+  if(argc-argi != 1) usage(argv[0]);
+  diskfile = argv[argi];
+
+  FS_Node_t root;
+  memset(&root, 0, sizeof(root));
+  root.type = 1;
+  if(hostdir) {
+    if(scan(hostdir, &root) < 0) return -1;
+    collect(hostdir, &root);
+
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads < 1) nthreads = 1;
+    if(nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+    if(nthreads > njobs) nthreads = njobs;
+    pthread_t tid[MAX_THREADS];
+    int i;
+    for(i=0; i<nthreads; i++) pthread_create(&tid[i], NULL, reader, NULL);
+    for(i=0; i<nthreads; i++) pthread_join(tid[i], NULL);
+    if(failed) return -1;
+  }
+
+  if(FS_Build(diskfile, &root) < 0) {
+    printf("ERROR: can't build file system in file '%s'\n", diskfile);
+    return -2;
+  }
+  return 0;
+}
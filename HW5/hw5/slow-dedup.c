@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile;
+  if(argc > 2) usage(argv[0]);
+  if(argc == 2) diskfile = argv[1];
+  else diskfile = "default-disk";
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  FS_Dedup_t d;
+  if(FS_Dedup(&d) < 0) {
+    printf("ERROR: can't deduplicate '%s'\n", diskfile);
+    return -2;
+  }
+  printf("shared %d of %d sectors in %d files, %d sectors freed\n",
+         d.shared, d.sectors, d.files, d.freed);
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
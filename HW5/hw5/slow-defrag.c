@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile;
+  if(argc > 2) usage(argv[0]);
+  if(argc == 2) diskfile = argv[1];
+  else diskfile = "default-disk";
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  FS_Defrag_t d;
+  if(FS_Defrag(&d) < 0) {
+    printf("ERROR: can't defragment '%s'\n", diskfile);
+    return -2;
+  }
+  printf("%-20s\t%-8s\t%-8s\n", "", "BEFORE", "AFTER");
+  printf("%-20s\t%-8d\t%-8d\n", "fragmentation score", d.score_before, d.score_after);
+  printf("%-20s\t%-8d\t%-8d\n", "free extents", d.free_extents_before, d.free_extents_after);
+  printf("moved %d of %d fragmented files and directories (of %d with data)\n",
+         d.moved, d.fragmented, d.inodes);
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
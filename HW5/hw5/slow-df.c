@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile;
+  if(argc > 2) usage(argv[0]);
+  if(argc == 2) diskfile = argv[1];
+  else diskfile = "default-disk";
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  // the counts come from the superblock and the index of free extents,
+  // so this is cheap enough to poll; the free inodes are only those the
+  // disk still has room to hold; nothing changes, so there is nothing
+  // to sync
+  FS_Stat_t st;
+  if(FS_Stat(&st) < 0) {
+    printf("ERROR: can't get the free space of '%s'\n", diskfile);
+    return -2;
+  }
+  printf("%-8s\t%-8s\t%-8s\t%-8s\n", "", "TOTAL", "USED", "FREE");
+  printf("%-8s\t%-8d\t%-8d\t%-8d\n", "inodes", st.total_inodes,
+         st.total_inodes-st.free_inodes, st.free_inodes);
+  printf("%-8s\t%-8d\t%-8d\t%-8d\n", "sectors", st.total_sectors,
+         st.total_sectors-st.free_sectors, st.free_sectors);
+  printf("%-8s\t%-8d\t%-8d\t%-8d\n", "bytes", st.total_sectors*SECTOR_SIZE,
+         (st.total_sectors-st.free_sectors)*SECTOR_SIZE, st.free_sectors*SECTOR_SIZE);
+
+  printf("free extents (largest %d sectors):\n", st.largest_extent);
+  int i;
+  for(i=0; i<FS_EXTENT_BUCKETS; i++) {
+    if(st.extents[i] == 0) continue;
+    if(i == FS_EXTENT_BUCKETS-1) printf("  %6d+ sectors\t%d\n", 1<<i, st.extents[i]);
+    else printf("  %6d-%-6d sectors\t%d\n", 1<<i, (2<<i)-1, st.extents[i]);
+  }
+  return 0;
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "LibFS.h"
 
 #define BFSZ 256
@@ -35,20 +36,35 @@ int main(int argc, char *argv[])
     return -3;
   }
 
+  // copy the file a run of data at a time; the holes in between are
+  // skipped over, and so become holes in the unix file as well
   char buf[BFSZ]; int sz;
-  do {
-    sz = File_Read(fd, buf, BFSZ);
-    if(sz < 0) {
-      printf("ERROR: can't read file '%s'\n", path);
+  int start = File_SeekData(fd, 0), end;
+  while(start >= 0 && (end = File_SeekHole(fd, start)) > start) {
+    if(File_Seek(fd, start) < 0 || fseek(fptr, start, SEEK_SET) < 0) {
+      printf("ERROR: can't seek in file '%s'\n", path);
       return -4;
-    } else if(sz > 0) {
+    }
+    for(; start < end; start += sz) {
+      sz = File_Read(fd, buf, end-start < BFSZ ? end-start : BFSZ);
+      if(sz <= 0) {
+	printf("ERROR: can't read file '%s'\n", path);
+	return -4;
+      }
       int wsz = fwrite(buf, 1, sz, fptr);
       if(wsz != sz) {
 	printf("ERROR: can't write file '%s'\n", fname);
 	return -5;
       }
     }
-  } while(sz > 0);
+    start = File_SeekData(fd, end);
+  }
+  // 'start' is the end of the file now; a hole at the end only shows
+  // in the size
+  if(start < 0 || fflush(fptr) != 0 || ftruncate(fileno(fptr), start) < 0) {
+    printf("ERROR: can't write file '%s'\n", fname);
+    return -5;
+  }
   
   fclose(fptr);
   File_Close(fd);
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "LibDisk.h"
 #include "LibFS.h"
 
 #define BFSZ 1024
@@ -40,6 +41,13 @@ int main(int argc, char *argv[])
     return -3;
   }
 
+  // reserve the sectors for the whole file before writing it piece by
+  // piece, so that it ends up in one run
+  fseek(fptr, 0, SEEK_END);
+  long fsize = ftell(fptr);
+  rewind(fptr);
+  if(fsize > 0 && fsize <= MAX_FILE_SIZE) File_Preallocate(fd, fsize);
+
   char buf[BFSZ]; 
   while(!feof(fptr)) {
     int rsz = fread(buf, 1, BFSZ, fptr);
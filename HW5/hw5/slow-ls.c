@@ -3,6 +3,8 @@
 #include <string.h>
 #include "LibFS.h"
 
+#define BATCH 64
+
 void usage(char *prog)
 {
   printf("USAGE: %s [disk] dir\n", prog);
@@ -20,30 +22,29 @@ int main(int argc, char *argv[])
     printf("ERROR: can't boot file system from file '%s'\n", diskfile);
     return -1;
   }
-  int sz = Dir_Size(path);
-  if(sz < 0) {
+  // the directory is read a batch of entries at a time, together with
+  // the type and size of each entry
+  int dd = Dir_Open(path);
+  if(dd < 0) {
     printf("ERROR: can't list '%s'\n", path);
     return -2;
-  } else if (sz == 0) {
-    printf("directory '%s': empty\n", path);
-    return 0;
   }
-  
-  char* buf = malloc(sz);
-  int entries = Dir_Read(path, buf, sz);
+
+  Dir_Entry_t ents[BATCH];
+  int entries, i, idx = 0;
+  while((entries = Dir_NextPlus(dd, ents, BATCH)) > 0) {
+    if(idx == 0)
+      printf("directory '%s':\n     %-15s\t%-s\t%-s\t%-s\n", path, "NAME", "INODE", "TYPE", "SIZE");
+    for(i=0; i<entries; i++, idx++)
+      printf("%-4d %-15s\t%-d\t%-s\t%-d\n", idx, ents[i].fname, ents[i].inode,
+             ents[i].type ? "dir" : "file", ents[i].size);
+  }
+  Dir_Close(dd);
   if(entries < 0) {
     printf("ERROR: can't list '%s'\n", path);
     return -3;
   }
-  //printf("entries return by dir_read = %d\n", entries);
-  printf("directory '%s':\n     %-15s\t%-s\n", path, "NAME", "INODE");
-  int idx = 0;
-  int i;
-  for(i=0; i<entries; i++) {
-    printf("%-4d %-15s\t%-d\n", i, &buf[idx], *(int*)&buf[idx+16]);
-    idx += 20;
-  }
-  free(buf);
+  if(idx == 0) printf("directory '%s': empty\n", path);
 
   if(FS_Sync() < 0) {
     printf("ERROR: can't sync disk '%s'\n", diskfile);